@@ -0,0 +1,359 @@
+//
+// ADCscan
+//
+// Background acquisition of the TW1, TW2 and guard readbacks. A PIT timer paces an eDMA
+// channel that writes the next channel of the scan to ADC1_HC0, starting a hardware
+// averaged conversion, and the conversion complete DMA request moves each result into a
+// ring buffer. The main loop filters the results as they arrive, every ADC_AVG samples
+// of a channel are averaged and applied to its readback with the FILTER IIR, the same
+// as the blocking reads in Update did, so the loop never waits on the ADC.
+//
+// In phase synchronous mode the free running scan is held and the step ISR uses the same
+// PIT and DMA channel to start single, not averaged, conversions at a delay after the
+// selected step. The main loop collects each result into its step bucket, see ADCsync.
+// Sampling only happens while Timer1ISR runs the waveform.
+//
+// The blocking reads used by calibration and SGRDA hold the scan while they run.
+//
+// Builds without the i.MX RT hardware fill the ring from halAnalogRead at the scan rate
+// when the results are processed.
+//
+#include <Arduino.h>
+#include <string.h>
+#include "Hal.h"
+#include "Hardware.h"
+#include "MFT.h"
+#include "Serial.h"
+#include "ADCscan.h"
+
+#if defined(__IMXRT1062__)
+#include <DMAChannel.h>
+#endif
+
+bool    adcScan = false;
+ADCsync adcSync = {false, 0, 0, 0};
+
+static uint16_t adcRing[ADC_RING];
+static uint32_t adcSum[ADC_SCAN_NUM];
+static int      adcNum[ADC_SCAN_NUM];
+static int      adcTail = 0;            // Next result to filter
+
+// Readbacks in scan order, ring entry i is from channel i % ADC_SCAN_NUM
+static ADCchan *const adcMon[ADC_SCAN_NUM]      = {&mftdata.TW1mon, &mftdata.TW2mon, &mftdata.GRDmon};
+static float   *const adcReadback[ADC_SCAN_NUM] = {&TW1readback, &TW2readback, &GRDreadback};
+
+// Adds a result to the channel's average, every ADC_AVG results update its readback
+static void ADCfilter(int ch, int counts)
+{
+  adcSum[ch] += counts;
+  if(++adcNum[ch] < ADC_AVG) return;
+  float val = Counts2Value(adcSum[ch] / ADC_AVG, adcMon[ch]);
+  *adcReadback[ch] = (1.0 - FILTER) * *adcReadback[ch] + FILTER * val;
+  adcSum[ch] = 0;
+  adcNum[ch] = 0;
+}
+
+// Adds the armed conversion's result to its step bucket and frees the ADC for the next
+static void ADCsyncCollect(int counts)
+{
+  int ch = adcSync.armChan, st = adcSync.armStep;
+
+  adcSync.sum[ch][st] += counts;
+  adcSync.num[ch][st]++;
+  ADCfilter(ch, counts);
+  adcSync.armed = false;
+}
+
+#if defined(__IMXRT1062__)
+
+// Allocated at startup with the Twave DMA channels so the sequence channel gets a low
+// number, the periodic PIT trigger is only available on DMA channels 0 through 3.
+DMAChannel adcSeqDMA;
+DMAChannel adcResultDMA;
+static IMXRT_PIT_CHANNEL_t *adcPIT = NULL;
+static uint32_t adcSeq[ADC_SCAN_NUM];   // ADC1_HC0 channel selects in scan order
+static uint32_t adcScanTCD[8];          // Scan sequence descriptor saved in synchronous mode
+
+#define ADC_PITLD (24 * ADC_UPDATE / ADC_CONV - 1)
+
+// Returns the ring entry the DMA writes next
+static int ADCscanHead(void)
+{
+  return adcResultDMA.TCD->BITER - adcResultDMA.TCD->CITER;
+}
+
+// Starts the scan, returns false if the DMA channel or its PIT timer is not avaliable
+// and the readbacks are left to the blocking reads.
+bool ADCscanBegin(void)
+{
+  if(adcSeqDMA.channel > 3) return false;
+  CCM_CCGR1 |= CCM_CCGR1_PIT(CCM_CCGR_ON);
+  PIT_MCR = 1;
+  adcPIT = IMXRT_PIT_CHANNELS + adcSeqDMA.channel;
+  if(adcPIT->TCTRL != 0) return false;
+  // Let the core map each pin to its ADC1 input
+  for(int i=0;i<ADC_SCAN_NUM;i++)
+  {
+    halAnalogRead(adcMon[i]->Chan);
+    adcSeq[i] = ADC1_HC0 & 0x1F;
+  }
+  // 32 sample hardware averaging and a DMA request on each conversion complete
+  ADC1_CFG = (ADC1_CFG & ~ADC_CFG_AVGS(3)) | ADC_CFG_AVGS(3);
+  ADC1_GC |= ADC_GC_AVGE | ADC_GC_DMAEN;
+  // Results, 16 bits from R0 to the ring, wraps at the end
+  adcResultDMA.disable();
+  adcResultDMA.TCD->SADDR    = &ADC1_R0;
+  adcResultDMA.TCD->SOFF     = 0;
+  adcResultDMA.TCD->ATTR     = DMA_TCD_ATTR_SSIZE(1) | DMA_TCD_ATTR_DSIZE(1);
+  adcResultDMA.TCD->NBYTES   = 2;
+  adcResultDMA.TCD->SLAST    = 0;
+  adcResultDMA.TCD->DADDR    = adcRing;
+  adcResultDMA.TCD->DOFF     = 2;
+  adcResultDMA.TCD->CITER    = adcResultDMA.TCD->BITER = ADC_RING;
+  adcResultDMA.TCD->DLASTSGA = -(int32_t)sizeof(adcRing);
+  adcResultDMA.TCD->CSR      = 0;
+  adcResultDMA.triggerAtHardwareEvent(DMAMUX_SOURCE_ADC1);
+  // Sequence, the next channel select to HC0 each PIT period
+  adcSeqDMA.disable();
+  adcSeqDMA.TCD->SADDR       = adcSeq;
+  adcSeqDMA.TCD->SOFF        = 4;
+  adcSeqDMA.TCD->ATTR        = DMA_TCD_ATTR_SSIZE(2) | DMA_TCD_ATTR_DSIZE(2);
+  adcSeqDMA.TCD->NBYTES      = 4;
+  adcSeqDMA.TCD->SLAST       = -(int32_t)sizeof(adcSeq);
+  adcSeqDMA.TCD->DADDR       = &ADC1_HC0;
+  adcSeqDMA.TCD->DOFF        = 0;
+  adcSeqDMA.TCD->CITER       = adcSeqDMA.TCD->BITER = ADC_SCAN_NUM;
+  adcSeqDMA.TCD->DLASTSGA    = 0;
+  adcSeqDMA.TCD->CSR         = 0;
+  volatile uint32_t *mux = &DMAMUX_CHCFG0 + adcSeqDMA.channel;
+  *mux = 0;
+  *mux = DMAMUX_CHCFG_ENBL | DMAMUX_CHCFG_TRIG | DMAMUX_CHCFG_A_ON;
+  adcResultDMA.enable();
+  adcSeqDMA.enable();
+  // The PIT runs with no interrupt, it only paces the sequence channel
+  adcPIT->TCTRL = 0;
+  adcPIT->LDVAL = ADC_PITLD;
+  adcPIT->TCTRL = PIT_TCTRL_TEN;
+  adcScan = true;
+  return true;
+}
+
+// Holds the scan so analogRead can use ADC1, the conversion in progress is allowed to
+// finish so the ring stays in step with the sequence.
+void ADCscanHold(bool hold)
+{
+  if(!adcScan) return;
+  if(adcSync.enabled)
+  {
+    adcSync.hold = hold;
+    if(!hold) return;
+    while(adcSync.armed && ((ADC1_HS & ADC_HS_COCO0) == 0));
+    if(adcSync.armed) ADCsyncCollect(ADC1_R0);
+    return;
+  }
+  if(hold)
+  {
+    adcSeqDMA.disable();
+    while((ADC1_GS & ADC_GS_ADACT) != 0);
+    while((ADC1_HS & ADC_HS_COCO0) != 0);
+    adcResultDMA.disable();
+    ADC1_GC &= ~ADC_GC_DMAEN;
+  }
+  else
+  {
+    ADC1_GC |= ADC_GC_DMAEN;
+    adcResultDMA.enable();
+    adcSeqDMA.enable();
+  }
+}
+
+// Holds the scan and sets the sequence channel up for one conversion per trigger.
+// Returns false if the scan is not running.
+bool ADCsyncBegin(void)
+{
+  if(!adcScan) return false;
+  if(adcSync.enabled) return true;
+  ADCscanHold(true);
+  memcpy(adcScanTCD, (void *)adcSeqDMA.TCD, sizeof(adcScanTCD));
+  // Single conversions so the sample is taken at the delay
+  ADC1_GC &= ~ADC_GC_AVGE;
+  adcSeqDMA.TCD->SLAST = 0;
+  adcSeqDMA.TCD->CITER = adcSeqDMA.TCD->BITER = 1;
+  adcSeqDMA.TCD->CSR   = DMA_TCD_CSR_DREQ;
+  adcSync.armed = false;
+  adcSync.hold = false;
+  adcSync.enabled = true;
+  return true;
+}
+
+// Returns to the free running scan, the armed conversion is collected first
+void ADCsyncEnd(void)
+{
+  if(!adcSync.enabled) return;
+  ADCscanHold(true);
+  adcSync.enabled = false;
+  adcSync.hold = false;
+  adcSeqDMA.disable();
+  memcpy((void *)adcSeqDMA.TCD, adcScanTCD, sizeof(adcScanTCD));
+  ADC1_GC |= ADC_GC_AVGE;
+  adcPIT->TCTRL = 0;
+  adcPIT->LDVAL = ADC_PITLD;
+  adcPIT->TCTRL = PIT_TCTRL_TEN;
+  ADCscanHold(false);
+}
+
+// Called by the step ISR after step is latched, starts a conversion after the delay if
+// the ADC is free and this step is sampled. The PIT restarts from the delay and its
+// trigger runs the sequence channel once.
+void ADCsyncStep(int step)
+{
+  if(adcSync.hold || adcSync.armed || (step >= ADC_STEPS)) return;
+  if((adcSync.step >= 0) && (step != adcSync.step)) return;
+  adcSync.armStep = step;
+  adcSync.armChan = adcSync.chan;
+  if(++adcSync.chan >= ADC_SCAN_NUM) adcSync.chan = 0;
+  adcSync.armed = true;
+  adcSeqDMA.TCD->SADDR = &adcSeq[adcSync.armChan];
+  adcSeqDMA.enable();
+  adcPIT->TCTRL = 0;
+  adcPIT->LDVAL = adcSync.ticks;
+  adcPIT->TCTRL = PIT_TCTRL_TEN;
+}
+
+// Collects the armed conversion's result when it is done
+static void ADCsyncPoll(void)
+{
+  if(adcSync.armed && ((ADC1_HS & ADC_HS_COCO0) != 0)) ADCsyncCollect(ADC1_R0);
+}
+
+#else
+
+static uint32_t adcStart;
+static uint32_t adcDone;                // Conversions since the scan started
+static int      adcHead = 0;
+static int      adcSyncCounts;          // Armed conversion's result, read when armed
+
+// Converts the channels that are due since the last call, as the DMA would have
+static int ADCscanHead(void)
+{
+  uint32_t due = (uint64_t)(halMicros() - adcStart) * ADC_CONV / ADC_UPDATE;
+
+  // A full ring would look empty, keep the newest results that fit
+  if(due - adcDone > ADC_RING - ADC_SCAN_NUM) adcDone = due - (ADC_RING - ADC_SCAN_NUM);
+  for(;adcDone != due;adcDone++)
+  {
+    adcRing[adcHead] = halAnalogRead(adcMon[adcHead % ADC_SCAN_NUM]->Chan);
+    if(++adcHead >= ADC_RING) adcHead = 0;
+  }
+  return adcHead;
+}
+
+bool ADCscanBegin(void)
+{
+  adcStart = halMicros();
+  adcDone = 0;
+  adcScan = true;
+  return true;
+}
+
+void ADCscanHold(bool hold)
+{
+  if(!adcSync.enabled) return;
+  adcSync.hold = hold;
+  if(hold && adcSync.armed) ADCsyncCollect(adcSyncCounts);
+}
+
+bool ADCsyncBegin(void)
+{
+  if(!adcScan) return false;
+  adcSync.armed = false;
+  adcSync.hold = false;
+  adcSync.enabled = true;
+  return true;
+}
+
+void ADCsyncEnd(void)
+{
+  if(!adcSync.enabled) return;
+  ADCscanHold(true);
+  adcSync.enabled = false;
+  adcSync.hold = false;
+  // Restart the scan timing from now
+  adcStart = halMicros();
+  adcDone = 0;
+}
+
+// The conversion is done when the step is latched, there is no delay
+void ADCsyncStep(int step)
+{
+  if(adcSync.hold || adcSync.armed || (step >= ADC_STEPS)) return;
+  if((adcSync.step >= 0) && (step != adcSync.step)) return;
+  adcSync.armStep = step;
+  adcSync.armChan = adcSync.chan;
+  if(++adcSync.chan >= ADC_SCAN_NUM) adcSync.chan = 0;
+  adcSyncCounts = halAnalogRead(adcMon[adcSync.armChan]->Chan);
+  adcSync.armed = true;
+}
+
+static void ADCsyncPoll(void)
+{
+  if(adcSync.armed) ADCsyncCollect(adcSyncCounts);
+}
+
+#endif
+
+// Sets the step to sample, -1 for all, and the delay after the step is latched in uS.
+// The delay used is clamped to the limit so the sample stays in its step.
+void ADCsyncSet(int step, int delay)
+{
+  int d = delay < adcSync.limit ? delay : adcSync.limit;
+
+  adcSync.step = step;
+  adcSync.delay = delay;
+  adcSync.ticks = d > 0 ? 24 * d - 1 : 0;
+}
+
+// Sets the largest delay for the step period, the step timing calls this when the
+// frequency changes
+void ADCsyncLimit(int limit)
+{
+  adcSync.limit = limit > 0 ? limit : 0;
+  ADCsyncSet(adcSync.step, adcSync.delay);
+}
+
+// Empties the step buckets
+void ADCsyncClear(void)
+{
+  memset(adcSync.sum, 0, sizeof(adcSync.sum));
+  memset(adcSync.num, 0, sizeof(adcSync.num));
+}
+
+// Returns the average of a channel's step bucket in engineering units, false if the
+// bucket is empty
+bool ADCsyncValue(int ch, int step, float *val)
+{
+  if(adcSync.num[ch][step] == 0) return false;
+  *val = ((float)adcSync.sum[ch][step] / adcSync.num[ch][step] - adcMon[ch]->b) / adcMon[ch]->m;
+  return true;
+}
+
+// Filters the results written since the last call, returns false if the scan is not
+// running.
+bool ADCscanProcess(void)
+{
+  int head;
+
+  if(!adcScan) return false;
+  if(adcSync.enabled)
+  {
+    ADCsyncPoll();
+    return true;
+  }
+  head = ADCscanHead();
+  while(adcTail != head)
+  {
+    ADCfilter(adcTail % ADC_SCAN_NUM, adcRing[adcTail]);
+    if(++adcTail >= ADC_RING) adcTail = 0;
+  }
+  return true;
+}
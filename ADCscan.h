@@ -0,0 +1,46 @@
+#ifndef ADCscan_h
+#define ADCscan_h
+#include <stdint.h>
+
+#define ADC_SCAN_NUM  3                         // Scanned readbacks, TW1, TW2 and guard
+#define ADC_AVG       20                        // Samples averaged per filter update
+#define ADC_UPDATE    25000                     // uS between filter updates
+#define ADC_CONV      (ADC_AVG * ADC_SCAN_NUM)  // Conversions per filter update
+#define ADC_RING      (ADC_SCAN_NUM * 64)       // Result ring size, a multiple of ADC_SCAN_NUM
+#define ADC_STEPS     8                         // Twave steps sampled, the first 8 frames of a cycle
+
+// Phase synchronous sampling. The step ISR starts one conversion a delay after the
+// selected step is latched, each result is added to its channel and step bucket and
+// to the readback filter. The channels are sampled in turn, one per armed step.
+typedef struct
+{
+  bool              enabled;
+  int               step;                       // Step index to sample, -1 for every step
+  int               delay;                      // uS from the step latch to the sample
+  int               limit;                      // Largest delay for the step period, uS
+  uint32_t          ticks;                      // Delay in PIT ticks
+  volatile bool     hold;                       // Set while the blocking reads use the ADC
+  volatile bool     armed;                      // A conversion is waiting or in progress
+  volatile uint8_t  armStep;                    // Step and channel of the armed conversion
+  volatile uint8_t  armChan;
+  uint8_t           chan;                       // Next channel to sample
+  uint32_t          sum[ADC_SCAN_NUM][ADC_STEPS];
+  uint32_t          num[ADC_SCAN_NUM][ADC_STEPS];
+} ADCsync;
+
+extern bool    adcScan;
+extern ADCsync adcSync;
+
+// Function prototypes
+bool ADCscanBegin(void);
+void ADCscanHold(bool hold);
+bool ADCscanProcess(void);
+void ADCsyncSet(int step, int delay);
+void ADCsyncLimit(int limit);
+bool ADCsyncBegin(void);
+void ADCsyncEnd(void);
+void ADCsyncStep(int step);
+void ADCsyncClear(void);
+bool ADCsyncValue(int ch, int step, float *val);
+
+#endif
@@ -336,8 +336,33 @@ class _AtomicInline {
     The operation depends on the value of '_Atomic'.
 *********************************************************************/
 
+/**** MFT host build. ****/
+#if defined( MFT_HOST )
+
+/*********************************************************************
+  The host build runs the mock interrupts on the calling thread,
+  nothing can interrupt a block so it does no work.
+*********************************************************************/
+
+_INLINE_ void GlobalInterruptsOff( void )         {
+  return;
+}
+_INLINE_ void GlobalInterruptsOn( void )          {
+  return;
+}
+
+template< bool _Atomic, bool _SafeRestore = false >
+struct Atomic_RestoreState {
+  _INLINE_ Atomic_RestoreState( void )  {
+    return;
+  }
+  _INLINE_ ~Atomic_RestoreState( void ) {
+    return;
+  }
+};
+
 /**** AVR specific. ****/
-#ifdef __AVR__
+#elif defined( __AVR__ )
 #include <avr/io.h>
 
 /*** GlobalInterrupts On/Off function prototypes must not change. ***/
@@ -83,4 +83,6 @@ extern int ErrorCode;
 #define ERR_ADCNOTAVALIABLE         124     // ADC interface in use and not avaliable at this time
 #define ERR_ADCALREARYSETUP         125     // ADC interface is already setup
 #define ERR_ADCNOTSETUP             126     // ADC interface is not setup
+#define ERR_BADCRC                  127     // Binary command frame CRC error
+#define ERR_LINETOOLONG             128     // Command line does not fit in the receive buffer
 #endif
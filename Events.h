@@ -0,0 +1,83 @@
+#ifndef Events_h
+#define Events_h
+//
+// Interrupt to main loop event queues. The trigger, clock, table and step ISRs do the
+// time critical work themselves and queue a timestamped event for anything slow, the
+// command strings, that the main loop then runs in order. Each ISR has
+// its own single producer, single consumer ring so no locking is needed, only the ISR
+// writes head and only the main loop writes tail. An event that does not fit is counted
+// as an overflow.
+//
+#include <stdint.h>
+#include "Hal.h"
+
+#define EVQ_SIZE    32          // Events per queue, must be a power of 2
+
+// Event sources, one queue each
+enum EventSources
+{
+  EVQ_TRIG1,
+  EVQ_TRIG2,
+  EVQ_CLOCK,
+  EVQ_STEP,
+  EVQ_NUM
+};
+
+enum EventActions
+{
+  EV_CMD                        // Run the active command string
+};
+
+typedef struct
+{
+  uint32_t  time;               // uS timestamp
+  uint8_t   action;
+  uint8_t   chan;
+  uint8_t   state;
+} Event;
+
+typedef struct
+{
+  Event     buf[EVQ_SIZE];
+  uint32_t  head;               // Written by the ISR
+  uint32_t  tail;               // Written by the main loop
+  uint32_t  overflows;          // Events lost because the queue was full
+} EventQueue;
+
+extern EventQueue eventQueues[EVQ_NUM];
+
+// Queues an event, only called from the queue's ISR
+inline void EventPush(EventQueue *q, uint8_t action, uint8_t chan, uint8_t state)
+{
+  uint32_t head = q->head;
+  Event    *e;
+
+  if(head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= EVQ_SIZE)
+  {
+    q->overflows++;
+    return;
+  }
+  e = &q->buf[head & (EVQ_SIZE - 1)];
+  e->time = halMicros();
+  e->action = action;
+  e->chan = chan;
+  e->state = state;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the oldest event in the queue without removing it, NULL if it is empty
+inline Event *EventPeek(EventQueue *q)
+{
+  uint32_t tail = q->tail;
+
+  if(__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail) return NULL;
+  return &q->buf[tail & (EVQ_SIZE - 1)];
+}
+
+// Removes the oldest event, only called from the main loop
+inline void EventPop(EventQueue *q)
+{
+  __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
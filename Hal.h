@@ -0,0 +1,288 @@
+#ifndef Hal_h
+#define Hal_h
+//
+// Hardware abstraction layer. The firmware core reaches the Teensy peripherals only
+// through these functions. For the MFT hardware they are inline wrappers around the
+// Teensyduino libraries so there is no added cost. Defining MFT_HOST selects the mock
+// backends in HalHost.cpp so the core can be run and tested on a workstation.
+//
+#include <stdint.h>
+#include <stddef.h>
+
+// Heap allocator calls since reset, used to check the command path does not allocate
+extern uint32_t halHeapCalls;
+
+#if defined(MFT_HOST)
+
+#define HAL_PINS      64
+#define HAL_EEPROM    4096
+
+#define HAL_STEP_CLOCK     150000000    // Step timer ticks per second, before the prescale
+#define HAL_STEP_MAXTICKS  65536
+#define HAL_SPLIT_CLOCK    24000000     // Split step timer ticks per second
+
+// Mock hardware state, host test code reads and drives these directly
+typedef struct
+{
+  uint8_t   mode[HAL_PINS];             // Pin modes
+  uint8_t   level[HAL_PINS];            // Pin levels
+  void      (*pinISR[HAL_PINS])(void);  // Attached pin interrupts
+  uint8_t   pinEdge[HAL_PINS];          // Edge of each pin interrupt, RISING, FALLING or CHANGE
+  int       adc[HAL_PINS];              // Counts returned by halAnalogRead for each channel
+  uint32_t  spiShift;                   // Last 32 bits shifted out on SPI
+  uint32_t  spiWords;                   // 16 bit SPI words sent
+  int       i2cAddr;                    // Last I2C transaction
+  uint8_t   i2cBuf[8];
+  int       i2cLen;
+  uint32_t  i2cWrites;                  // I2C transactions sent
+  uint32_t  stepPeriod;                 // Step timer period in nS
+  uint64_t  stepLeft;                   // Time left in the period when the step timer stopped
+  bool      stepRunning;
+  void      (*stepISR)(void);
+  uint32_t  clockPeriod;                // Clock timer period in uS, 0 if stopped
+  void      (*clockISR)(void);
+  uint8_t   eeprom[HAL_EEPROM];
+  uint64_t  ns;                         // Virtual time in nS, advanced by the delays and timers
+  uint64_t  stepNext;                   // Time of the next step timer interrupt
+  uint64_t  clockNext;                  // Time of the next clock timer interrupt
+  bool      tableRunning;               // Table timer compare interrupt enabled
+  void      (*tableISR)(void);
+  uint64_t  tableNext;                  // Time of the table timer compare
+  bool      rampRunning;                // Ramp timer compare interrupt enabled
+  void      (*rampISR)(void);
+  uint64_t  rampNext;                   // Time of the ramp timer compare
+  bool      splitRunning;               // Split step timer compare interrupt enabled
+  void      (*splitISR)(void);
+  uint64_t  splitNext;                  // Time of the split step timer compare
+  uint32_t  pulsePeriod;                // Pulse timer period in uS, 0 if stopped
+  void      (*pulseISR)(void);
+  uint64_t  pulseNext;                  // Time of the next pulse timer interrupt
+  bool      reset;                      // Set by halReset
+  // Optional hooks, used by the simulator to trace output activity
+  void      (*onPinWrite)(int pin, int level);
+  void      (*onI2Cwrite)(int addr, const uint8_t *buf, int len);
+} HalHost;
+
+extern HalHost halHost;
+
+void halPinMode(int pin, int mode);
+void halDigitalWrite(int pin, int val);
+int  halDigitalRead(int pin);
+void halAnalogResolution(int bits);
+int  halAnalogRead(int chan);
+void halDelay(uint32_t ms);
+void halDelayMicroseconds(uint32_t us);
+uint32_t halMicros(void);
+void halSPIbegin(void);
+void halSPItransfer16(uint16_t val);
+void halI2Cbegin(void);
+void halI2Cwrite(int addr, const uint8_t *buf, int len);
+void halStepTimerBegin(uint32_t period_uS);
+void halStepTimerPeriod(uint32_t period_uS);
+void halStepTimerTicks(uint32_t ticks, int prescale);
+void halStepTimerAttach(void (*isr)(void));
+void halStepTimerStart(void);
+void halStepTimerRestart(void);
+void halStepTimerStop(void);
+void halClockTimerBegin(void (*isr)(void), uint32_t period_uS);
+void halClockTimerEnd(void);
+void halPulseTimerBegin(void (*isr)(void), uint32_t period_uS);
+void halPulseTimerEnd(void);
+void halTableTimerBegin(void (*isr)(void));
+uint32_t halTableTimerNow(void);
+void halTableTimerAt(uint32_t t);
+void halTableTimerStop(void);
+void halRampTimerBegin(void (*isr)(void));
+uint32_t halRampTimerNow(void);
+void halRampTimerAt(uint32_t t);
+void halRampTimerStop(void);
+void halSplitTimerBegin(void (*isr)(void));
+uint32_t halSplitTimerNow(void);
+void halSplitTimerAt(uint32_t t);
+void halSplitTimerStop(void);
+void halAttachInterrupt(int pin, void (*isr)(void), int mode);
+void halDetachInterrupt(int pin);
+void halEEPROMread(int addr, void *buf, int len);
+void halEEPROMwrite(int addr, const void *buf, int len);
+void halReset(void);
+
+// Host test helpers
+void halHostSetPin(int pin, int level);
+void halHostSteps(int num);
+void halHostClockTicks(int num);
+void halHostTableEvents(int num);
+void halHostRampEvents(int num);
+void halHostSplitEvents(int num);
+void halHostPulseEvents(int num);
+
+// Simulator, HalSim.cpp
+bool halSimOpen(const char *fileName, bool binary);
+void halSimClose(void);
+bool halSimTrigger(int pin, int level, uint64_t ns);
+void halSimRun(uint64_t ns, void (*idle)(void) = NULL);
+
+#else
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <Wire.h>
+#include <EEPROM.h>
+#include <TimerOne.h>
+#include "AtomicBlock.h"
+
+extern IntervalTimer halClockTimer;
+extern IntervalTimer halPulseTimer;
+// GPT2 compare ISRs, Hardware.ino
+extern void (*halTableISR)(void);
+extern void (*halRampISR)(void);
+void halGPT2begin(void);
+
+// GPIO
+inline void halPinMode(int pin, int mode)       { pinMode(pin, mode); }
+inline void halDigitalWrite(int pin, int val)   { digitalWrite(pin, val); }
+inline int  halDigitalRead(int pin)             { return digitalRead(pin); }
+// ADC
+inline void halAnalogResolution(int bits)       { analogReadResolution(bits); analogWriteResolution(bits); }
+inline int  halAnalogRead(int chan)             { return analogRead(chan); }
+// Delays
+inline void halDelay(uint32_t ms)               { delay(ms); }
+inline void halDelayMicroseconds(uint32_t us)   { delayMicroseconds(us); }
+inline uint32_t halMicros(void)                 { return micros(); }
+// SPI, setup for the MAX14802 chain, 20MHz mode 2
+inline void halSPIbegin(void)                   { SPI.begin(); SPI.beginTransaction(SPISettings(20000000, MSBFIRST, SPI_MODE2)); }
+inline void halSPItransfer16(uint16_t val)      { SPI.transfer16(val); }
+// I2C
+inline void halI2Cbegin(void)                   { Wire.begin(); }
+inline void halI2Cwrite(int addr, const uint8_t *buf, int len)
+{
+  Wire.beginTransmission(addr);
+  Wire.write(buf, len);
+  Wire.endTransmission();
+}
+// Step timer, Timer1
+inline void halStepTimerBegin(uint32_t period_uS)   { Timer1.initialize(period_uS); }
+inline void halStepTimerPeriod(uint32_t period_uS)  { Timer1.setPeriod(period_uS); }
+// Timer1 is FlexPWM1 submodule 3 counting bus clocks from INIT to VAL1. Sets the period
+// to ticks bus clocks divided by 2^prescale, up to HAL_STEP_MAXTICKS. The new period is
+// loaded at the end of the current one so the step timing stays continuous.
+#define HAL_STEP_CLOCK     F_BUS_ACTUAL
+#define HAL_STEP_MAXTICKS  65536
+inline void halStepTimerTicks(uint32_t ticks, int prescale)
+{
+  FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_CLDOK(8);
+  FLEXPWM1_SM3CTRL = FLEXPWM_SMCTRL_FULL | FLEXPWM_SMCTRL_PRSC(prescale);
+  FLEXPWM1_SM3INIT = -(int32_t)(ticks / 2);
+  FLEXPWM1_SM3VAL1 = ticks - ticks / 2 - 1;
+  FLEXPWM1_MCTRL |= FLEXPWM_MCTRL_LDOK(8);
+}
+inline void halStepTimerAttach(void (*isr)(void))   { Timer1.attachInterrupt(isr); }
+inline void halStepTimerStart(void)                 { Timer1.start(); }
+inline void halStepTimerStop(void)                  { Timer1.stop(); }
+// Timer1.start does not reload the counter, this stops the timer, forces the SM3
+// counter to INIT and clears a pending reload so the next interrupt is a full period out
+inline void halStepTimerRestart(void)
+{
+  Timer1.stop();
+  FLEXPWM1_SM3CTRL2 |= FLEXPWM_SMCTRL2_FRCEN | FLEXPWM_SMCTRL2_FORCE;
+  FLEXPWM1_SM3STS = FLEXPWM_SMSTS_RF;
+  Timer1.resume();
+}
+// Clock timer, IntervalTimer
+inline void halClockTimerBegin(void (*isr)(void), uint32_t period_uS) { halClockTimer.begin(isr, period_uS); }
+inline void halClockTimerEnd(void)                  { halClockTimer.end(); }
+// Pulse timer, IntervalTimer. Used as a one shot, the ISR ends it
+inline void halPulseTimerBegin(void (*isr)(void), uint32_t period_uS) { halPulseTimer.begin(isr, period_uS); }
+inline void halPulseTimerEnd(void)                  { halPulseTimer.end(); }
+// Table timer, GPT2 free running at 1MHz from the 24MHz oscillator. The compare interrupt
+// fires when the count reaches the time set by halTableTimerAt, the ISR clears it with
+// halTableTimerAt or halTableTimerStop. The ramp timer uses the second compare.
+inline void halTableTimerBegin(void (*isr)(void))
+{
+  halTableISR = isr;
+  halGPT2begin();
+}
+inline uint32_t halTableTimerNow(void)              { return GPT2_CNT; }
+inline void halTableTimerAt(uint32_t t)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  GPT2_OCR1 = t;
+  GPT2_SR = GPT_SR_OF1;
+  GPT2_IR |= GPT_IR_OF1IE;
+  asm volatile("dsb");
+}
+inline void halTableTimerStop(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  GPT2_IR &= ~GPT_IR_OF1IE;
+  GPT2_SR = GPT_SR_OF1;
+  asm volatile("dsb");
+}
+// Ramp timer, GPT2 compare 2, works the same as the table timer
+inline void halRampTimerBegin(void (*isr)(void))
+{
+  halRampISR = isr;
+  halGPT2begin();
+}
+inline uint32_t halRampTimerNow(void)               { return GPT2_CNT; }
+inline void halRampTimerAt(uint32_t t)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  GPT2_OCR2 = t;
+  GPT2_SR = GPT_SR_OF2;
+  GPT2_IR |= GPT_IR_OF2IE;
+  asm volatile("dsb");
+}
+inline void halRampTimerStop(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  GPT2_IR &= ~GPT_IR_OF2IE;
+  GPT2_SR = GPT_SR_OF2;
+  asm volatile("dsb");
+}
+// Split step timer, GPT1 free running at 24MHz, used when TW1 and TW2 have their own
+// step clocks. Works the same as the table timer.
+#define HAL_SPLIT_CLOCK    24000000
+inline void halSplitTimerBegin(void (*isr)(void))
+{
+  CCM_CCGR1 |= CCM_CCGR1_GPT1_BUS(CCM_CCGR_ON) | CCM_CCGR1_GPT1_SERIAL(CCM_CCGR_ON);
+  GPT1_CR = 0;
+  GPT1_IR = 0;
+  GPT1_PR = 0;
+  GPT1_SR = 0x3F;
+  GPT1_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_FRR | GPT_CR_ENMOD;
+  GPT1_CR |= GPT_CR_EN;
+  attachInterruptVector(IRQ_GPT1, isr);
+  NVIC_ENABLE_IRQ(IRQ_GPT1);
+}
+inline uint32_t halSplitTimerNow(void)              { return GPT1_CNT; }
+inline void halSplitTimerAt(uint32_t t)
+{
+  GPT1_OCR1 = t;
+  GPT1_SR = GPT_SR_OF1;
+  GPT1_IR = GPT_IR_OF1IE;
+  asm volatile("dsb");
+}
+inline void halSplitTimerStop(void)
+{
+  GPT1_IR = 0;
+  GPT1_SR = GPT_SR_OF1;
+  asm volatile("dsb");
+}
+// Pin interrupts
+inline void halAttachInterrupt(int pin, void (*isr)(void), int mode) { attachInterrupt(digitalPinToInterrupt(pin), isr, mode); }
+inline void halDetachInterrupt(int pin)             { detachInterrupt(digitalPinToInterrupt(pin)); }
+// EEPROM, only changed bytes are written
+inline void halEEPROMread(int addr, void *buf, int len)
+{
+  for(int i=0;i<len;i++) ((uint8_t *)buf)[i] = EEPROM.read(addr + i);
+}
+inline void halEEPROMwrite(int addr, const void *buf, int len)
+{
+  for(int i=0;i<len;i++) EEPROM.update(addr + i, ((const uint8_t *)buf)[i]);
+}
+// System reboot
+inline void halReset(void)                          { SCB_AIRCR = 0x05FA0004; }
+
+#endif
+
+#endif
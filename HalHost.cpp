@@ -0,0 +1,300 @@
+//
+// HalHost
+//
+// Mock hardware backends used when the firmware core is built for a workstation with
+// MFT_HOST defined. The peripherals are modeled as plain state in halHost that test
+// code can inspect, pin changes fire the attached interrupts and the timers are
+// advanced by the halHost helper functions.
+//
+#if defined(MFT_HOST)
+#include <Arduino.h>
+#include <string.h>
+#include "Hal.h"
+
+HalHost halHost;
+uint32_t halHeapCalls = 0;    // The host allocator is not hooked, this stays 0
+
+void halPinMode(int pin, int mode)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return;
+  halHost.mode[pin] = mode;
+}
+
+void halDigitalWrite(int pin, int val)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return;
+  val = (val != 0);
+  if((halHost.onPinWrite != NULL) && (halHost.level[pin] != val)) halHost.onPinWrite(pin, val);
+  halHost.level[pin] = val;
+}
+
+int halDigitalRead(int pin)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return 0;
+  return halHost.level[pin];
+}
+
+void halAnalogResolution(int bits) {}
+
+int halAnalogRead(int chan)
+{
+  if((chan < 0) || (chan >= HAL_PINS)) return 0;
+  return halHost.adc[chan];
+}
+
+void halDelay(uint32_t ms)              { halHost.ns += (uint64_t)ms * 1000000; }
+void halDelayMicroseconds(uint32_t us)  { halHost.ns += (uint64_t)us * 1000; }
+uint32_t halMicros(void)                { return halHost.ns / 1000; }
+
+void halSPIbegin(void) {}
+
+void halSPItransfer16(uint16_t val)
+{
+  halHost.spiShift = (halHost.spiShift << 16) | val;
+  halHost.spiWords++;
+}
+
+void halI2Cbegin(void) {}
+
+void halI2Cwrite(int addr, const uint8_t *buf, int len)
+{
+  if(len > (int)sizeof(halHost.i2cBuf)) len = sizeof(halHost.i2cBuf);
+  halHost.i2cAddr = addr;
+  memcpy(halHost.i2cBuf, buf, len);
+  halHost.i2cLen = len;
+  halHost.i2cWrites++;
+  if(halHost.onI2Cwrite != NULL) halHost.onI2Cwrite(addr, buf, len);
+}
+
+// Begin and setting the period restart the period as TimerOne does. Start resumes the
+// count where Stop left it, only Restart reloads the counter for a full period.
+void halStepTimerBegin(uint32_t period_uS)
+{
+  halHost.stepPeriod = period_uS * 1000;
+  halHost.stepRunning = true;
+  halHost.stepNext = halHost.ns + halHost.stepPeriod;
+}
+
+void halStepTimerPeriod(uint32_t period_uS)
+{
+  halHost.stepPeriod = period_uS * 1000;
+  halHost.stepNext = halHost.ns + halHost.stepPeriod;
+}
+
+// The next interrupt keeps its time, the new period starts after it
+void halStepTimerTicks(uint32_t ticks, int prescale)
+{
+  halHost.stepPeriod = (((uint64_t)ticks << prescale) * 1000000000 + HAL_STEP_CLOCK / 2) / HAL_STEP_CLOCK;
+}
+
+void halStepTimerAttach(void (*isr)(void))  { halHost.stepISR = isr; }
+
+void halStepTimerStart(void)
+{
+  if(halHost.stepRunning) return;
+  halHost.stepRunning = true;
+  halHost.stepNext = halHost.ns + (halHost.stepLeft != 0 ? halHost.stepLeft : halHost.stepPeriod);
+}
+
+void halStepTimerRestart(void)
+{
+  halHost.stepRunning = true;
+  halHost.stepNext = halHost.ns + halHost.stepPeriod;
+}
+
+void halStepTimerStop(void)
+{
+  if(!halHost.stepRunning) return;
+  halHost.stepRunning = false;
+  halHost.stepLeft = halHost.stepNext > halHost.ns ? halHost.stepNext - halHost.ns : halHost.stepPeriod;
+}
+
+void halClockTimerBegin(void (*isr)(void), uint32_t period_uS)
+{
+  halHost.clockISR = isr;
+  halHost.clockPeriod = period_uS;
+  halHost.clockNext = halHost.ns + (uint64_t)period_uS * 1000;
+}
+
+void halClockTimerEnd(void) { halHost.clockPeriod = 0; }
+
+void halPulseTimerBegin(void (*isr)(void), uint32_t period_uS)
+{
+  halHost.pulseISR = isr;
+  halHost.pulsePeriod = period_uS;
+  halHost.pulseNext = halHost.ns + (uint64_t)period_uS * 1000;
+}
+
+void halPulseTimerEnd(void) { halHost.pulsePeriod = 0; }
+
+void halTableTimerBegin(void (*isr)(void))
+{
+  halHost.tableISR = isr;
+  halHost.tableRunning = false;
+}
+
+uint32_t halTableTimerNow(void) { return halMicros(); }
+
+// Like the GPT the compare only fires when the count reaches t, a time already reached
+// fires after the count wraps
+void halTableTimerAt(uint32_t t)
+{
+  uint64_t us = halHost.ns / 1000;
+
+  halHost.tableNext = (us + (uint64_t)(uint32_t)(t - (uint32_t)us - 1) + 1) * 1000;
+  halHost.tableRunning = true;
+}
+
+void halTableTimerStop(void) { halHost.tableRunning = false; }
+
+void halRampTimerBegin(void (*isr)(void))
+{
+  halHost.rampISR = isr;
+  halHost.rampRunning = false;
+}
+
+uint32_t halRampTimerNow(void) { return halMicros(); }
+
+// The same count as the table timer, compare 2
+void halRampTimerAt(uint32_t t)
+{
+  uint64_t us = halHost.ns / 1000;
+
+  halHost.rampNext = (us + (uint64_t)(uint32_t)(t - (uint32_t)us - 1) + 1) * 1000;
+  halHost.rampRunning = true;
+}
+
+void halRampTimerStop(void) { halHost.rampRunning = false; }
+
+void halSplitTimerBegin(void (*isr)(void))
+{
+  halHost.splitISR = isr;
+  halHost.splitRunning = false;
+}
+
+uint32_t halSplitTimerNow(void) { return halHost.ns * (HAL_SPLIT_CLOCK / 1000000) / 1000; }
+
+// Works the same as the table timer compare, the time is the nS of the tick t is reached
+void halSplitTimerAt(uint32_t t)
+{
+  uint64_t ticks = halHost.ns * (HAL_SPLIT_CLOCK / 1000000) / 1000;
+
+  ticks += (uint64_t)(uint32_t)(t - (uint32_t)ticks - 1) + 1;
+  halHost.splitNext = (ticks * 1000 + (HAL_SPLIT_CLOCK / 1000000) - 1) / (HAL_SPLIT_CLOCK / 1000000);
+  halHost.splitRunning = true;
+}
+
+void halSplitTimerStop(void) { halHost.splitRunning = false; }
+
+void halAttachInterrupt(int pin, void (*isr)(void), int mode)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return;
+  halHost.pinISR[pin] = isr;
+  halHost.pinEdge[pin] = mode;
+}
+
+void halDetachInterrupt(int pin)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return;
+  halHost.pinISR[pin] = NULL;
+}
+
+void halEEPROMread(int addr, void *buf, int len)
+{
+  if((addr < 0) || (addr + len > HAL_EEPROM)) return;
+  memcpy(buf, &halHost.eeprom[addr], len);
+}
+
+void halEEPROMwrite(int addr, const void *buf, int len)
+{
+  if((addr < 0) || (addr + len > HAL_EEPROM)) return;
+  memcpy(&halHost.eeprom[addr], buf, len);
+}
+
+void halReset(void) { halHost.reset = true; }
+
+// Drives an input pin, an attached interrupt fires on a level change that matches its
+// edge
+void halHostSetPin(int pin, int level)
+{
+  if((pin < 0) || (pin >= HAL_PINS)) return;
+  level = (level != 0);
+  if(halHost.level[pin] == level) return;
+  halHost.level[pin] = level;
+  if(halHost.pinISR[pin] == NULL) return;
+  if((halHost.pinEdge[pin] == RISING) && !level) return;
+  if((halHost.pinEdge[pin] == FALLING) && level) return;
+  halHost.pinISR[pin]();
+}
+
+// Fires the step timer interrupt num times if the timer is running
+void halHostSteps(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if(!halHost.stepRunning || (halHost.stepISR == NULL)) return;
+    halHost.ns += halHost.stepPeriod;
+    halHost.stepISR();
+  }
+}
+
+// Fires the clock timer interrupt num times if the timer is running
+void halHostClockTicks(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if((halHost.clockPeriod == 0) || (halHost.clockISR == NULL)) return;
+    halHost.ns += (uint64_t)halHost.clockPeriod * 1000;
+    halHost.clockISR();
+  }
+}
+
+// Fires the table timer interrupt num times if its compare is enabled
+void halHostTableEvents(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if(!halHost.tableRunning || (halHost.tableISR == NULL)) return;
+    if(halHost.ns < halHost.tableNext) halHost.ns = halHost.tableNext;
+    halHost.tableRunning = false;
+    halHost.tableISR();
+  }
+}
+
+// Fires the ramp timer interrupt num times if its compare is enabled
+void halHostRampEvents(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if(!halHost.rampRunning || (halHost.rampISR == NULL)) return;
+    if(halHost.ns < halHost.rampNext) halHost.ns = halHost.rampNext;
+    halHost.rampRunning = false;
+    halHost.rampISR();
+  }
+}
+
+// Fires the split step timer interrupt num times if its compare is enabled
+void halHostSplitEvents(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if(!halHost.splitRunning || (halHost.splitISR == NULL)) return;
+    if(halHost.ns < halHost.splitNext) halHost.ns = halHost.splitNext;
+    halHost.splitRunning = false;
+    halHost.splitISR();
+  }
+}
+
+// Fires the pulse timer interrupt num times if the timer is running
+void halHostPulseEvents(int num)
+{
+  for(int i=0;i<num;i++)
+  {
+    if((halHost.pulsePeriod == 0) || (halHost.pulseISR == NULL)) return;
+    if(halHost.ns < halHost.pulseNext) halHost.ns = halHost.pulseNext;
+    halHost.pulseNext += (uint64_t)halHost.pulsePeriod * 1000;
+    halHost.pulseISR();
+  }
+}
+
+#endif
@@ -0,0 +1,237 @@
+//
+// HalSim
+//
+// Host simulator built on the mock backends in HalHost.cpp. Virtual time is advanced
+// from event to event and the step timers, clock timer and scheduled trigger input edges
+// fire their interrupts in time order. ISRs run in zero time except for the delays they
+// call, an interrupt that comes due while a delay runs fires late, the same as it would
+// on the hardware with interrupts blocked.
+//
+// Every MAX14802 latch, MAX5815 DAC output update, TrigOut edge and trigger input edge is written
+// to a trace file as it happens so long captures use no memory. Two formats are
+// supported, a VCD file for a waveform viewer or a compact binary record stream:
+//   header: "MFTT", uint32 version
+//   record: uint64 time in nS, uint8 signal, uint32 value, little endian, 13 bytes
+//
+#if defined(MFT_HOST)
+#include <stdio.h>
+#include <string.h>
+#include "Hal.h"
+#include "MFT.h"
+
+#define SIM_QUEUE   64
+
+// Trace signals, the VCD id character is '!' + signal number
+enum SimSignal
+{
+  SIM_TW1,
+  SIM_TW2,
+  SIM_DAC0,
+  SIM_DAC1,
+  SIM_DAC2,
+  SIM_DAC3,
+  SIM_TRIGOUT,
+  SIM_TRIG1,
+  SIM_TRIG2,
+  SIM_NUM
+};
+
+const char *simNames[SIM_NUM] = {"TW1","TW2","DAC0","DAC1","DAC2","DAC3","TrigOut","Trig1","Trig2"};
+const int   simWidth[SIM_NUM] = {16,16,16,16,16,16,1,1,1};
+
+typedef struct
+{
+  uint64_t  ns;
+  int       pin;
+  int       level;
+} SimEdge;
+
+FILE     *simFile   = NULL;
+bool      simBinary = false;
+uint64_t  simLastNS;
+SimEdge   simQueue[SIM_QUEUE];
+int       simQueued = 0;
+
+static void simTrace(int sig, uint32_t val)
+{
+  if(simFile == NULL) return;
+  if(simBinary)
+  {
+    uint8_t rec[13];
+    for(int i=0;i<8;i++) rec[i] = halHost.ns >> (8 * i);
+    rec[8] = sig;
+    for(int i=0;i<4;i++) rec[9 + i] = val >> (8 * i);
+    fwrite(rec, 1, sizeof(rec), simFile);
+    return;
+  }
+  if(halHost.ns != simLastNS)
+  {
+    fprintf(simFile, "#%llu\n", (unsigned long long)halHost.ns);
+    simLastNS = halHost.ns;
+  }
+  if(simWidth[sig] == 1) fprintf(simFile, "%d%c\n", val & 1, '!' + sig);
+  else
+  {
+    fputc('b', simFile);
+    for(int i=simWidth[sig]-1;i>=0;i--) fputc((val >> i) & 1 ? '1' : '0', simFile);
+    fprintf(simFile, " %c\n", '!' + sig);
+  }
+}
+
+// MAX5815 code registers and the channels written since the last load
+uint16_t  simDACcode[4];
+uint8_t   simDACpending = 0;
+
+// The MAX14802 outputs update on the latch rising edge, the frame is TW2 then TW1.
+// The MAX5815 loads the code registers to the outputs on the LDAC falling edge.
+static void simPinWrite(int pin, int level)
+{
+  if((pin == LTCH) && level)
+  {
+    simTrace(SIM_TW1, halHost.spiShift & 0xFFFF);
+    simTrace(SIM_TW2, halHost.spiShift >> 16);
+  }
+  else if((pin == LDAC) && !level)
+  {
+    for(int i=0;i<4;i++) if(simDACpending & (1 << i)) simTrace(SIM_DAC0 + i, simDACcode[i]);
+    simDACpending = 0;
+  }
+  else if(pin == TrigOut) simTrace(SIM_TRIGOUT, level);
+}
+
+// Decode MAX5815 code, and code and load channel commands
+static void simI2Cwrite(int addr, const uint8_t *buf, int len)
+{
+  int chn = buf[0] & 0x0F;
+
+  if(len != 3) return;
+  if(chn > 3) return;
+  if((buf[0] & 0xF0) == 0x00)
+  {
+    simDACcode[chn] = (buf[1] << 8) | buf[2];
+    simDACpending |= 1 << chn;
+  }
+  else if((buf[0] & 0xF0) == 0x30)
+  {
+    simDACcode[chn] = (buf[1] << 8) | buf[2];
+    simDACpending &= ~(1 << chn);
+    simTrace(SIM_DAC0 + chn, simDACcode[chn]);
+  }
+}
+
+// Opens the trace file and installs the trace hooks, returns false if the file
+// can't be created
+bool halSimOpen(const char *fileName, bool binary)
+{
+  halSimClose();
+  if((simFile = fopen(fileName, binary ? "wb" : "w")) == NULL) return false;
+  simBinary = binary;
+  simLastNS = ~0ULL;
+  if(simBinary)
+  {
+    uint8_t hdr[8] = {'M','F','T','T',1,0,0,0};
+    fwrite(hdr, 1, sizeof(hdr), simFile);
+  }
+  else
+  {
+    fprintf(simFile, "$timescale 1ns $end\n$scope module MFT $end\n");
+    for(int i=0;i<SIM_NUM;i++) fprintf(simFile, "$var wire %d %c %s $end\n", simWidth[i], '!' + i, simNames[i]);
+    fprintf(simFile, "$upscope $end\n$enddefinitions $end\n");
+  }
+  halHost.onPinWrite = simPinWrite;
+  halHost.onI2Cwrite = simI2Cwrite;
+  return true;
+}
+
+void halSimClose(void)
+{
+  halHost.onPinWrite = NULL;
+  halHost.onI2Cwrite = NULL;
+  if(simFile != NULL) fclose(simFile);
+  simFile = NULL;
+}
+
+// Schedules an input edge at the absolute time ns, returns false if the queue is full
+bool halSimTrigger(int pin, int level, uint64_t ns)
+{
+  int i;
+
+  if(simQueued >= SIM_QUEUE) return false;
+  for(i=simQueued;(i > 0) && (simQueue[i-1].ns > ns);i--) simQueue[i] = simQueue[i-1];
+  simQueue[i].ns = ns;
+  simQueue[i].pin = pin;
+  simQueue[i].level = level;
+  simQueued++;
+  return true;
+}
+
+// Runs the simulation for ns nS of virtual time. Events due at the same time fire in
+// the order input edges, step timer, clock timer, table timer, ramp timer, split step
+// timer, pulse timer. If idle is not NULL it is called after every event, pass the
+// sketch loop function to process commands.
+void halSimRun(uint64_t ns, void (*idle)(void))
+{
+  uint64_t end = halHost.ns + ns;
+  uint64_t next;
+  enum {EV_NONE, EV_PIN, EV_STEP, EV_CLOCK, EV_TABLE, EV_RAMP, EV_SPLIT, EV_PULSE} ev;
+
+  while(true)
+  {
+    // Strict compares so equal times keep the priority order, events due at end fire
+    ev = EV_NONE;
+    next = end + 1;
+    if((simQueued > 0) && (simQueue[0].ns < next)) { ev = EV_PIN; next = simQueue[0].ns; }
+    if(halHost.stepRunning && (halHost.stepISR != NULL) && (halHost.stepNext < next)) { ev = EV_STEP; next = halHost.stepNext; }
+    if((halHost.clockPeriod != 0) && (halHost.clockISR != NULL) && (halHost.clockNext < next)) { ev = EV_CLOCK; next = halHost.clockNext; }
+    if(halHost.tableRunning && (halHost.tableISR != NULL) && (halHost.tableNext < next)) { ev = EV_TABLE; next = halHost.tableNext; }
+    if(halHost.rampRunning && (halHost.rampISR != NULL) && (halHost.rampNext < next)) { ev = EV_RAMP; next = halHost.rampNext; }
+    if(halHost.splitRunning && (halHost.splitISR != NULL) && (halHost.splitNext < next)) { ev = EV_SPLIT; next = halHost.splitNext; }
+    if((halHost.pulsePeriod != 0) && (halHost.pulseISR != NULL) && (halHost.pulseNext < next)) { ev = EV_PULSE; next = halHost.pulseNext; }
+    if(ev == EV_NONE) break;
+    if(halHost.ns < next) halHost.ns = next;
+    switch(ev)
+    {
+      case EV_PIN:
+        {
+          SimEdge e = simQueue[0];
+          memmove(&simQueue[0], &simQueue[1], (--simQueued) * sizeof(SimEdge));
+          if(e.pin == Trig1) simTrace(SIM_TRIG1, e.level);
+          if(e.pin == Trig2) simTrace(SIM_TRIG2, e.level);
+          halHostSetPin(e.pin, e.level);
+        }
+        break;
+      case EV_STEP:
+        halHost.stepNext += halHost.stepPeriod;
+        halHost.stepISR();
+        break;
+      case EV_CLOCK:
+        halHost.clockNext += (uint64_t)halHost.clockPeriod * 1000;
+        halHost.clockISR();
+        break;
+      case EV_TABLE:
+        // The ISR sets the next compare or stops the timer
+        halHost.tableRunning = false;
+        halHost.tableISR();
+        break;
+      case EV_RAMP:
+        halHost.rampRunning = false;
+        halHost.rampISR();
+        break;
+      case EV_SPLIT:
+        halHost.splitRunning = false;
+        halHost.splitISR();
+        break;
+      case EV_PULSE:
+        halHost.pulseNext += (uint64_t)halHost.pulsePeriod * 1000;
+        halHost.pulseISR();
+        break;
+      default:
+        break;
+    }
+    if(idle != NULL) idle();
+  }
+  if(halHost.ns < end) halHost.ns = end;
+  if(simFile != NULL) fflush(simFile);
+}
+
+#endif
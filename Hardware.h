@@ -38,6 +38,9 @@ float Counts2Value(int Counts, ADCchan *ad);
 int   Value2Counts(float Value, DACchan *DC);
 int   Value2Counts(float Value, ADCchan *ac);
 void  MAX5815(int addr, int chn, int counts);
+void  MAX5815group(bool open);
+bool  MAX5815load(int addr, int chn, int counts);
+uint8_t ComputeCRC(uint8_t *buf, int bsize);
 
 void ProgramFLASH(char * Faddress,char *Fsize);
 
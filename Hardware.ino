@@ -1,16 +1,62 @@
 #include "Hardware.h"
 #include "AtomicBlock.h"
+#include "Hal.h"
+#include "I2Cqueue.h"
+#include "ADCscan.h"
 #include <Arduino.h>
-#include "SPI.h"
 #include <wiring_private.h>
 #include <assert.h>
 
+#if !defined(MFT_HOST)
+IntervalTimer halClockTimer;
+IntervalTimer halPulseTimer;
+void (*halTableISR)(void) = NULL;
+void (*halRampISR)(void) = NULL;
+
+// GPT2 has one interrupt for both compares, the table timer on compare 1 and the ramp
+// timer on compare 2
+static void halGPT2isr(void)
+{
+  uint32_t sr = GPT2_SR & GPT2_IR;
+
+  if(((sr & GPT_SR_OF1) != 0) && (halTableISR != NULL)) halTableISR();
+  if(((sr & GPT_SR_OF2) != 0) && (halRampISR != NULL)) halRampISR();
+}
+
+// Starts GPT2 free running at 1MHz from the 24MHz oscillator, once for both timers
+void halGPT2begin(void)
+{
+  static bool started = false;
+
+  if(started) return;
+  CCM_CCGR0 |= CCM_CCGR0_GPT2_BUS(CCM_CCGR_ON) | CCM_CCGR0_GPT2_SERIAL(CCM_CCGR_ON);
+  GPT2_CR = 0;
+  GPT2_IR = 0;
+  GPT2_PR = GPT_PR_PRESCALER24M(2) | GPT_PR_PRESCALER(7);
+  GPT2_SR = 0x3F;
+  GPT2_CR = GPT_CR_EN_24M | GPT_CR_CLKSRC(5) | GPT_CR_FRR | GPT_CR_ENMOD;
+  GPT2_CR |= GPT_CR_EN;
+  attachInterruptVector(IRQ_GPT2, halGPT2isr);
+  NVIC_ENABLE_IRQ(IRQ_GPT2);
+  started = true;
+}
+
+// Heap allocator call counter. newlib calls __malloc_lock on every malloc, free and
+// realloc, defining it here replaces the empty library version.
+uint32_t halHeapCalls = 0;
+
+extern "C" void __malloc_lock(struct _reent *r)   { halHeapCalls++; }
+extern "C" void __malloc_unlock(struct _reent *r) {}
+#endif
+
 // Reads the selected ADC channel for the number of averages defined by num
 int GetADCvalue(int chan, int num)
 {
   int i=0,j;
 
-  for(j=0;j<num;j++) i += analogRead(chan);
+  ADCscanHold(true);
+  for(j=0;j<num;j++) i += halAnalogRead(chan);
+  ADCscanHold(false);
   return i/num;
 }
 
@@ -98,11 +144,10 @@ byte ComputeCRC(byte *buf, int bsize)
 
 void MAX14802_Latch(void)
 {
-  digitalWrite(LTCH, LOW);
-  digitalWrite(LTCH, HIGH);
+  halDigitalWrite(LTCH, LOW);
+  halDigitalWrite(LTCH, HIGH);
 }
 
-SPISettings settingsA(20000000, MSBFIRST, SPI_MODE2);
 void MAX14802(int TW1, int TW2, bool Latch)
 {
   static bool inited = false;
@@ -110,45 +155,76 @@ void MAX14802(int TW1, int TW2, bool Latch)
   if(!inited)
   {
     // Init the SPI interface
-    SPI.begin();
-    SPI.beginTransaction(settingsA);
+    halSPIbegin();
     // Set latch high
-    pinMode(LTCH, OUTPUT);
-    digitalWrite(LTCH, HIGH);
+    halPinMode(LTCH, OUTPUT);
+    halDigitalWrite(LTCH, HIGH);
     // Set clear low
-    pinMode(CLRMUX, OUTPUT);
-    digitalWrite(CLRMUX, LOW);
+    halPinMode(CLRMUX, OUTPUT);
+    halDigitalWrite(CLRMUX, LOW);
     inited = true;
   }
-  SPI.transfer16(TW1);
-  SPI.transfer16(TW2);
+  halSPItransfer16(TW1);
+  halSPItransfer16(TW2);
   if(Latch) MAX14802_Latch();
 }
 
+// MAX5815 DAC writes are queued on the I2C interrupt driver so the CPU does not wait on
+// the bus. LDAC is held high, a single write updates its output with a code and load
+// command. While a group is open only the code registers are written and closing the
+// group pulses LDAC so all the outputs change at once. The main loop waits for room in
+// the I2C queue, the trigger ISRs use MAX5815load which does not wait.
+bool dacGroup   = false;
+bool dacPending = false;
+
 void MAX5815(int addr, int chn, int counts)
 {
   static bool inited = false;
+  uint8_t     buf[3];
 
   if(!inited)
   {
-    pinMode(CLRDAC,OUTPUT);
-    pinMode(LDAC,OUTPUT);
-    digitalWrite(CLRDAC,LOW);
-    delay(1);
-    digitalWrite(CLRDAC,HIGH);
-    digitalWrite(LDAC,LOW);
+    halPinMode(CLRDAC,OUTPUT);
+    halPinMode(LDAC,OUTPUT);
+    halDigitalWrite(CLRDAC,LOW);
+    halDelay(1);
+    halDigitalWrite(CLRDAC,HIGH);
+    halDigitalWrite(LDAC,HIGH);
     // Turn on internal reference
-    Wire.beginTransmission(addr);
-    Wire.write(0x75);
-    Wire.write(0x0);
-    Wire.write(0x0);
-    Wire.endTransmission();
-    delay(10);
+    buf[0] = 0x75;
+    buf[1] = 0x0;
+    buf[2] = 0x0;
+    I2CwriteWait(addr, buf, 3);
+    I2Cwait();
+    halDelay(10);
     inited = true;
   }
-  Wire.beginTransmission(addr);
-  Wire.write(0x30 | chn);
-  Wire.write(counts >> 8);
-  Wire.write(counts);
-  Wire.endTransmission();
+  buf[0] = (dacGroup ? 0x00 : 0x30) | chn;
+  buf[1] = counts >> 8;
+  buf[2] = counts;
+  I2CwriteWait(addr, buf, 3);
+  if(dacGroup) dacPending = true;
+}
+
+// Writes and loads one DAC output without waiting, safe to call from an ISR. An open
+// group is not held for this write. Returns false if the I2C queue is full and the
+// write was dropped.
+bool MAX5815load(int addr, int chn, int counts)
+{
+  uint8_t buf[3];
+
+  buf[0] = 0x30 | chn;
+  buf[1] = counts >> 8;
+  buf[2] = counts;
+  return I2Cwrite(addr, buf, 3);
+}
+
+// Opens or closes a group of DAC writes that update the outputs together. Closing
+// pulses LDAC after the last queued write.
+void MAX5815group(bool open)
+{
+  dacGroup = open;
+  if(open || !dacPending) return;
+  dacPending = false;
+  I2CwriteWait(0, NULL, 0, LDAC);
 }
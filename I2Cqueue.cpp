@@ -0,0 +1,169 @@
+//
+// I2Cqueue
+//
+// Interrupt driven I2C write queue. Writes are queued by the main loop or an ISR and the LPI2C1
+// interrupt feeds each transaction's command words to the transmit FIFO and starts the
+// next one when the stop is detected, so the CPU does not wait on the bus. A transaction
+// can pulse a pin low when it is done, the DAC uses this to pulse LDAC after a group of
+// code register writes so the outputs update together.
+//
+// Builds without the i.MX RT hardware write each transaction through the HAL as soon as
+// it is queued.
+//
+#include <Arduino.h>
+#include <string.h>
+#include "Hal.h"
+#include "I2Cqueue.h"
+#include "AtomicBlock.h"
+
+I2Cqueue  i2cQueue;
+uint32_t  i2cErrors = 0;
+uint32_t  i2cOverflows = 0;
+
+// Pulses the transaction's done pin
+static void I2Cpulse(I2Ctransaction *t)
+{
+  if(t->pulse < 0) return;
+  halDigitalWrite(t->pulse, LOW);
+  halDigitalWrite(t->pulse, HIGH);
+}
+
+#if defined(__IMXRT1062__)
+
+// LPI2C master commands, the command is in bits 8 through 10 of the transmit data word
+#define I2C_CMD_TX      0x000
+#define I2C_CMD_STOP    0x200
+#define I2C_CMD_START   0x400
+#define I2C_TXFIFO      4
+
+static uint16_t       i2cWords[I2CQ_MAX + 2];   // Command words for the transaction in progress
+static int            i2cNum, i2cNext;
+static volatile bool  i2cBusy = false;
+
+// Fills the transmit FIFO, the transmit interrupt is on until all the words are written
+static void I2Cfill(void)
+{
+  while((i2cNext < i2cNum) && ((LPI2C1_MFSR & 0x07) < I2C_TXFIFO)) LPI2C1_MTDR = i2cWords[i2cNext++];
+  if(i2cNext < i2cNum) LPI2C1_MIER = LPI2C_MIER_SDIE | LPI2C_MIER_NDIE | LPI2C_MIER_ALIE | LPI2C_MIER_TDIE;
+  else LPI2C1_MIER = LPI2C_MIER_SDIE | LPI2C_MIER_NDIE | LPI2C_MIER_ALIE;
+}
+
+// Starts the oldest queued transaction, called from the ISR or with interrupts off
+static void I2Cstart(void)
+{
+  I2Ctransaction *t;
+
+  while(true)
+  {
+    if(__atomic_load_n(&i2cQueue.head, __ATOMIC_ACQUIRE) == i2cQueue.tail)
+    {
+      i2cBusy = false;
+      LPI2C1_MIER = 0;
+      return;
+    }
+    t = &i2cQueue.buf[i2cQueue.tail & (I2CQ_SIZE - 1)];
+    if(t->len != 0) break;
+    // No data, only pulse the pin
+    I2Cpulse(t);
+    __atomic_store_n(&i2cQueue.tail, i2cQueue.tail + 1, __ATOMIC_RELEASE);
+  }
+  i2cNum = 0;
+  i2cWords[i2cNum++] = I2C_CMD_START | (t->addr << 1);
+  for(int i=0;i<t->len;i++) i2cWords[i2cNum++] = I2C_CMD_TX | t->buf[i];
+  i2cWords[i2cNum++] = I2C_CMD_STOP;
+  i2cNext = 0;
+  i2cBusy = true;
+  I2Cfill();
+}
+
+static void I2Cisr(void)
+{
+  uint32_t msr = LPI2C1_MSR;
+
+  // On a NACK the master sends the stop itself, drop the rest of the transaction
+  if(msr & (LPI2C_MSR_NDF | LPI2C_MSR_ALF))
+  {
+    i2cErrors++;
+    LPI2C1_MCR |= LPI2C_MCR_RTF;
+    LPI2C1_MSR = LPI2C_MSR_NDF | LPI2C_MSR_ALF;
+    i2cNext = i2cNum;
+  }
+  if(msr & LPI2C_MSR_SDF)
+  {
+    LPI2C1_MSR = LPI2C_MSR_SDF;
+    I2Cpulse(&i2cQueue.buf[i2cQueue.tail & (I2CQ_SIZE - 1)]);
+    __atomic_store_n(&i2cQueue.tail, i2cQueue.tail + 1, __ATOMIC_RELEASE);
+    I2Cstart();
+    return;
+  }
+  if(msr & LPI2C_MSR_TDF) I2Cfill();
+}
+
+void I2Cbegin(void)
+{
+  halI2Cbegin();
+  Wire.setClock(I2C_CLOCK);
+  LPI2C1_MIER = 0;
+  LPI2C1_MSR = LPI2C_MSR_SDF | LPI2C_MSR_NDF | LPI2C_MSR_ALF;
+  attachInterruptVector(IRQ_LPI2C1, I2Cisr);
+  NVIC_ENABLE_IRQ(IRQ_LPI2C1);
+}
+
+bool I2Cidle(void) { return !i2cBusy; }
+
+#else
+
+void I2Cbegin(void) { halI2Cbegin(); }
+bool I2Cidle(void)  { return true; }
+
+#endif
+
+// Adds a write to the queue with interrupts off, returns false if the queue is full
+static bool I2Cput(int addr, const uint8_t *buf, int len, int pulse)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  I2Ctransaction *t;
+  uint32_t       head = i2cQueue.head;
+
+  if(len > I2CQ_MAX) len = I2CQ_MAX;
+  if(head - __atomic_load_n(&i2cQueue.tail, __ATOMIC_ACQUIRE) >= I2CQ_SIZE) return false;
+  t = &i2cQueue.buf[head & (I2CQ_SIZE - 1)];
+  t->addr = addr;
+  t->len = len;
+  if(len > 0) memcpy(t->buf, buf, len);
+  t->pulse = pulse;
+#if defined(__IMXRT1062__)
+  __atomic_store_n(&i2cQueue.head, head + 1, __ATOMIC_RELEASE);
+  if(!i2cBusy) I2Cstart();
+#else
+  if(t->len > 0) halI2Cwrite(t->addr, t->buf, t->len);
+  I2Cpulse(t);
+  __atomic_store_n(&i2cQueue.head, head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&i2cQueue.tail, head + 1, __ATOMIC_RELEASE);
+#endif
+  return true;
+}
+
+// Queues a write of len bytes to the device at addr, pulse is a pin to pulse low when
+// the write is done or -1. A write with no data only pulses the pin once the writes
+// ahead of it are done. Safe to call from an ISR. Returns false and counts an overflow
+// if the queue is full.
+bool I2Cwrite(int addr, const uint8_t *buf, int len, int pulse)
+{
+  if(I2Cput(addr, buf, len, pulse)) return true;
+  i2cOverflows++;
+  return false;
+}
+
+// Queues a write, waiting for room if the queue is full. The ISRs queue writes too so
+// the wait retries the write rather than testing for room first. Main loop only.
+void I2CwriteWait(int addr, const uint8_t *buf, int len, int pulse)
+{
+  while(!I2Cput(addr, buf, len, pulse));
+}
+
+// Waits for all the queued writes to finish
+void I2Cwait(void)
+{
+  while(!I2Cidle());
+}
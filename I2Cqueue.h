@@ -0,0 +1,34 @@
+#ifndef I2Cqueue_h
+#define I2Cqueue_h
+#include <stdint.h>
+
+#define I2C_CLOCK     1000000     // Fast mode plus
+#define I2CQ_SIZE     16          // Queued transactions, must be a power of 2
+#define I2CQ_MAX      4           // Bytes per transaction
+
+typedef struct
+{
+  uint8_t   addr;
+  uint8_t   len;
+  uint8_t   buf[I2CQ_MAX];
+  int8_t    pulse;                // Pin pulsed low when the transaction is done, -1 if none
+} I2Ctransaction;
+
+typedef struct
+{
+  I2Ctransaction  buf[I2CQ_SIZE];
+  uint32_t        head;           // Written by the main loop and ISRs with interrupts off
+  uint32_t        tail;           // Written by the I2C ISR
+} I2Cqueue;
+
+extern uint32_t i2cErrors;
+extern uint32_t i2cOverflows;
+
+// Function prototypes
+void I2Cbegin(void);
+bool I2Cwrite(int addr, const uint8_t *buf, int len, int pulse = -1);
+void I2CwriteWait(int addr, const uint8_t *buf, int len, int pulse = -1);
+bool I2Cidle(void);
+void I2Cwait(void);
+
+#endif
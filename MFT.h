@@ -1,6 +1,7 @@
 #ifndef MFT_h
 #define MFT_h
 #include "Hardware.h"
+#include "Hal.h"
 
 #define FILTER   0.1
 
@@ -41,6 +42,9 @@ enum TriggerFunction
   CNT_TF,
   TWALT1_TF,
   TWALT2_TF,
+  RAMP_TF,
+  TBL_TF,
+  BURST_TF,
   NA_TF
 };
 
@@ -61,6 +65,174 @@ typedef struct
   bool      commandOnTcount;    // Execute command string at threshold count
 } PulseCounter;
 
+#define TW_MAXFRAMES  1024              // Frames per cycle, both channels with the dwells expanded
+#define TW_MAXSEQ     256               // Steps in a channel's sequence
+#define TW_MAXOVRS    32                // Maximum oversampling, frames per step
+#define TW_MAXSTEPRATE (MAXfrequency * 8) // Frames per second the step engine can play
+
+// Timer1ISR hot state, final MAX14802 words for each step. Two tables are used, the
+// inactive table is rebuilt at set time and swapped in at the next cycle boundary. A
+// cycle is 8 frames for the bit patterns, or longer when a channel plays a sequence or
+// the steps are oversampled. Each table is built for the four direction variants, so a
+// direction change only selects a variant, and the open mask is applied per step.
+#define TW_REV1       1                 // Direction variant bits, set for reverse
+#define TW_REV2       2
+#define TW_DIRS       4
+
+typedef struct
+{
+  uint32_t          frames[2][TW_DIRS][TW_MAXFRAMES]; // Step frames, TW2 word in upper 16 bits, TW1 in lower
+  volatile uint16_t len[2];             // Frames per cycle in each table
+  volatile uint16_t chLen[2][2];        // Frames per cycle of each channel in each table
+  volatile uint8_t  active;             // Frame table played by Timer1ISR
+  volatile bool     pending;            // True when the inactive table holds new frames
+  volatile uint8_t  dir;                // Direction variant played
+  volatile uint8_t  dirNext;            // Direction variant taken at the cycle boundary
+  volatile uint32_t open;               // Open mask, ANDed with each frame
+} TWengine;
+
+// Returns the frame for the current step and advances the step index. A pending frame
+// table and direction are swapped in at the cycle boundary. This is the step model
+// used by Timer1ISR and by the DMA chain check.
+inline uint32_t TWstep(TWengine *tw, volatile int *indx)
+{
+  uint32_t frame;
+  int      next;
+
+  if(*indx == 0)
+  {
+    if(tw->pending)
+    {
+      tw->active ^= 1;
+      tw->pending = false;
+    }
+    tw->dir = tw->dirNext;
+  }
+  frame = tw->frames[tw->active][tw->dir][*indx] & tw->open;
+  next = *indx + 1;
+  *indx = next < tw->len[tw->active] ? next : 0;
+  return frame;
+}
+
+// Step sequences, a channel can play a sequence of up to TW_MAXSEQ steps instead of its
+// 8 step bit pattern. Each step is packed in 16 bits, the electrode mask in the low byte
+// and the dwell, the number of step periods the step is held less 1, in the high byte.
+// The frame builder expands the dwells so the step ISR only indexes the frame table.
+#define TW_SEQSTEP(mask,dwell)  ((uint16_t)(((mask) & 0xFF) | (((dwell) - 1) << 8)))
+#define TW_SEQMASK(step)        ((step) & 0xFF)
+#define TW_SEQDWELL(step)       (((step) >> 8) + 1)
+
+typedef struct
+{
+  uint16_t  steps[2][TW_MAXSEQ];
+  int       num[2];                     // Steps in each channel's sequence
+  bool      enabled[2];                 // Play the sequence instead of the bit pattern
+} TWsequence;
+
+// Step clock synthesis. The step period is ticks + frac / 2^32 step timer ticks, the ISR
+// adds frac to a phase accumulator each step and a carry makes the next period one tick
+// longer, so the average step rate is exact to far better than 1Hz. The timer loads a
+// new period at the end of the current one so frequency changes are phase continuous.
+// A period can be staged instead, the ISR loads it on the last frame of the cycle so the
+// new rate starts with the next cycle, together with a pending frame table.
+typedef struct
+{
+  uint32_t  ticks;                      // Whole step timer ticks per step
+  uint32_t  frac;                       // Fraction of a tick per step, 1/2^32 units
+  int       prescale;                   // Step timer prescale, 2^prescale
+  uint32_t  phase;                      // Fraction accumulator
+  bool      extra;                      // True if the loaded period has the extra tick
+  float     afreq;                      // Actual frequency per output in Hz
+  uint32_t  sticks;                     // Staged period
+  uint32_t  sfrac;
+  int       sprescale;
+  volatile bool staged;                 // True when a staged period is waiting
+} TWclock;
+
+// When waveform changes made while running take effect
+enum TWupdateMode
+{
+  TW_UPD_STEP,                          // Next step, a frame table of the same length
+  TW_UPD_CYCLE                          // Next cycle boundary, frames and step period
+};
+
+// Called by the step ISR once per step
+inline void TWclockStep(TWclock *c)
+{
+  uint32_t p = c->phase + c->frac;
+  bool     carry = (p < c->phase);
+
+  c->phase = p;
+  if(carry == c->extra) return;
+  c->extra = carry;
+  halStepTimerTicks(c->ticks + carry, c->prescale);
+}
+
+// Loads a staged step period, called by the step ISR or with the step timer stopped
+inline void TWclockCommit(TWclock *c)
+{
+  if(!c->staged) return;
+  c->ticks = c->sticks;
+  c->frac = c->sfrac;
+  c->prescale = c->sprescale;
+  c->extra = false;
+  c->staged = false;
+  halStepTimerTicks(c->ticks, c->prescale);
+}
+
+// Ramp targets, each ramps from its start to its end value over its duration once the
+// ramps are started by RUNRAMP or an armed RAMP trigger
+enum RampTarget
+{
+  RAMP_FREQ,
+  RAMP_TWV1,
+  RAMP_TWV2,
+  RAMP_GRD,
+  RAMP_NUM
+};
+
+enum RampShape
+{
+  RAMP_LIN,
+  RAMP_EXP
+};
+
+#define RAMP_TICK     1000              // uS between ramp updates
+
+typedef struct
+{
+  bool      enabled;
+  uint8_t   shape;
+  float     start;
+  float     end;
+  float     k;                          // log(end/start) for an exponential ramp
+  uint32_t  duration;                   // Ramp time in mS
+} Ramp;
+
+typedef struct
+{
+  Ramp              ramp[RAMP_NUM];
+  volatile bool     armed;              // Waiting for a RAMP trigger
+  volatile bool     running;
+  volatile uint32_t start;              // Ramp timer count, uS, when the ramps started
+  volatile uint32_t next;               // Ramp timer count of the next update
+  uint32_t          length;             // Longest enabled ramp in uS
+} RampEngine;
+
+// Burst mode, the waveform plays exactly a number of whole cycles from the first frame
+// and stops. A burst is started by BURST or by a BURST trigger when armed.
+typedef struct
+{
+  int               cycles;             // Cycles per burst
+  volatile int      left;               // Cycles left in the running burst
+  volatile bool     armed;              // Waiting for a BURST trigger
+  volatile bool     running;
+  bool              rearm;              // Arm again when a burst is done
+  bool              trigOut;            // Pulse TrigOut when a burst is done
+  bool              command;            // Run the command string when a burst is done
+  uint32_t          count;              // Bursts done
+} Burst;
+
 // TwaveSwitch data structure
 typedef struct
 {
@@ -103,6 +275,17 @@ typedef struct
   unsigned int  Signature;              // Must be 0xAA55A5A5 for valid data
 } MFTdata;
 
+// DAC codes for the voltage setpoints, updated when a setpoint or calibration changes so
+// the DAC writes, the alternate TW voltage trigger in particular, do no float math
+typedef struct
+{
+  uint16_t      tw[2];                  // TWvoltage
+  uint16_t      alt[2];                 // TWaltV
+  uint16_t      guard;                  // Guard, includes the low voltage correction
+} DACcodes;
+
+extern DACcodes dacCodes;
+
 extern bool MonitorFlag;
 
 extern float TW1readback;
@@ -113,6 +296,14 @@ extern int   activeCS;
 extern char  commandString[2][MAXCMDLEN];
 
 extern PulseCounter pulseCounter;
+extern TWengine     twEngine;
+extern TWsequence   twSeq;
+extern int          twOS;
+extern volatile int TWindx;
+extern TWclock twClock;
+extern TWupdateMode twUpdate;
+extern RampEngine rampEngine;
+extern Burst burst;
 
 extern int  clockFrequency;
 extern char clockMode[];
@@ -122,6 +313,14 @@ extern char clockMode[];
 void ReadAllSerial(void);
 void ProcessSerial(bool scan = true);
 void ReadADC(void);
+void Update(void);
+bool Restore(void);
+void ProcessEvents(void);
+void executeCommand(char *str);
+void executeCommandString(void);
+bool checkChange(char *str, float *change);
+bool checkChange(char *str, int *change);
+void updateTWclock(void);
 void SetFrequency(char *value);
 void SetFWDir(char *chan, char *fwd);
 void GetFWDir(int ch);
@@ -130,8 +329,18 @@ void GetPattern(int ch);
 void StopTwave(void);
 void StartTwave(void);
 void rtClockCyclsISR(void);
+void defineTWvector(int ch, bool fwd);
+void defineTWvector(int ch, bool fwd, bool now);
+void TWdirection(bool now);
+void TWopen(void);
+int  checkCH(char *chan);
+bool checkTF(char *str, bool *val);
+bool checkPattern(char *str, int *ptrn);
+void updateTWframes(bool now);
 void MoveNcycles(int N);
 
+void updateDACcodes(void);
+int  guardCounts(float val);
 void SetTWvoltage(char *chan, char *value);
 void GetTWvoltage(int ch);
 void SetTWAvoltage(char *chan, char *value);
@@ -154,10 +363,13 @@ void getRevPS(int ch);
 void playCommandString(void);
 void playCommandString1(void);
 void playCommandString2(void);
+void setCommandString1(char *str);
+void setCommandString2(char *str);
 void setTrig1(char *mode, char *function);
 void setTrig2(char *mode, char *function);
 void clearCounter(void);
 void readTriggerInput(int ch);
+void getEventOverflows(void);
 
 void setMaximum(void);
 void getMaximum(void);
@@ -170,4 +382,45 @@ void getActiveCMD(void);
 void setClock(int freq);
 void setClockFunction(char *func);
 
+void setDMAmode(char *val);
+void testDMAchain(void);
+void setSync(int step, int delay);
+void getSync(void);
+void setSyncEnable(char *val);
+void getSyncProfile(int ch);
+void clearSync(void);
+void pulseTrigOut(void);
+void setTWaltV(int chan, bool useALT);
+void toggleTWaltV(int chan);
+void rampTrigger(void);
+void RampBegin(void);
+void setRamp(void);
+void getRamp(void);
+void clearRamps(void);
+void runRamps(void);
+void armRamps(void);
+void stopRamps(void);
+void getRampStatus(void);
+int  TWsequenceFrames(int ch);
+int  TWchannelFrames(int ch);
+int  TWcycleFrames(int n0, int n1);
+void clearSequence(int ch);
+void addSequence(void);
+void getSequence(int ch);
+void setSequenceEnable(char *chan, char *val);
+void getSequenceEnable(int ch);
+int  TWmaxFrequency(void);
+void setOversample(int n);
+void getMaxFrequency(void);
+void setSplitMode(char *val);
+void SetFrequency2(char *value);
+void burstTrigger(void);
+void setBurstCycles(int n);
+void startBurst(void);
+void armBurst(void);
+void stopBurst(void);
+void getBurstStatus(void);
+void setUpdateMode(char *mode);
+void getUpdateMode(void);
+
 #endif
@@ -67,6 +67,124 @@
 // 1.7, June 19, 2024
 //    1.) Added SGRDA to set the guard voltage and use readback to lineraze below 5 volts
 //    2.) Fixed commnuications issue when in the command execution loops
+// 1.8, Oct 17, 2026
+//    1.) Timer1ISR now plays a precomputed, double buffered MAX14802 frame table. The table
+//        is rebuilt at set time and swapped in at the next cycle boundary. The maximum
+//        frequency stays 25KHz, the two SPI words and the latch take about 2uS of each 5uS
+//        step at that rate.
+//    2.) Added DMA driven waveform playback, a PIT paced eDMA chain writes the step frames
+//        to the SPI and pulses the latch with no per step interrupt.
+//        SDMA,TRUE|FALSE
+//        GDMA
+//        TDMA, checks the DMA descriptor chain against the step ISR, returns PASS or FAIL
+//    3.) All peripheral access now goes through the hardware abstraction layer in Hal.h,
+//        building with MFT_HOST defined uses the mock backends in HalHost.cpp
+//    4.) Fixed divide by zero when setting the clock frequency to 0
+//    5.) Added a host simulator, HalSim.cpp, that runs the timers and trigger inputs in
+//        virtual time and streams MAX14802 latches, DAC writes and TrigOut edges to a
+//        VCD or binary trace file
+//    6.) Commands are found with a hash table of the command names built at compile time,
+//        command table entries are type checked at compile time
+//    7.) Command argument parsing no longer uses String objects and does not allocate
+//        GHEAP, returns the number of heap allocator calls since reset
+//    8.) Commands are processed a full line at a time, the line is taken from the ring
+//        buffer in one or two blocks and split in place, tokens are no longer limited
+//        to 19 characters
+//    9.) USB and Serial1 each have their own input ring buffer and command parser state,
+//        responses go to the port the command came from. All available characters are
+//        read on each pass
+//   10.) Added an optional binary command frame mode with CRC8, see Serial.h
+//        SBIN,TRUE|FALSE
+//        GCMDID,name, returns a command's binary ID
+//   11.) Responses are sent through a per port output queue. Added a request tag mode, a
+//        command can start with #tag, and the tag is sent in front of its response.
+//        A tag over 10 characters is NAKed. A full queue is sent with blocking writes.
+//        STAG,TRUE|FALSE
+//        GTXOVF, returns the number of characters the port failed to take
+//   12.) Trigger command strings are compiled when they are set, STRGCMD1 and STRGCMD2
+//        NAK a string with an unknown command. Triggers run the compiled string directly
+//        before any queued serial commands.
+//   13.) Trigger and clock ISRs queue timestamped events for the main loop, one per edge,
+//        so fast edges are no longer lost. The alternate TW voltage DAC writes and command
+//        strings run from the queue.
+//        GEVOVF, returns the number of events lost to a full queue
+//   14.) MAX5815 writes are queued on an interrupt driven I2C driver at 1MHz. DAC writes
+//        from commands on one line separated by ; or from a trigger command string are
+//        loaded together with LDAC.
+//   15.) The DAC codes for the TW, alternate TW and guard voltages are computed when a
+//        setpoint or the calibration changes, the alternate TW voltage trigger no longer
+//        does any float math. The guard low voltage correction is now also applied at
+//        power up.
+//   16.) The TW1, TW2 and guard readbacks are scanned in the background with hardware
+//        averaging and DMA, the main loop filters the samples as they arrive and no longer
+//        blocks on the ADC. The blocking reads used by calibration and SGRDA hold the scan.
+//   17.) Added telemetry streaming, a port can stream timestamped TW1, TW2 and guard
+//        readbacks, the pulse count and status as CSV lines or binary frames, see Serial.h
+//        STLM,rate, samples per second 1 to 1000, 0 stops
+//        GTLM
+//   18.) Added phase synchronous readback sampling, the step ISR starts a conversion a set
+//        delay after a chosen step and the results are averaged in per step buckets.
+//        SSYNC,step,delay, step 0 to 7 or -1 for all, delay in uS
+//        GSYNC
+//        SSYNCENA,TRUE|FALSE
+//        GSYNCENA
+//        GSYNCV,chan, returns the 8 step averages, chan 1 = TW1, 2 = TW2, 3 = guard
+//        CLRSYNC, clears the step averages
+//   19.) The step period is set in Timer1 bus clocks with a fractional part dithered by
+//        the step ISR, frequency changes are loaded at the end of a step with no restart.
+//        GAFREQ returns the actual frequency as a float.
+//   20.) Added a ramp engine, the frequency, TW voltages and guard ramp from a start to an
+//        end value, linear or exponential, updated every mS from the ramp start time. The
+//        ramps can be armed to start on a trigger, TrigOut is pulsed at the start and end.
+//        SRAMP,type,chan,start,end,mS,LIN|EXP, types: FREQ,TWV,GRD, chan only for TWV
+//        GRAMP,type,chan
+//        CLRRAMP, removes all the ramps
+//        RUNRAMP, ARMRAMP, STOPRAMP
+//        GRAMPSTAT, returns IDLE, ARMED or RUNNING
+//        TRIG1 and TRIG2 function RAMP starts the armed ramps
+//   21.) Added a time table sequencer, a table of uS timed direction, pattern, open,
+//        frequency, DAC setpoint, alternate voltage and TrigOut entries is loaded into RAM
+//        and run from a hardware timer, see Table.cpp.
+//        ADDTBL,time,action,chan,value, chan only for the channel actions
+//        CLRTBL, GTBL
+//        STBLLEN,uS, GTBLLEN, pass length, 0 uses the last entry time
+//        STBLREP,passes, GTBLREP, 0 repeats until stopped
+//        TBLSTRT, TBLARM, TBLSTOP
+//        GTBLSTAT, returns IDLE, ARMED or RUNNING
+//        TRIG1 and TRIG2 function TBL starts the armed table
+//   22.) Added step sequences, a channel can play up to 256 steps, each with its own
+//        electrode mask and dwell, instead of the 8 step bit pattern. The dwells are
+//        expanded into the frame table, a cycle can be up to 1024 frames. Direction and
+//        phase shift apply to sequences, reverse plays the steps backwards.
+//        CLRSEQ,chan
+//        ADDSEQ,chan,mask[:dwell],..., mask is 8 bits binary, dwell 1 to 256
+//        GSEQ,chan
+//        SSEQENA,chan,TRUE|FALSE
+//        GSEQENA,chan
+//   23.) Added step oversampling, each step is played as n frames so the phase shifts are
+//        set in 45/n degree increments instead of 45. The step rate goes up n times, the
+//        maximum frequency is 25000/n.
+//        SOVRS,n, n is 1 to 32
+//        GOVRS
+//        GMAXFREQ, returns the maximum frequency for the oversampling
+//   24.) Added split step clocks, TW1 and TW2 can step at their own frequencies from
+//        their own phase accumulators, see TwaveSplit.cpp. Steps that come due together
+//        are written to the MAX14802 chain in one SPI transaction.
+//        SSPLIT,TRUE|FALSE
+//        GSPLIT
+//        SFREQ2,freq, the TW2 frequency, TW1 uses SFREQ
+//        GFREQ2, GAFREQ2
+//   25.) Added burst mode, exactly N whole cycles from the first frame, started now or by
+//        an armed BURST trigger. When done TrigOut can be pulsed, the command string run
+//        and the burst armed again. STEP now moves exactly N steps.
+//        SBSTCYC,N, GBSTCYC
+//        BURST, BSTARM, BSTSTOP, GBSTSTAT, GBSTCNT
+//        SBSTREARM,SBSTTRG,SBSTCMD TRUE|FALSE and their G commands
+//   26.) Added the update mode, in CYCLE mode pattern, direction, phase shift and frequency
+//        changes made while running are staged and committed together at the next cycle
+//        boundary. STEP mode applies them on the next step.
+//        SUPDMODE,STEP|CYCLE
+//        GUPDMODE
 //
 //
 // Gordon Anderson
@@ -82,18 +200,23 @@
 #include <ThreadController.h>
 #include <Adafruit_DotStar.h>
 
-#include <SPI.h>
+#include "Hal.h"
 #include "Hardware.h"
 #include "MFT.h"
 #include "Errors.h"
 #include "Serial.h"
 #include <SerialBuffer.h>
-#include <TimerOne.h>
-#include <EEPROM.h>
 #include "AtomicBlock.h"
-
-const char   Version[] PROGMEM = "MFT version 1.7, Jun 19, 2024";
+#include "TwaveDMA.h"
+#include "Events.h"
+#include "I2Cqueue.h"
+#include "ADCscan.h"
+#include "Table.h"
+#include "TwaveSplit.h"
+
+const char   Version[] PROGMEM = "MFT version 1.8, Oct 17, 2026";
 MFTdata      mftdata;
+DACcodes     dacCodes;
 
 int eeAddress = 0;
 
@@ -104,16 +227,16 @@ ThreadController control = ThreadController();
 //Threads
 Thread SystemThread = Thread();
 
-IntervalTimer     clockTimer;
 int  clockFrequency = 0;
 char clockMode[5] = "NA";
 void (*clockFunction)(bool high) = NULL;
 
 int               activeCS = 0;
 char              commandString[2][MAXCMDLEN] = {"STWV,1,>25|ETRGCMD2|+=1","STWV,1,<=0|ETRGCMD1|-=1"};
+CmdProgram        cmdProgram[2];
 TriggerFunction   TrigFunc[2] = {NA_TF,NA_TF};
 TriggerMode       TrigMode[2] = {NA_MODE,NA_MODE};
-bool              TrigCommandString = false;
+EventQueue        eventQueues[EVQ_NUM];
 
 PulseCounter      pulseCounter = {0,0,false,false,false};
 
@@ -152,7 +275,14 @@ MFTdata Rev_1_mftdata = {
                             };
 
 char Status[20] = "Running";
-int TWindx  = 0;
+TWengine twEngine = {{{{0}}},{8,8},{{8,8},{8,8}},0,false,0,0,0xFFFFFFFF};
+TWsequence twSeq;
+int twOS = 1;
+volatile int TWindx  = 0;
+TWclock twClock = {0,0,0,0,false,0,0,0,0,false};
+TWupdateMode twUpdate = TW_UPD_CYCLE;
+RampEngine rampEngine;
+Burst burst = {1,0,false,false,false,false,false,0};
 int TWcycl  = 0;
 int TWcycls = 10;
 float TW1readback = 0;
@@ -166,73 +296,298 @@ void msTimerIntercept(void)
 
 }
 
-// This function uses the bit pattern to fill the Twave vector.
-// The flag fwd is true for forward direction
-void defineTWvector(int ch, bool fwd)
+// Frame builder state. A build started from an ISR while another build is in progress
+// only flags the interrupted build to start over, so the frames always match the last
+// settings and a long cycle is never built with interrupts off.
+static volatile bool twBuilding = false;
+static volatile bool twRebuild  = false;
+static volatile bool twBuildNow = false;
+static uint8_t       twWave[2][2][TW_MAXFRAMES]; // One cycle of each channel's masks, forward and reverse
+static uint8_t       twSeqWave[TW_MAXFRAMES];   // Expanded sequence, before direction and phase
+
+// Returns the frames in one cycle of a channel's sequence, the sum of its dwells
+int TWsequenceFrames(int ch)
+{
+  int n = 0;
+
+  for(int i=0;i<twSeq.num[ch];i++) n += TW_SEQDWELL(twSeq.steps[ch][i]);
+  return n;
+}
+
+// Returns the frames in one cycle of a channel, 8 for the bit pattern, times the
+// oversampling
+int TWchannelFrames(int ch)
+{
+  if(!twSeq.enabled[ch] || (twSeq.num[ch] == 0)) return 8 * twOS;
+  return TWsequenceFrames(ch) * twOS;
+}
+
+// Returns the frames in a cycle of both channels, the least common multiple of their
+// cycle lengths
+int TWcycleFrames(int n0, int n1)
 {
-  int mft;
-  int ps;
+  int a = n0, b = n1, t;
 
-  mft = mftdata.bitPattern[ch];
-  if(fwd) ps = (mftdata.fwdPS[ch] / 45) & 0x07;
-  else ps = (mftdata.revPS[ch] / 45) & 0x07;
-  for(int i=0;i<8;i++)
+  while(b != 0)
   {
-    mftdata.twave[ch][(i + ps) & 0x07] = mft & 0xFF;
-    if(!fwd)
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return n0 / a * n1;
+}
+
+// Returns the 8 step wave of a bit pattern, forward rotates the pattern right one bit
+// per step and reverse rotates it left
+static uint8_t TWpatternStep(int pattern, bool fwd, int step)
+{
+  if(step == 0) return pattern & 0xFF;
+  if(fwd) return ((pattern >> step) | (pattern << (8 - step))) & 0xFF;
+  return ((pattern << step) | (pattern >> (8 - step))) & 0xFF;
+}
+
+// Fills twWave[ch][rev] with one cycle of the channel's masks in a direction and
+// returns its length. Each step is held for twOS frames and the cycle is rotated by the
+// phase shift in frames, so oversampling sets the phase shift resolution. A sequence
+// plays backwards in the reverse direction.
+static int TWchannelWave(int ch, bool fwd)
+{
+  uint8_t *wave = twWave[ch][fwd ? 0 : 1];
+  int     n = 0;
+  int     off;
+  bool    seq = twSeq.enabled[ch] && (twSeq.num[ch] > 0);
+
+  if(!seq)
+  {
+    for(int i=0;i<8;i++)
     {
-      // rotate left. 8 bits
-      mft = mft << 1;
-      if((mft & 0x100) != 0) mft |= 1;
+      for(int d=twOS;(d > 0) && (n < TW_MAXFRAMES);d--) twSeqWave[n++] = TWpatternStep(mftdata.bitPattern[ch], fwd, i);
     }
-    else
+  }
+  else
+  {
+    for(int i=0;i<twSeq.num[ch];i++)
     {
-      // rotate right. 8 bits
-      if((mft & 1) != 0) mft |= 0x100;
-      mft = (mft >> 1);
-      mft &= 0xFF;
+      for(int d=TW_SEQDWELL(twSeq.steps[ch][i]) * twOS;(d > 0) && (n < TW_MAXFRAMES);d--) twSeqWave[n++] = TW_SEQMASK(twSeq.steps[ch][i]);
     }
   }
+  if(fwd) off = mftdata.fwdPS[ch] * n / 360;
+  else off = mftdata.revPS[ch] * n / 360;
+  off = ((off % n) + n) % n;
+  for(int i=0;i<n;i++) wave[(i + off) % n] = (fwd || !seq) ? twSeqWave[i] : twSeqWave[n - 1 - i];
+  return n;
 }
 
+// Returns the open mask as an AND mask for the frames
+static uint32_t TWopenMask(void)
+{
+  uint32_t mask = 0xFFFFFFFF;
+
+  for(int ch=0;ch<2;ch++)
+  {
+    if(mftdata.Open[ch]) mask &= ~((uint32_t)((mftdata.openMask[ch] | (mftdata.openMask[ch] << 8)) & 0xFFFF) << (16 * ch));
+  }
+  return mask;
+}
+
+// This function builds the final MAX14802 words for one cycle from the channel waves
+// and inverted byte into frame table k, one table for each direction variant. The eDMA
+// plays the frames as they are so in DMA mode the open mask is built in. With split
+// step clocks each channel indexes the table on its own so the table only needs the
+// longer channel.
+static void TWbuildFrames(int k)
+{
+  uint32_t *frames;
+  uint32_t mask = twDMAmode ? TWopenMask() : 0xFFFFFFFF;
+  int      n[2], j[2];
+  int      tw[2];
+  int      len;
+
+  for(int ch=0;ch<2;ch++)
+  {
+    n[ch] = TWchannelWave(ch, true);
+    TWchannelWave(ch, false);
+  }
+  // The sequence commands keep the cycle in range, this only protects the table
+  if(twSplitMode) len = n[0] > n[1] ? n[0] : n[1];
+  else len = TWcycleFrames(n[0], n[1]);
+  if(len > TW_MAXFRAMES) len = TW_MAXFRAMES;
+  for(int v=0;v<TW_DIRS;v++)
+  {
+    frames = twEngine.frames[k][v];
+    j[0] = j[1] = 0;
+    for(int i=0;i<len;i++)
+    {
+      for(int ch=0;ch<2;ch++)
+      {
+        tw[ch] = twWave[ch][(v >> ch) & 1][j[ch]];
+        tw[ch] |= ((~tw[ch]) & 0xFF) << 8;
+        if(++j[ch] >= n[ch]) j[ch] = 0;
+      }
+      frames[i] = (((uint32_t)(tw[1] & 0xFFFF) << 16) | (tw[0] & 0xFFFF)) & mask;
+    }
+  }
+  twEngine.chLen[k][0] = n[0];
+  twEngine.chLen[k][1] = n[1];
+  twEngine.len[k] = len;
+}
+
+// Rebuilds the inactive frame table. If now is true the new table is used on the next
+// step, else Timer1ISR swaps it in at the next cycle boundary. A table with a different
+// cycle length is always swapped at the cycle boundary.
+void updateTWframes(bool now)
+{
+  int next;
+
+  {
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    if(twBuilding)
+    {
+      twRebuild = true;
+      twBuildNow = twBuildNow || now;
+      return;
+    }
+    twBuilding = true;
+    twBuildNow = now;
+  }
+  while(true)
+  {
+    {
+      AtomicBlock< Atomic_RestoreState > a_Block;
+      twRebuild = false;
+      twEngine.pending = false;
+      // In DMA mode the eDMA does the swap, cancel any pending switch and sync to it
+      if(twDMAmode) twEngine.active = TWdmaHold();
+      // With split clocks the channels swap on their own, both must leave the old table
+      if(twSplitMode) TWsplitHold();
+      next = twEngine.active ^ 1;
+    }
+    TWbuildFrames(next);
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    if(twRebuild) continue;
+    now = twBuildNow && (twEngine.len[next] == twEngine.len[next ^ 1]);
+    if(twDMAmode) TWdmaLink(next, now);
+    if(twSplitMode) TWsplitLink(next, twBuildNow);
+    else if(now) twEngine.active = next;
+    else twEngine.pending = true;
+    twBuilding = false;
+    return;
+  }
+}
+
+// This function uses the bit pattern to fill the Twave vector, the phase shift is
+// applied by the frame builder. The flag fwd is true for forward direction. If now is
+// true the new frames are used on the next step, table events need this, else the TW
+// update mode decides.
+void defineTWvector(int ch, bool fwd, bool now)
+{
+  for(int i=0;i<8;i++) mftdata.twave[ch][i] = TWpatternStep(mftdata.bitPattern[ch], fwd, i);
+  updateTWframes(now);
+}
+
+// Selects the direction variant of the frame tables for mftdata.Fwd. This only switches
+// tables so the triggers can call it. If now is true the new direction is used on the
+// next step, else at the cycle boundary.
+void TWdirection(bool now)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  uint8_t v = (mftdata.Fwd[0] ? 0 : TW_REV1) | (mftdata.Fwd[1] ? 0 : TW_REV2);
+
+  twEngine.dirNext = v;
+  if(now) twEngine.dir = v;
+  if(twDMAmode) TWdmaDirection(now);
+  if(twSplitMode) TWsplitDirection(now);
+}
+
+// Loads the open mask, used from the next step. The eDMA can not mask the frames so in
+// DMA mode the tables are rebuilt.
+void TWopen(void)
+{
+  twEngine.open = TWopenMask();
+  if(twDMAmode) updateTWframes(true);
+}
+
+// Host command path, the new frames follow the TW update mode
+void defineTWvector(int ch, bool fwd)
+{
+  defineTWvector(ch, fwd, twUpdate == TW_UPD_STEP);
+}
+
+// Step engine, one table load and the SPI writes per step. A pending frame table
+// is only swapped in at the cycle boundary so a cycle is never mixed.
 void Timer1ISR(void)
 {
-  static int TW1,TW2;
+  uint32_t frame;
+  int      step = TWindx;
 
-  TW1 = mftdata.twave[0][TWindx] | (((~mftdata.twave[0][TWindx]) & 0xFF) << 8);
-  TW2 = mftdata.twave[1][TWindx] | (((~mftdata.twave[1][TWindx]) & 0xFF) << 8);
-  if(mftdata.Open[0]) TW1 &= ~(mftdata.openMask[0] | (mftdata.openMask[0] << 8));
-  if(mftdata.Open[1]) TW2 &= ~(mftdata.openMask[1] | (mftdata.openMask[1] << 8));
-  MAX14802(TW2,TW1);
-  TWindx++;
-  TWindx &= 0x07;
+  frame = TWstep(&twEngine, &TWindx);
+  MAX14802(frame >> 16, frame & 0xFFFF);
+  TWclockStep(&twClock);
+  // A staged period loads on the last frame so it starts with the next cycle
+  if(twClock.staged && (step == twEngine.len[twEngine.active] - 1)) TWclockCommit(&twClock);
+  // Sampling is synchronous to the steps, the first frame of each oversampled step
+  if(adcSync.enabled && ((step % twOS) == 0)) ADCsyncStep(step / twOS);
 }
 
 void rtClockCyclsISR(void)
 {
   Timer1ISR();
-  if(++TWcycl > TWcycls) 
+  if(++TWcycl >= TWcycls) 
   {
-    Timer1.stop();
+    halStepTimerStop();
     strcpy(Status,"Stopped");
   }
 }
 
+// Burst step engine, a cycle is done when the frame index wraps. At the end of the last
+// cycle the timer stops with the last frame latched.
+void BurstISR(void)
+{
+  Timer1ISR();
+  if(TWindx != 0) return;
+  if(--burst.left > 0) return;
+  halStepTimerStop();
+  burst.running = false;
+  burst.count++;
+  strcpy(Status,"Stopped");
+  if(burst.trigOut) pulseTrigOut();
+  if(burst.command) EventPush(&eventQueues[EVQ_STEP], EV_CMD, 0, 0);
+  if(burst.rearm) burst.armed = true;
+}
+
+// Starts a burst from the first frame of a cycle, called from an ISR or with interrupts
+// off. The first frame is latched now and the step timer counter is reloaded for a full
+// period so the burst has the same timing from the start every time.
+static void BurstStart(void)
+{
+  burst.armed = false;
+  burst.left = burst.cycles;
+  burst.running = true;
+  TWindx = 0;
+  TWclockCommit(&twClock);
+  strcpy(Status,"Burst");
+  halStepTimerAttach(BurstISR);
+  halStepTimerRestart();
+  BurstISR();
+}
+
 void setup() 
 {    
-  pinMode(0,OUTPUT);
-  pinMode(TrigOut,OUTPUT);
-  digitalWrite(TrigOut, LOW);
-  pinMode(Trig1,INPUT);
-  pinMode(Trig2,INPUT);
+  halPinMode(0,OUTPUT);
+  halPinMode(TrigOut,OUTPUT);
+  halDigitalWrite(TrigOut, LOW);
+  halPinMode(Trig1,INPUT);
+  halPinMode(Trig2,INPUT);
   // Read the flash config contents and test the signature
   mftdata = Rev_1_mftdata;
   Restore();
+  updateDACcodes();
   // Init serial communications
   SerialInit();
   Serial1.begin(mftdata.Baud);
-  analogReadResolution(12);
-  analogWriteResolution(12);
+  CompileCmdString(&cmdProgram[0], commandString[0]);
+  CompileCmdString(&cmdProgram[1], commandString[1]);
+  halAnalogResolution(12);
   // Configure Threads
   SystemThread.setName((char *)"Update");
   SystemThread.onRun(Update);
@@ -240,8 +595,10 @@ void setup()
   // Add thread to the controller
   control.add(&SystemThread);
   // Define the vector based on bit pattern
-  defineTWvector(0,mftdata.Fwd);
-  defineTWvector(1,mftdata.Fwd);
+  defineTWvector(0,mftdata.Fwd[0]);
+  defineTWvector(1,mftdata.Fwd[1]);
+  TWdirection(true);
+  TWopen();
   // Init the TwaveSwitch, open all switches
   MAX14802(0,0);
   // Start the clock
@@ -249,17 +606,25 @@ void setup()
   // The argument sets the timer period in uS
   // This is a 16 bit timer
   int p_uS = 1000000/(mftdata.Freq * 8);
-  Timer1.initialize(p_uS);
-  mftdata.Afreq = 1000000/(p_uS * 8);
-  Timer1.start();
-  Timer1.attachInterrupt(Timer1ISR);
+  halStepTimerBegin(p_uS);
+  twSplit.freq2 = mftdata.Freq;
+  updateTWclock();
+  TWclockCommit(&twClock);
+  halStepTimerStart();
+  halStepTimerAttach(Timer1ISR);
   // Init the TWI interface
-  Wire.begin();
+  I2Cbegin();
   // Init the DAC
-  MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl));
-  MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl));
-  MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, Value2Counts(mftdata.Guard,&mftdata.GRDctrl));
   MAX5815(mftdata.MAX5815add,3,0);
+  MAX5815group(true);
+  MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, dacCodes.tw[0]);
+  MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, dacCodes.tw[1]);
+  MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, dacCodes.guard);
+  MAX5815group(false);
+  // Start the background readback scan
+  ADCscanBegin();
+  TableBegin();
+  RampBegin();
 }
 
 // This function is called at 40 Hz
@@ -267,6 +632,8 @@ void Update(void)
 {
   float val;
   
+  // The background scan filters the readbacks as the samples arrive
+  if(adcScan) return;
   // Read the readback ADC values, filter and update global variables
   val = ReadADCchannel(mftdata.TW1mon,20);
   TW1readback = (1.0 - FILTER) * TW1readback + FILTER * val;
@@ -278,97 +645,117 @@ void Update(void)
   GRDreadback = (1.0 - FILTER) * GRDreadback + FILTER * val;
 }
 
+// Moves all the received characters from each serial port to its input ring buffer
 void ReadAllSerial(void)
 {
-  // Put serial received characters in the input ring buffer
-  if (Serial1.available() > 0)
-  {
-    serial = &Serial1;
-    PutCh(Serial1.read());
-  }
-  // Put serial received characters in the input ring buffer
-  if (Serial.available() > 0)
-  {
-    serial = &Serial;
-    PutCh(Serial.read());
-  }
+  for (int i = 0; i < NUM_CMDPORTS; i++) RB_Read(&CmdPorts[i].rb, CmdPorts[i].stream);
 }
 
 // This function process all the serial IO and commands
 void ProcessSerial(bool scan)
 {
-  // Put serial received characters in the input ring buffer
-  if (Serial1.available() > 0)
-  {
-    serial = &Serial1;
-    PutCh(Serial1.read());
-  }
-  // Put serial received characters in the input ring buffer
-  if (Serial.available() > 0)
-  {
-    serial = &Serial;
-    PutCh(Serial.read());
-  }
+  ReadAllSerial();
   if (!scan) return;
-  // If there is a command in the input ring buffer, process it!
-  //if (RB_Commands(&RB) > 0) while (ProcessCommand() == 0); // Process until there is nothing to do
-  while (RB_Commands(&RB) > 0) ProcessCommand();
-  //if((RB_Size(&RB) == 0) && TrigCommandString)
-  if(TrigCommandString)
+  // If there is a command in a port's input ring buffer, process it!
+  // Process until there is nothing to do. Trigger events run before each command so
+  // queued serial commands don't delay them, inside a ; separated DAC group they wait
+  // for the end of its line so the group still loads together.
+  for (int i = 0; i < NUM_CMDPORTS; i++)
   {
-    TrigCommandString = false;
-    executeCommandString();
-    if(SerialMute)
-    {
-      //while (RB_Commands(&RB) > 0) while (ProcessCommand() == 0);
-      while (RB_Commands(&RB) > 0) ProcessCommand();
-    }
-    else
+    do
     {
-      SerialMute=true;
-      //while (RB_Commands(&RB) > 0) while (ProcessCommand() == 0);
-      while (RB_Commands(&RB) > 0) ProcessCommand();
-      SerialMute=false;
-    }
+      if (!CmdPorts[i].dacGroup) ProcessEvents();
+    } while (ProcessCommand(&CmdPorts[i]) == 0);
   }
+  SendTelemetry();
+  SendAllSerial();
 }
 
 void loop() 
 {
   ProcessSerial();
+  ADCscanProcess();
   control.run();
 }
 
 // Counter function
 
-void advanceCounter(void)
+// Runs the queued trigger and clock events, oldest first. Any output goes to the last
+// port that sent a command.
+void ProcessEvents(void)
 {
-  pulseCounter.count++;
-  if(pulseCounter.count == pulseCounter.tcount)
+  EventQueue *q;
+  Event      *e, ev;
+
+  for(int n=0;n<EVQ_SIZE * EVQ_NUM;n++)
   {
-    if(pulseCounter.resetOnTcount) pulseCounter.count = 0;
-    if(pulseCounter.triggerOnTcount)
+    q = NULL;
+    e = NULL;
+    for(int i=0;i<EVQ_NUM;i++)
     {
-      if(digitalRead(TrigOut) == LOW)
-      {
-        digitalWrite(TrigOut, HIGH);
-        delayMicroseconds(5);
-        digitalWrite(TrigOut, LOW);
-      }
-      else
-      {
-        digitalWrite(TrigOut, LOW);
-        delayMicroseconds(5);
-        digitalWrite(TrigOut, HIGH);        
-      }
+      Event *next = EventPeek(&eventQueues[i]);
+      if(next == NULL) continue;
+      if((e == NULL) || ((int32_t)(next->time - e->time) < 0)) { q = &eventQueues[i]; e = next; }
     }
-    if(pulseCounter.commandOnTcount)
+    if(q == NULL) return;
+    ev = *e;
+    EventPop(q);
+    switch(ev.action)
     {
-      TrigCommandString = true;
+      case EV_CMD:
+        serial = &cmdPort->tx;
+        executeCommandString();
+        break;
+      default:
+        break;
     }
   }
 }
 
+// Returns the number of trigger and clock events lost because the main loop fell behind
+void getEventOverflows(void)
+{
+  uint32_t n = 0;
+
+  for(int i=0;i<EVQ_NUM;i++) n += eventQueues[i].overflows;
+  SendACKonly;
+  if(!SerialMute) serial->println(n);
+}
+
+volatile bool trigOutPulsing = false;
+int           trigOutIdle;
+
+// Pulse timer ISR, ends the TrigOut pulse
+static void trigOutPulseEnd(void)
+{
+  halPulseTimerEnd();
+  halDigitalWrite(TrigOut, trigOutIdle);
+  trigOutPulsing = false;
+}
+
+// Pulses TrigOut away from its current level for 5uS. The pulse timer ends the pulse so
+// the ISRs that call this don't wait, a pulse started during a pulse extends it.
+void pulseTrigOut(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  if(!trigOutPulsing) trigOutIdle = halDigitalRead(TrigOut);
+  trigOutPulsing = true;
+  halDigitalWrite(TrigOut, !trigOutIdle);
+  halPulseTimerBegin(trigOutPulseEnd, 5);
+}
+
+// Called from the trigger and clock ISRs, q is the calling ISR's event queue
+void advanceCounter(EventQueue *q)
+{
+  pulseCounter.count++;
+  if(pulseCounter.count == pulseCounter.tcount)
+  {
+    if(pulseCounter.resetOnTcount) pulseCounter.count = 0;
+    if(pulseCounter.triggerOnTcount) pulseTrigOut();
+    if(pulseCounter.commandOnTcount) EventPush(q, EV_CMD, 0, 0);
+  }
+}
+
 //
 // Host command functions
 //
@@ -412,46 +799,71 @@ bool checkTF(char *str, bool *val)
 // actions: command, user must replace commas with _ or action can be a value or change string
 bool checkIF(char *str, float *change)
 {
-  String cond;
+  Span   cond;
   bool   res;
   float  val;
-
-  cond = str;
-  cond.trim();
-  if(cond.startsWith("<="))      res = *change <= cond.substring(2).toFloat();
-  else if(cond.startsWith(">=")) res = *change >= cond.substring(2).toFloat();
-  else if(cond.startsWith(">"))  res = *change >  cond.substring(1).toFloat();
-  else if(cond.startsWith("<"))  res = *change <  cond.substring(1).toFloat();
-  else if(cond.startsWith("="))  res = *change == cond.substring(1).toFloat();
+  int    i;
+  char   action[MAXCMDLEN];
+
+  // Compiled command strings pass the decoded conditional
+  if((ifOp != NULL) && (str == ifArg)) return checkIF(ifOp, change);
+  cond = SpanTrim(str);
+  if(SpanStartsWith(cond,"<="))      res = *change <= SpanToFloat(SpanFrom(cond,2));
+  else if(SpanStartsWith(cond,">=")) res = *change >= SpanToFloat(SpanFrom(cond,2));
+  else if(SpanStartsWith(cond,">"))  res = *change >  SpanToFloat(SpanFrom(cond,1));
+  else if(SpanStartsWith(cond,"<"))  res = *change <  SpanToFloat(SpanFrom(cond,1));
+  else if(SpanStartsWith(cond,"="))  res = *change == SpanToFloat(SpanFrom(cond,1));
   else return false;
   // Here with an if condition with the bool result in res
   // Find first |
-  if(cond.indexOf('|') == -1) return true;
-  cond.remove(0,cond.indexOf('|')+1);
+  if((i = SpanIndexOf(cond,'|')) == -1) return true;
+  cond = SpanFrom(cond,i+1);
   if(!res)
   {
     // If false find the second |
-    if(cond.indexOf('|') == -1) return true;
-    cond.remove(0,cond.indexOf('|')+1);
+    if((i = SpanIndexOf(cond,'|')) == -1) return true;
+    cond = SpanFrom(cond,i+1);
   }
-  if(cond.indexOf('|') != -1) cond.remove(cond.indexOf('|'));
+  if((i = SpanIndexOf(cond,'|')) != -1) cond.len = i;
   // Now process the token
-  if(checkChange((char *)cond.c_str(), &val)) {*change += val; return true;}
-  cond.trim();
-  if(isDigit(cond[0]) || (cond[0] == '.') || (cond[0] == '-'))
+  SpanCopy(SpanTrim(cond), action, sizeof(action));
+  if(checkChange(action, &val)) {*change += val; return true;}
+  if(isDigit(action[0]) || (action[0] == '.') || (action[0] == '-'))
   {
     // If here is a value
-    *change = cond.toFloat();
+    *change = atof(action);
   }
   else
   {
     // If here its a command
-    cond.replace("_",",");
-    executeCommand((char *)cond.c_str());
+    for(i=0;action[i]!=0;i++) if(action[i] == '_') action[i] = ',';
+    executeCommand(action);
   }
   return true;
 }
 
+// Runs a conditional decoded by the command string compiler, a command action is
+// run after the current command
+bool checkIF(const CmdOp *op, float *change)
+{
+  const CondAction *action;
+  bool             res;
+
+  switch(op->cond)
+  {
+    case 'L': res = *change <= op->condVal; break;
+    case 'G': res = *change >= op->condVal; break;
+    case '>': res = *change >  op->condVal; break;
+    case '<': res = *change <  op->condVal; break;
+    default:  res = *change == op->condVal; break;
+  }
+  action = &op->action[res ? 0 : 1];
+  if(action->type == CP_VALUE) *change = action->val;
+  else if(action->type == CP_CHANGE) *change += action->val;
+  else if(action->type == CP_CMD) ifAction = action->op;
+  return true;
+}
+
 bool checkIF(char *str, int *change)
 {
   float val;
@@ -468,48 +880,43 @@ bool checkIF(char *str, int *change)
 // Checks for +=value or -=value, returns true and the signed change
 bool checkChange(char *str, float *change)
 {
-  String token;
+  Span   token;
   float  val;
 
-  token = str;
-  token.trim();
-  if(token.startsWith("+=")) val = 1;
-  else if(token.startsWith("-=")) val = -1;
+  token = SpanTrim(str);
+  if(SpanStartsWith(token,"+=")) val = 1;
+  else if(SpanStartsWith(token,"-=")) val = -1;
   else return false;
-  token.remove(0,2);
-  *change = val * token.toFloat();
+  *change = val * SpanToFloat(SpanFrom(token,2));
   return true;
 }
 
 bool checkChange(char *str, int *change)
 {
-  String token;
+  Span token;
   int  val;
 
-  token = str;
-  token.trim();
-  if(token.startsWith("+=")) val = 1;
-  else if(token.startsWith("-=")) val = -1;
+  token = SpanTrim(str);
+  if(SpanStartsWith(token,"+=")) val = 1;
+  else if(SpanStartsWith(token,"-=")) val = -1;
   else return false;
-  token.remove(0,2);
-  *change = val * token.toInt();
+  *change = val * SpanToInt(SpanFrom(token,2));
   return true;
 }
 
 bool checkPattern(char *str, int *ptrn)
 {
-  String token;
+  Span   token;
   int    bi  = 0;
   int    val = 0;
 
-  token = str;
-  token.trim();
-  if((token.length() <= 8) && (token.length() > 0))
+  token = SpanTrim(str);
+  if((token.len <= 8) && (token.len > 0))
   {
-    for(int i = token.length()-1;i>=0;i--)
+    for(int i = token.len-1;i>=0;i--)
     {
-      if(token.charAt(i) == '1') val |= 1 << bi;
-      else if(token.charAt(i) != '0')
+      if(token.str[i] == '1') val |= 1 << bi;
+      else if(token.str[i] != '0')
       {
         SetErrorCode(ERR_BADCMD);
         SendNAK;
@@ -527,18 +934,20 @@ bool checkPattern(char *str, int *ptrn)
 
 bool checkTrigFunc(char *value, TriggerFunction *tf)
 {
-  String token;
-
-  token = value;
-  token.trim();
-  if(token == "REV1")          *tf = REV1_TF;
-  else if(token == "REV2")     *tf = REV2_TF;
-  else if(token == "OPEN1")    *tf = OPEN1_TF;
-  else if(token == "OPEN2")    *tf = OPEN2_TF;
-  else if(token == "CMD")      *tf = CMD_TF;
-  else if(token == "CNT")      *tf = CNT_TF;
-  else if(token == "TWALT1")   *tf = TWALT1_TF;
-  else if(token == "TWALT2")   *tf = TWALT2_TF;
+  Span token;
+
+  token = SpanTrim(value);
+  if(SpanEquals(token,"REV1"))          *tf = REV1_TF;
+  else if(SpanEquals(token,"REV2"))     *tf = REV2_TF;
+  else if(SpanEquals(token,"OPEN1"))    *tf = OPEN1_TF;
+  else if(SpanEquals(token,"OPEN2"))    *tf = OPEN2_TF;
+  else if(SpanEquals(token,"CMD"))      *tf = CMD_TF;
+  else if(SpanEquals(token,"CNT"))      *tf = CNT_TF;
+  else if(SpanEquals(token,"TWALT1"))   *tf = TWALT1_TF;
+  else if(SpanEquals(token,"TWALT2"))   *tf = TWALT2_TF;
+  else if(SpanEquals(token,"RAMP"))     *tf = RAMP_TF;
+  else if(SpanEquals(token,"TBL"))      *tf = TBL_TF;
+  else if(SpanEquals(token,"BURST"))    *tf = BURST_TF;
   else
   {
    SetErrorCode(ERR_BADARG);
@@ -550,14 +959,13 @@ bool checkTrigFunc(char *value, TriggerFunction *tf)
 
 bool checkTrigMode(char *value, TriggerMode *tm)
 {
-  String token;
+  Span token;
 
-  token = value;
-  token.trim();
-  if(token == "POS")         *tm = POS_MODE;
-  else if(token == "NEG")    *tm = NEG_MODE;
-  else if(token == "CHANGE") *tm = CHANGE_MODE;
-  else if(token == "NA")     *tm = NA_MODE;
+  token = SpanTrim(value);
+  if(SpanEquals(token,"POS"))         *tm = POS_MODE;
+  else if(SpanEquals(token,"NEG"))    *tm = NEG_MODE;
+  else if(SpanEquals(token,"CHANGE")) *tm = CHANGE_MODE;
+  else if(SpanEquals(token,"NA"))     *tm = NA_MODE;
   else
   {
    *tm = NA_MODE;
@@ -571,7 +979,7 @@ bool checkTrigMode(char *value, TriggerMode *tm)
 void SaveSettings(void)
 {
   mftdata.Signature = SIGNATURE;
-  EEPROM.put(eeAddress, mftdata);
+  halEEPROMwrite(eeAddress, &mftdata, sizeof(MFTdata));
   SendACK;
 }
 
@@ -580,7 +988,7 @@ bool Restore(void)
   static MFTdata twsd;
 
   // Read the flash config contents and test the signature
-  EEPROM.get(eeAddress, twsd);
+  halEEPROMread(eeAddress, &twsd, sizeof(MFTdata));
   if(twsd.Signature == SIGNATURE) 
   {
     mftdata = twsd;
@@ -593,6 +1001,7 @@ void RestoreSettings(void)
 {
   if(Restore()) 
   {
+    updateDACcodes();
     SendACK; 
   }
   else
@@ -605,17 +1014,9 @@ void RestoreSettings(void)
 
 void Software_Reset(void)
 {
-  // in globals declaration section
-  #define CPU_RESTART_ADDR (uint32_t *)0xE000ED0C
-  #define CPU_RESTART_VAL 0x5FA0004
-  #define CPU_RESTART (*CPU_RESTART_ADDR = CPU_RESTART_VAL);
-
-
-  // Then in loop do something like
-
-  if (digitalRead(2) == HIGH)
+  if (halDigitalRead(2) == HIGH)
   {
-    CPU_RESTART;
+    halReset();
   }
 }
 
@@ -629,10 +1030,70 @@ void Debug(int i)
 {
 }
 
+// Sets the step timing for mftdata.Freq, 8 steps of twOS frames per cycle, and computes
+// the actual frequency. Timer1 gets the period in bus clocks with a fraction the ISR
+// dithers, the prescale is used for the low frequencies. In CYCLE update mode a running
+// step timer gets the period staged for the next cycle. DMA playback uses the 24MHz PIT
+// period closest to the request and split step clocks set each channel's period, TW2
+// runs at twSplit.freq2, both load the new period at the end of the current step.
+void updateTWclock(void)
+{
+  uint64_t p;
+  int      shift = 0;
+  float    period;
+  bool     stage;
+
+  if(mftdata.Freq > TWmaxFrequency()) mftdata.Freq = TWmaxFrequency();
+  period = 1000000.0 / (mftdata.Freq * 8 * twOS);
+
+  if(twSplitMode)
+  {
+    if(twSplit.freq2 > TWmaxFrequency()) twSplit.freq2 = TWmaxFrequency();
+    TWsplitSetFreq(0, mftdata.Freq);
+    TWsplitSetFreq(1, twSplit.freq2);
+    twClock.afreq = twSplit.afreq[0];
+  }
+  else if(twDMAmode)
+  {
+    TWdmaSetPeriod(period);
+    twClock.afreq = 1000000.0 / (TWdmaPeriod(period) * 8 * twOS);
+  }
+  else
+  {
+    // Step period in 32.32 fixed point ticks
+    p = (((uint64_t)HAL_STEP_CLOCK << 32) + mftdata.Freq * 4 * twOS) / (mftdata.Freq * 8 * twOS);
+    while(((p >> 32) > HAL_STEP_MAXTICKS) && (shift < 7)) { p >>= 1; shift++; }
+    if((p >> 32) >= HAL_STEP_MAXTICKS) p = (uint64_t)HAL_STEP_MAXTICKS << 32;
+    stage = (twUpdate == TW_UPD_CYCLE) && (strcmp(Status,"Stopped") != 0);
+    {
+      AtomicBlock< Atomic_RestoreState > a_Block;
+      if(stage)
+      {
+        twClock.sticks = p >> 32;
+        twClock.sfrac = p & 0xFFFFFFFF;
+        twClock.sprescale = shift;
+        twClock.staged = true;
+      }
+      else
+      {
+        twClock.ticks = p >> 32;
+        twClock.frac = p & 0xFFFFFFFF;
+        twClock.prescale = shift;
+        twClock.extra = false;
+        twClock.staged = false;
+        halStepTimerTicks(twClock.ticks, shift);
+      }
+    }
+    twClock.afreq = (double)HAL_STEP_CLOCK * 4294967296.0 / ((double)p * (1 << shift) * 8 * twOS);
+  }
+  mftdata.Afreq = twClock.afreq + 0.5;
+  // Keep the sync sample delay inside the new step period
+  ADCsyncLimit(1000000/(mftdata.Freq * 8) - 1);
+}
+
 void SetFrequency(char *value)
 {
-  String token;
-  int    freq, p_uS;
+  int    freq;
 
   freq = mftdata.Freq;
   if(checkIF(value, &freq)) freq = freq;
@@ -640,18 +1101,12 @@ void SetFrequency(char *value)
   {
     freq += mftdata.Freq;
   }
-  else
-  {
-    token = value;
-    freq = token.toInt();
-  }
-  if(freq > mftdata.maxFreq) freq = mftdata.maxFreq;
+  else freq = atoi(value);
+  if(freq > TWmaxFrequency()) freq = TWmaxFrequency();
   if(freq < mftdata.minFreq) freq = mftdata.minFreq;
   if(freq < 1) freq = 1;
   mftdata.Freq = freq;
-  p_uS = 1000000/(mftdata.Freq * 8);
-  Timer1.setPeriod(p_uS);
-  mftdata.Afreq = 1000000/(p_uS * 8);
+  updateTWclock();
   SendACK;
 }
 
@@ -661,7 +1116,7 @@ void SetFWDir(char *chan, char *fwd)
 
   if((ch=checkCH(chan)) == -1) return;
   if(!checkTF(fwd, &mftdata.Fwd[ch])) return;
-  defineTWvector(ch,mftdata.Fwd[ch]);
+  TWdirection(twUpdate == TW_UPD_STEP);
   SendACK;
 }
 
@@ -695,82 +1150,739 @@ void GetPattern(int ch)
 
 void StartTwave(void)
 {
-  Timer1.start();
-  Timer1.attachInterrupt(Timer1ISR);
+  burst.running = false;
+  if(twDMAmode) TWdmaRun(true);
+  else if(twSplitMode) TWsplitRun(true);
+  else
+  {
+    TWclockCommit(&twClock);
+    halStepTimerStart();
+    halStepTimerAttach(Timer1ISR);
+  }
   strcpy(Status,"Running");
   SendACK;  
 }
 
 void StopTwave(void)
 {
-  Timer1.stop();
+  if(twDMAmode) TWdmaRun(false);
+  else if(twSplitMode) TWsplitRun(false);
+  else halStepTimerStop();
+  burst.running = false;
   strcpy(Status,"Stopped");
   SendACK;
 }
 
 void MoveNcycles(int N)
 {
+  if(twDMAmode || twSplitMode) ERR(ERR_NOTSUPPORTED);
   TWcycl = 0;
-  TWcycls = N;
-  Timer1.attachInterrupt(rtClockCyclsISR);
-  Timer1.start();
+  TWcycls = N * twOS;
+  halStepTimerAttach(rtClockCyclsISR);
+  halStepTimerStart();
   strcpy(Status,"Stepping");
   SendACK;
 }
 
-void toggleTWaltV(int chan)
+// Selects DMA driven playback, TRUE or FALSE. The waveform keeps its running state.
+void setDMAmode(char *val)
 {
-  static bool state[2] = {false,false};
+  bool mode;
+  bool running;
 
-  if(chan == 0)
+  if(!checkTF(val, &mode)) return;
+  if(mode == twDMAmode) {SendACK; return;}
+  if(twSplitMode) ERR(ERR_NOTSUPPORTED);
+  // The DMA playback has no step interrupt to start the sync conversions
+  if(mode && adcSync.enabled) ERR(ERR_NOTSUPPORTED);
+  running = (strcmp(Status,"Running") == 0);
+  if(mode)
   {
-    if(state[chan]) MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl));
-    else MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWaltV[0],&mftdata.TW1ctrl));
+    halStepTimerStop();
+    if(!TWdmaBegin(1000000.0/(mftdata.Freq * 8)))
+    {
+      if(running) halStepTimerStart();
+      ERR(ERR_CANTALLOCATE);
+    }
+    if(running) TWdmaRun(true);
   }
-  else if(chan == 1)
+  else
   {
-    if(state[chan]) MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl));
-    else MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWaltV[1],&mftdata.TW2ctrl));    
+    TWdmaEnd();
+    halStepTimerAttach(Timer1ISR);
+    if(running) halStepTimerStart();
   }
-  if(state[chan]) state[chan] = false;
-  else state[chan] = true;
+  // The open mask is built into the frames in DMA mode only
+  if(twEngine.open != 0xFFFFFFFF) updateTWframes(true);
+  updateTWclock();
+  TWclockCommit(&twClock);
+  SendACK;
 }
 
-void setTWaltV(int chan, bool useALT)
+// Selects independent TW1 and TW2 step clocks, TRUE or FALSE. TW1 runs at the frequency
+// and TW2 at the TW2 frequency. The waveform keeps its running state. Not supported with
+// DMA playback, synchronous sampling only runs with the shared step clock.
+void setSplitMode(char *val)
 {
-  if(useALT)
+  bool mode;
+  bool running;
+
+  if(!checkTF(val, &mode)) return;
+  if(mode == twSplitMode) {SendACK; return;}
+  if(twDMAmode) ERR(ERR_NOTSUPPORTED);
+  running = (strcmp(Status,"Running") == 0);
+  if(mode)
   {
-    if(chan == 0) 
-      MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWaltV[0],&mftdata.TW1ctrl));
-    if(chan == 1) 
-      MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWaltV[1],&mftdata.TW2ctrl));
+    halStepTimerStop();
+    TWsplitBegin();
+    updateTWframes(true);
+    updateTWclock();
+    if(running) TWsplitRun(true);
   }
   else
   {
-    if(chan == 0) 
-      MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl));
-    if(chan == 1) 
-      MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl));    
+    TWsplitEnd();
+    updateTWframes(false);
+    updateTWclock();
+    TWclockCommit(&twClock);
+    if(running) halStepTimerStart();
+  }
+  SendACK;
+}
+
+// Sets the TW2 frequency used with split step clocks
+void SetFrequency2(char *value)
+{
+  int freq;
+
+  if(checkChange(value, &freq)) freq += twSplit.freq2;
+  else freq = atoi(value);
+  if(freq > TWmaxFrequency()) freq = TWmaxFrequency();
+  if(freq < mftdata.minFreq) freq = mftdata.minFreq;
+  if(freq < 1) freq = 1;
+  twSplit.freq2 = freq;
+  updateTWclock();
+  SendACK;
+}
+
+// Selects when waveform changes made while running take effect. STEP applies them on
+// the next step, a frame table with a different cycle length still waits for the cycle
+// boundary. CYCLE stages the frames and the step period and commits them together at
+// the next cycle boundary.
+void setUpdateMode(char *mode)
+{
+  Span token;
+
+  token = SpanTrim(mode);
+  if(SpanEquals(token,"STEP"))        twUpdate = TW_UPD_STEP;
+  else if(SpanEquals(token,"CYCLE"))  twUpdate = TW_UPD_CYCLE;
+  else BADARG;
+  SendACK;
+}
+
+void getUpdateMode(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  if(twUpdate == TW_UPD_STEP) serial->println("STEP");
+  else serial->println("CYCLE");
+}
+
+//
+// Burst commands
+//
+
+// Starts an armed burst, called from the trigger ISRs
+void burstTrigger(void)
+{
+  if(burst.armed && !twDMAmode && !twSplitMode) BurstStart();
+}
+
+// Returns true if a burst can be played, sends the NAK if not. Bursts use the step
+// timer, not DMA playback or split step clocks.
+static bool burstReady(void)
+{
+  if(!twDMAmode && !twSplitMode) return true;
+  SetErrorCode(ERR_NOTSUPPORTED);
+  SendNAK;
+  return false;
+}
+
+void setBurstCycles(int n)
+{
+  if(n < 1) BADARG;
+  burst.cycles = n;
+  SendACK;
+}
+
+// Plays a burst now, any waveform playing is stopped
+void startBurst(void)
+{
+  if(!burstReady()) return;
+  {
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    halStepTimerStop();
+    BurstStart();
+  }
+  SendACK;
+}
+
+// Plays a burst on the next BURST trigger, with rearm set every trigger plays a burst
+// once the last one is done
+void armBurst(void)
+{
+  if(!burstReady()) return;
+  burst.armed = true;
+  SendACK;
+}
+
+// Disarms and ends a burst, the output holds the last frame
+void stopBurst(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  burst.armed = false;
+  if(burst.running)
+  {
+    halStepTimerStop();
+    burst.running = false;
+    strcpy(Status,"Stopped");
+  }
+  SendACK;
+}
+
+void getBurstStatus(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  if(burst.running) serial->println("RUNNING");
+  else if(burst.armed) serial->println("ARMED");
+  else serial->println("IDLE");
+}
+
+// Phase synchronous readback sampling, step is 0 through 7 or -1 for all steps and
+// delay is the uS from the step latch to the sample, less than the step period
+void setSync(int step, int delay)
+{
+  if((step < -1) || (step >= ADC_STEPS)) BADARG;
+  if((delay < 0) || (delay >= 1000000/(mftdata.Freq * 8))) BADARG;
+  ADCsyncSet(step, delay);
+  SendACK;
+}
+
+void getSync(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  serial->print(adcSync.step);
+  serial->print(",");
+  serial->println(adcSync.delay);
+}
+
+void setSyncEnable(char *val)
+{
+  bool mode;
+
+  if(!checkTF(val, &mode)) return;
+  if(mode)
+  {
+    // The DMA playback has no step interrupt to start the conversions
+    if(twDMAmode) ERR(ERR_NOTSUPPORTED);
+    if(!ADCsyncBegin()) ERR(ERR_ADCNOTAVALIABLE);
   }
+  else ADCsyncEnd();
+  SendACK;
+}
+
+// Returns the 8 step averages for a readback, 1 = TW1, 2 = TW2, 3 = guard. NA for a
+// step with no samples
+void getSyncProfile(int ch)
+{
+  float val;
+
+  if((ch < 1) || (ch > ADC_SCAN_NUM)) BADARG;
+  SendACKonly;
+  if(SerialMute) return;
+  for(int i=0;i<ADC_STEPS;i++)
+  {
+    if(i > 0) serial->print(",");
+    if(ADCsyncValue(ch - 1, i, &val)) serial->print(val);
+    else serial->print("NA");
+  }
+  serial->println("");
+}
+
+void clearSync(void)
+{
+  ADCsyncClear();
+  SendACK;
+}
+
+void testDMAchain(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  if(TWdmaVerify()) serial->println("PASS");
+  else serial->println("FAIL");
+}
+
+//
+// Ramp engine. The ramp values are computed from the time since the ramps started, so
+// a late update does not shift the rest of the ramp.
+//
+
+// Returns a ramp's value t uS after the start
+float rampValue(Ramp *r, uint32_t t)
+{
+  float f;
+
+  if(t >= r->duration * 1000) return r->end;
+  f = (float)t / ((float)r->duration * 1000.0);
+  if(r->shape == RAMP_EXP) return r->start * expf(r->k * f);
+  return r->start + (r->end - r->start) * f;
+}
+
+// Moves the ramp targets to their values t uS after the start, called from the ramp
+// timer ISR. The DAC writes are queued without waiting, a write the I2C queue can not
+// take is tried again on the next tick.
+void rampUpdate(uint32_t t)
+{
+  Ramp     *r = rampEngine.ramp;
+  DACcodes codes = dacCodes;
+  float    val;
+  int      freq;
+
+  if(r[RAMP_FREQ].enabled)
+  {
+    freq = rampValue(&r[RAMP_FREQ], t) + 0.5;
+    if(freq > TWmaxFrequency()) freq = TWmaxFrequency();
+    if(freq < mftdata.minFreq) freq = mftdata.minFreq;
+    if(freq < 1) freq = 1;
+    if(freq != mftdata.Freq)
+    {
+      mftdata.Freq = freq;
+      updateTWclock();
+    }
+  }
+  if(!r[RAMP_TWV1].enabled && !r[RAMP_TWV2].enabled && !r[RAMP_GRD].enabled) return;
+  for(int ch=0;ch<2;ch++)
+  {
+    if(!r[RAMP_TWV1 + ch].enabled) continue;
+    val = rampValue(&r[RAMP_TWV1 + ch], t);
+    if(val > mftdata.maxTWV[ch]) val = mftdata.maxTWV[ch];
+    if(val < mftdata.minTWV[ch]) val = mftdata.minTWV[ch];
+    mftdata.TWvoltage[ch] = val;
+  }
+  if(r[RAMP_GRD].enabled)
+  {
+    val = rampValue(&r[RAMP_GRD], t);
+    if(val > mftdata.maxGuard) val = mftdata.maxGuard;
+    if(val < mftdata.minGuard) val = mftdata.minGuard;
+    mftdata.Guard = val;
+  }
+  updateDACcodes();
+  if((dacCodes.tw[0] != codes.tw[0]) && !MAX5815load(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, dacCodes.tw[0])) dacCodes.tw[0] = codes.tw[0];
+  if((dacCodes.tw[1] != codes.tw[1]) && !MAX5815load(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, dacCodes.tw[1])) dacCodes.tw[1] = codes.tw[1];
+  if((dacCodes.guard != codes.guard) && !MAX5815load(mftdata.MAX5815add, mftdata.GRDctrl.Chan, dacCodes.guard)) dacCodes.guard = codes.guard;
+}
+
+// Ramp timer ISR, updates the running ramps every RAMP_TICK uS and ends them at the end
+// of the longest ramp
+static void RampISR(void)
+{
+  uint32_t now,t;
+
+  if(!rampEngine.running)
+  {
+    halRampTimerStop();
+    return;
+  }
+  while(true)
+  {
+    if((int32_t)(halRampTimerNow() - rampEngine.next) < 0)
+    {
+      halRampTimerAt(rampEngine.next);
+      // Done unless the time was reached while the compare was set
+      if((int32_t)(halRampTimerNow() - rampEngine.next) < 0) return;
+    }
+    now = halRampTimerNow();
+    t = now - rampEngine.start;
+    rampUpdate(t);
+    if(t >= rampEngine.length)
+    {
+      rampEngine.running = false;
+      halRampTimerStop();
+      pulseTrigOut();
+      return;
+    }
+    while((int32_t)(now - rampEngine.next) >= 0) rampEngine.next += RAMP_TICK;
+  }
+}
+
+void RampBegin(void)
+{
+  halRampTimerBegin(RampISR);
+}
+
+// Starts the armed ramps, called by the trigger ISRs or with interrupts off
+void rampTrigger(void)
+{
+  if(!rampEngine.armed) return;
+  rampEngine.armed = false;
+  rampEngine.start = halRampTimerNow();
+  rampEngine.next = rampEngine.start;
+  rampEngine.running = true;
+  pulseTrigOut();
+  RampISR();
+}
+
+// Reads the ramp type and channel from the command line, FREQ, TWV,chan or GRD. Returns
+// the ramp target or -1 after sending the NAK.
+int rampTarget(void)
+{
+  char *tkn;
+
+  if((tkn = TokenFromCommandLine(',')) != NULL)
+  {
+    if(strcmp(tkn,"FREQ") == 0) return RAMP_FREQ;
+    if(strcmp(tkn,"GRD") == 0)  return RAMP_GRD;
+    if((strcmp(tkn,"TWV") == 0) && ((tkn = TokenFromCommandLine(',')) != NULL))
+    {
+      if(strcmp(tkn,"1") == 0) return RAMP_TWV1;
+      if(strcmp(tkn,"2") == 0) return RAMP_TWV2;
+    }
+  }
+  SetErrorCode(ERR_BADARG);
+  SendNAK;
+  return -1;
+}
+
+// Called with parameters in the ring buffer, type,chan,start,end,mS,LIN|EXP. The chan is
+// only entered for TWV, the values are clamped to the limits as the ramp runs.
+void setRamp(void)
+{
+  char  *tkn;
+  Ramp  r;
+  int   target;
+
+  if((target = rampTarget()) == -1) return;
+  while(true)
+  {
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    r.start = atof(tkn);
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    r.end = atof(tkn);
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    if(atoi(tkn) <= 0) break;
+    r.duration = atoi(tkn);
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    if(strcmp(tkn,"LIN") == 0) r.shape = RAMP_LIN;
+    else if(strcmp(tkn,"EXP") == 0) r.shape = RAMP_EXP;
+    else break;
+    r.k = 0;
+    if(r.shape == RAMP_EXP)
+    {
+      // Exponential ramps can not start, end or cross 0
+      if((r.start * r.end) <= 0) break;
+      r.k = logf(r.end / r.start);
+    }
+    if(rampEngine.running)
+    {
+      SetErrorCode(ERR_BADARG);
+      SendNAK;
+      return;
+    }
+    r.enabled = true;
+    rampEngine.ramp[target] = r;
+    SendACK;
+    return;
+  }
+  BADARG;
+}
+
+// Called with parameters in the ring buffer, type,chan. Returns start,end,mS,shape or NA
+// if the ramp is not set
+void getRamp(void)
+{
+  Ramp *r;
+  int  target;
+
+  if((target = rampTarget()) == -1) return;
+  r = &rampEngine.ramp[target];
+  SendACKonly;
+  if(SerialMute) return;
+  if(!r->enabled)
+  {
+    serial->println("NA");
+    return;
+  }
+  serial->print(r->start);
+  serial->print(",");
+  serial->print(r->end);
+  serial->print(",");
+  serial->print(r->duration);
+  serial->print(",");
+  if(r->shape == RAMP_EXP) serial->println("EXP");
+  else serial->println("LIN");
+}
+
+void clearRamps(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  rampEngine.armed = false;
+  rampEngine.running = false;
+  halRampTimerStop();
+  for(int i=0;i<RAMP_NUM;i++) rampEngine.ramp[i].enabled = false;
+  SendACK;
+}
+
+// Finds the longest ramp, returns false after sending the NAK if there are no ramps
+bool rampLength(void)
+{
+  rampEngine.length = 0;
+  for(int i=0;i<RAMP_NUM;i++)
+  {
+    if(!rampEngine.ramp[i].enabled) continue;
+    if(rampEngine.ramp[i].duration * 1000 > rampEngine.length) rampEngine.length = rampEngine.ramp[i].duration * 1000;
+  }
+  if(rampEngine.length > 0) return true;
+  SetErrorCode(ERR_BADARG);
+  SendNAK;
+  return false;
+}
+
+void runRamps(void)
+{
+  if(rampEngine.running || !rampLength()) return;
+  {
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    rampEngine.armed = true;
+    rampTrigger();
+  }
+  SendACK;
+}
+
+// The ramps start on the next RAMP trigger edge
+void armRamps(void)
+{
+  if(rampEngine.running || !rampLength()) return;
+  rampEngine.armed = true;
+  SendACK;
+}
+
+// Stops the ramps, the targets hold their present values
+void stopRamps(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  rampEngine.armed = false;
+  rampEngine.running = false;
+  halRampTimerStop();
+  SendACK;
+}
+
+void getRampStatus(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  if(rampEngine.running) serial->println("RUNNING");
+  else if(rampEngine.armed) serial->println("ARMED");
+  else serial->println("IDLE");
+}
+
+//
+// Step sequence commands
+//
+
+// Returns true if the channel's cycle length n fits with the other channel's cycle,
+// sends the NAK if not
+bool checkCycleFrames(int ch, int n)
+{
+  if(TWcycleFrames(n, TWchannelFrames(ch ^ 1)) <= TW_MAXFRAMES) return true;
+  SetErrorCode(ERR_TBLTOOBIG);
+  SendNAK;
+  return false;
+}
+
+// Removes a channel's sequence, if it was playing the channel returns to its bit pattern
+void clearSequence(int ch)
+{
+  if((ch = checkCH(ch)) == -1) return;
+  twSeq.num[ch] = 0;
+  defineTWvector(ch,mftdata.Fwd[ch]);
+  SendACK;
+}
+
+// Called with parameters in the ring buffer, chan,step,step,... Adds steps to the end of
+// a channel's sequence. A step is the 8 bit binary electrode mask, optionally followed by
+// :dwell, the number of step periods it is held, 1 to 256.
+void addSequence(void)
+{
+  char     *tkn;
+  uint16_t steps[TW_MAXSEQ];
+  int      ch, num, mask, dwell, frames = 0;
+
+  if((tkn = TokenFromCommandLine(',')) == NULL) BADARG;
+  if((ch = checkCH(tkn)) == -1) return;
+  num = twSeq.num[ch];
+  memcpy(steps, twSeq.steps[ch], num * sizeof(uint16_t));
+  while((tkn = TokenFromCommandLine(',')) != NULL)
+  {
+    if(!checkPattern(tkn,&mask)) return;
+    dwell = 1;
+    if((tkn = TokenFromCommandLine(':')) != NULL)
+    {
+      dwell = atoi(tkn);
+      if((dwell < 1) || (dwell > 256)) BADARG;
+      // Only one dwell per step
+      if(TokenFromCommandLine(':') != NULL) BADARG;
+    }
+    if(num >= TW_MAXSEQ) ERR(ERR_TBLTOOBIG);
+    steps[num++] = TW_SEQSTEP(mask,dwell);
+  }
+  if(num == twSeq.num[ch]) BADARG;
+  for(int i=0;i<num;i++) frames += TW_SEQDWELL(steps[i]) * twOS;
+  if(frames > TW_MAXFRAMES) ERR(ERR_TBLTOOBIG);
+  if(twSeq.enabled[ch] && !checkCycleFrames(ch, frames)) return;
+  memcpy(twSeq.steps[ch], steps, num * sizeof(uint16_t));
+  twSeq.num[ch] = num;
+  if(twSeq.enabled[ch]) defineTWvector(ch,mftdata.Fwd[ch]);
+  SendACK;
+}
+
+// Returns a channel's sequence, mask:dwell for each step, the dwell is left off if 1
+void getSequence(int ch)
+{
+  if((ch = checkCH(ch)) == -1) return;
+  SendACKonly;
+  if(SerialMute) return;
+  for(int i=0;i<twSeq.num[ch];i++)
+  {
+    if(i > 0) serial->print(",");
+    serial->print(TW_SEQMASK(twSeq.steps[ch][i]),BIN);
+    if(TW_SEQDWELL(twSeq.steps[ch][i]) > 1)
+    {
+      serial->print(":");
+      serial->print(TW_SEQDWELL(twSeq.steps[ch][i]));
+    }
+  }
+  serial->println("");
+}
+
+// If TRUE the channel plays its sequence, else its bit pattern
+void setSequenceEnable(char *chan, char *val)
+{
+  int  ch;
+  bool ena;
+
+  if((ch=checkCH(chan)) == -1) return;
+  if(!checkTF(val, &ena)) return;
+  if(ena)
+  {
+    if(twSeq.num[ch] == 0) ERR(ERR_NOTBLLOADED);
+    if(!checkCycleFrames(ch, TWsequenceFrames(ch) * twOS)) return;
+  }
+  twSeq.enabled[ch] = ena;
+  defineTWvector(ch,mftdata.Fwd[ch]);
+  SendACK;
+}
+
+void getSequenceEnable(int ch)
+{
+  if((ch = checkCH(ch)) == -1) return;
+  SendACKonly;
+  if(SerialMute) return;
+  if(twSeq.enabled[ch]) serial->println("TRUE");
+  else serial->println("FALSE");
+}
+
+//
+// Oversampling commands
+//
+
+// Returns the highest frequency the step engine can play with the oversampling, each
+// step is twOS frames
+int TWmaxFrequency(void)
+{
+  int freq = TW_MAXSTEPRATE / (8 * twOS);
+
+  if(freq > mftdata.maxFreq) freq = mftdata.maxFreq;
+  return freq;
+}
+
+// Sets the frames per step, 1 to TW_MAXOVRS. The phase shifts are applied in frames so
+// oversampling by n sets them in 45/n degree increments. The step rate goes up n times
+// so the frequency is limited to TWmaxFrequency. The new frames start at the next cycle
+// boundary, in STEP update mode the rest of the playing cycle runs at the new step rate.
+void setOversample(int n)
+{
+  if((n < 1) || (n > TW_MAXOVRS)) BADARG;
+  if(TWcycleFrames(TWchannelFrames(0) / twOS * n, TWchannelFrames(1) / twOS * n) > TW_MAXFRAMES) ERR(ERR_TBLTOOBIG);
+  twOS = n;
+  updateTWframes(false);
+  updateTWclock();
+  SendACK;
+}
+
+void getMaxFrequency(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  serial->println(TWmaxFrequency());
+}
+
+// Computes the DAC codes for the TW, alternate TW and guard setpoints, call when a
+// setpoint or the DAC calibration changes
+void updateDACcodes(void)
+{
+  dacCodes.tw[0]  = Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl);
+  dacCodes.tw[1]  = Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl);
+  dacCodes.alt[0] = Value2Counts(mftdata.TWaltV[0],&mftdata.TW1ctrl);
+  dacCodes.alt[1] = Value2Counts(mftdata.TWaltV[1],&mftdata.TW2ctrl);
+  dacCodes.guard  = guardCounts(mftdata.Guard);
+}
+
+// Returns the DAC code for a guard voltage
+int guardCounts(float val)
+{
+  // This code corrects non linearity at low guard voltage settings
+  if(val < 3.888) val = val * 0.7553 + 0.9516;
+  return Value2Counts(val,&mftdata.GRDctrl);
+}
+
+// Switches a channel between its TW and alternate TW voltage, called by the trigger
+// ISRs. The cached DAC code is queued on the I2C driver, it is dropped if the queue
+// is full.
+void toggleTWaltV(int chan)
+{
+  static bool state[2] = {false,false};
+
+  if((chan < 0) || (chan > 1)) return;
+  setTWaltV(chan, !state[chan]);
+  state[chan] = !state[chan];
+}
+
+void setTWaltV(int chan, bool useALT)
+{
+  if(chan == 0) 
+    MAX5815load(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, useALT ? dacCodes.alt[0] : dacCodes.tw[0]);
+  if(chan == 1) 
+    MAX5815load(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, useALT ? dacCodes.alt[1] : dacCodes.tw[1]);
 }
 
 void SetTWAvoltage(char *chan, char *value)
 {
-  String token;
   int    ch;
   float  val;
 
   if((ch=checkCH(chan)) == -1) return;
-  token = value;
-  val = token.toFloat();
+  val = atof(value);
   if((val > mftdata.maxTWV[ch]) || (val < mftdata.minTWV[ch])) BADARG;
   if(ch == 0) mftdata.TWaltV[0]=val;
   if(ch == 1) mftdata.TWaltV[1]=val;
+  updateDACcodes();
   SendACK;  
 }
 void SetTWvoltage(char *chan, char *value)
 {
-  String token;
   int    ch;
   float  val;
 
@@ -778,22 +1890,20 @@ void SetTWvoltage(char *chan, char *value)
   val = mftdata.TWvoltage[ch];
   if(checkIF(value, &val)) val = val;
   else if(checkChange(value,&val)) val += mftdata.TWvoltage[ch];
-  else
-  {
-    token = value;
-    val = token.toFloat();
-  }
+  else val = atof(value);
   if(val > mftdata.maxTWV[ch]) val = mftdata.maxTWV[ch];
   if(val < mftdata.minTWV[ch]) val = mftdata.minTWV[ch];
   if(ch == 0) 
   {
     mftdata.TWvoltage[0]=val;
-    MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl));
+    updateDACcodes();
+    MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, dacCodes.tw[0]);
   }
   if(ch == 1) 
   {
     mftdata.TWvoltage[1]=val;
-    MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl));
+    updateDACcodes();
+    MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, dacCodes.tw[1]);
   }
   SendACK;  
 }
@@ -826,79 +1936,70 @@ void GetTWreadback(int ch)
 
 void SetGRDvoltage(char *value)
 {
-  String token;
   float  val;
 
   val = mftdata.Guard;
   if(checkIF(value, &val)) val = val;
   if(checkChange(value,&val)) val += mftdata.Guard;
-  else
-  {
-    token = value;
-    val = token.toFloat();
-  }
+  else val = atof(value);
   if(val > mftdata.maxGuard) val = mftdata.maxGuard;
   if(val < mftdata.minGuard) val = mftdata.minGuard;
   mftdata.Guard=val;
-  // This code corrects non linearity at low guard voltage settings
-  if(val < 3.888) val = val * 0.7553 + 0.9516;
-  MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, Value2Counts(val,&mftdata.GRDctrl));
+  updateDACcodes();
+  MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, dacCodes.guard);
   SendACK;
 }
 
 void SetGRDvoltageAdj(char *value)
 {
-  String token;
   float  val;
 
   val = mftdata.Guard;
   if(checkIF(value, &val)) val = val;
   if(checkChange(value,&val)) val += mftdata.Guard;
-  else
-  {
-    token = value;
-    val = token.toFloat();
-  }
+  else val = atof(value);
   if(val > mftdata.maxGuard) val = mftdata.maxGuard;
   if(val < mftdata.minGuard) val = mftdata.minGuard;
   mftdata.Guard=val;
+  updateDACcodes();
   // This code corrects non linearity at low guard voltage settings, below 5 volts
   // The readback channel is used to correct
   if(val < 5.0)
   {
     float vo = val;
+    // Each write must reach the output before the readback
+    MAX5815group(false);
     for(int j=0;j<5;j++)
     {
       int cnts = Value2Counts(vo,&mftdata.GRDctrl);
       MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, cnts);
+      dacCodes.guard = cnts;
+      I2Cwait();
       float valRB = ReadADCchannel(mftdata.GRDmon,100);
       vo += val-valRB;
     }
   }
-  else MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, Value2Counts(val,&mftdata.GRDctrl));
+  else MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, dacCodes.guard);
   SendACK;
 }
 
 void SetTrigOut(char *value)
 {
-  String token;
-
-  token = value;
-  if(token == "LOW") digitalWrite(TrigOut, LOW);
-  else if(token == "HIGH") digitalWrite(TrigOut, HIGH);
-  else if(token == "PULSE")
+  if(strcmp(value,"LOW") == 0) halDigitalWrite(TrigOut, LOW);
+  else if(strcmp(value,"HIGH") == 0) halDigitalWrite(TrigOut, HIGH);
+  else if(strcmp(value,"PULSE") == 0)
   {
-    if(digitalRead(TrigOut) == LOW)
+    if(halDigitalRead(TrigOut) == LOW)
     {
-      digitalWrite(TrigOut, HIGH);
-      delay(1);
-      digitalWrite(TrigOut, LOW);
+      halDigitalWrite(TrigOut, HIGH);
+      halDelay(1);
+      halDigitalWrite(TrigOut, LOW);
     }
     else
     {
-      digitalWrite(TrigOut, LOW);
-      delay(1);
-      digitalWrite(TrigOut, HIGH);
+      halDigitalWrite(TrigOut, LOW);
+      halDelay(1);
+      halDigitalWrite(TrigOut, HIGH);
     }
   }
   else
@@ -912,7 +2013,6 @@ void SetTrigOut(char *value)
 // Calibrate TW1, TW2, and Gaurd
 void Calibrate(void)
 {
-  String sRes;
   float  V1,V2;
   int    V1rbCnt,V2rbCnt;
 
@@ -921,14 +2021,14 @@ void Calibrate(void)
    MAX5815(mftdata.MAX5815add,TW1ctrlCH,1000);
    // Ask user to enter V1
    V1 = UserInputFloat((char *)"\nEnter TWV1 voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V1rbCnt = GetADCvalue(TW1monCH, 100);
    GetToken(false);  // flush the buffer
    // Set votage to V2
    MAX5815(mftdata.MAX5815add,TW1ctrlCH,20000);
    // Ask user to enter V2
    V2 = UserInputFloat((char *)"\nEnter TWV1 voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V2rbCnt = GetADCvalue(TW1monCH, 100);
    GetToken(false);  // flush the buffer
    // Calculate the calibration parameters, m and b
@@ -938,20 +2038,21 @@ void Calibrate(void)
    mftdata.TW1mon.m = (V2rbCnt - V1rbCnt) / (V2-V1);
    mftdata.TW1mon.b = V2rbCnt - V2 * mftdata.TW1mon.m;
    serial->print("ADC: "); serial->print(mftdata.TW1mon.m); serial->print(", "); serial->println(mftdata.TW1mon.b);
-   MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, Value2Counts(mftdata.TWvoltage[0],&mftdata.TW1ctrl));
+   updateDACcodes();
+   MAX5815(mftdata.MAX5815add, mftdata.TW1ctrl.Chan, dacCodes.tw[0]);
 // Calibrate TW2 output
    // Set votage to V1
    MAX5815(mftdata.MAX5815add,TW2ctrlCH,1000);
    // Ask user to enter V1
    V1 = UserInputFloat((char *)"\nEnter TWV2 voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V1rbCnt = GetADCvalue(TW2monCH, 100);
    GetToken(false);  // flush the buffer
    // Set votage to V2
    MAX5815(mftdata.MAX5815add,TW2ctrlCH,20000);
    // Ask user to enter V2
    V2 = UserInputFloat((char *)"\nEnter TWV2 voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V2rbCnt = GetADCvalue(TW2monCH, 100);
    GetToken(false);  // flush the buffer
    // Calculate the calibration parameters, m and b
@@ -961,20 +2062,21 @@ void Calibrate(void)
    mftdata.TW2mon.m = (V2rbCnt - V1rbCnt) / (V2-V1);
    mftdata.TW2mon.b = V2rbCnt - V2 * mftdata.TW2mon.m;
    serial->print("ADC: "); serial->print(mftdata.TW2mon.m); serial->print(", "); serial->println(mftdata.TW2mon.b);
-   MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, Value2Counts(mftdata.TWvoltage[1],&mftdata.TW2ctrl));
+   updateDACcodes();
+   MAX5815(mftdata.MAX5815add, mftdata.TW2ctrl.Chan, dacCodes.tw[1]);
 // Calibrate Guard output
    // Set votage to V1
    MAX5815(mftdata.MAX5815add,GRDctrlCH,5000);
    // Ask user to enter V1
    V1 = UserInputFloat((char *)"\nEnter Guard voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V1rbCnt = GetADCvalue(GRDmonCH, 100);
    GetToken(false);  // flush the buffer
    // Set votage to V2
    MAX5815(mftdata.MAX5815add,GRDctrlCH,20000);
    // Ask user to enter V2
    V2 = UserInputFloat((char *)"\nEnter Guard voltage: ", NULL);
-   delay(1);
+   halDelay(1);
    V2rbCnt = GetADCvalue(GRDmonCH, 100);
    GetToken(false);  // flush the buffer
    // Calculate the calibration parameters, m and b
@@ -984,7 +2086,8 @@ void Calibrate(void)
    mftdata.GRDmon.m = (V2rbCnt - V1rbCnt) / (V2-V1);
    mftdata.GRDmon.b = V2rbCnt - V2 * mftdata.GRDmon.m;
    serial->print("ADC: "); serial->print(mftdata.GRDmon.m); serial->print(", "); serial->println(mftdata.GRDmon.b);
-   MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, Value2Counts(mftdata.Guard,&mftdata.GRDctrl));
+   updateDACcodes();
+   MAX5815(mftdata.MAX5815add, mftdata.GRDctrl.Chan, dacCodes.guard);
 }
 
 void setOpen(char *chan, char *val)
@@ -993,7 +2096,7 @@ void setOpen(char *chan, char *val)
 
   if((ch=checkCH(chan)) == -1) return;
   if(!checkTF(val, &mftdata.Open[ch])) return;
-  defineTWvector(ch,mftdata.Fwd[ch]);
+  TWopen();
   SendACK;  
 }
 void getOpen(int ch)
@@ -1011,7 +2114,7 @@ void setOpenMask(char *chan, char *ptrn)
   if((ch=checkCH(chan)) == -1) return;
   if(!checkPattern(ptrn,&val)) return;
   mftdata.openMask[ch] = val;
-  defineTWvector(ch,mftdata.Fwd[ch]);
+  TWopen();
   SendACK;
   
 }
@@ -1024,13 +2127,11 @@ void getOpenMask(int ch)
 }
 void setFwdPS(char *chan, char *phase)
 {
-  String token;
   int ch,ph; 
 
-  token = phase;
   if((ch=checkCH(chan)) == -1) return;
   if(checkChange(phase, &ph)) ph += mftdata.fwdPS[ch];
-  else ph = token.toInt();
+  else ph = atoi(phase);
   SendACK;
   mftdata.fwdPS[ch] = ph;
   defineTWvector(ch,mftdata.Fwd[ch]);
@@ -1044,13 +2145,11 @@ void getFwdPS(int ch)
 }
 void setRevPS(char *chan, char *phase)
 {
-  String token;
   int ch,ph; 
 
-  token = phase;
   if((ch=checkCH(chan)) == -1) return;
   if(checkChange(phase, &ph)) ph += mftdata.revPS[ch];
-  else ph = token.toInt();
+  else ph = atoi(phase);
   SendACK;
   mftdata.revPS[ch] = ph;
   defineTWvector(ch,mftdata.Fwd[ch]);
@@ -1081,34 +2180,68 @@ void executeCommand(char *str)
   if(!SerialMute) putString((char *)"MUTE,ON\n");
 }
 
+// Runs the active compiled command string, muted
 void executeCommandString(void)
 {
-  // If the command string length is greater that zero then put
-  // the string in the command ring buffer for execution. 
-  if(strlen(commandString[activeCS]) > 0)
-  {
-    putString((char *)"\n");
-    putString(commandString[activeCS]);
-  }
+  bool mute = SerialMute;
+
+  SerialMute = true;
+  // DAC writes from the string update the outputs together
+  MAX5815group(true);
+  RunCmdProgram(&cmdProgram[activeCS]);
+  MAX5815group(false);
+  SerialMute = mute;
 }
 
 void playCommandString(void)
 {
-  if(!SerialMute) putString((char *)"MUTE,OFF\n");
   executeCommandString();
-  if(!SerialMute) putString((char *)"MUTE,ON\n");
   SendACKonly;
 }
 
+// Sets a command string, it is compiled and left unchanged if it has an error
+void setCommandString(int cs, char *str)
+{
+  static CmdProgram prog;
+
+  if(!CompileCmdString(&prog, str)) { SendNAK; return; }
+  strncpy(commandString[cs], str, MAXCMDLEN - 1);
+  commandString[cs][MAXCMDLEN - 1] = 0;
+  cmdProgram[cs] = prog;
+  SendACK;
+}
+
+void setCommandString1(char *str) {setCommandString(0, str);}
+void setCommandString2(char *str) {setCommandString(1, str);}
+
 void playCommandString1(void) {activeCS=0; playCommandString();}
 void playCommandString2(void) {activeCS=1; playCommandString();}
 
-void Trig1isr(void)
+// Returns the pin interrupt edge for a trigger mode and function. The functions that
+// follow the input level need both edges, CHANGE reads the level from the pin. A short
+// glitch is followed by the edge back so the level read ends on the final state.
+static int trigEdge(int mode, int func)
+{
+  if(mode == CHANGE_MODE) return CHANGE;
+  switch(func)
+  {
+    case REV1_TF:
+    case REV2_TF:
+    case OPEN1_TF:
+    case OPEN2_TF:
+    case TWALT1_TF:
+    case TWALT2_TF:
+      return CHANGE;
+    default:
+      break;
+  }
+  return mode == POS_MODE ? RISING : FALLING;
+}
+
+static void Trig1event(int state)
 {
-  int state;
+  EventQueue *q = &eventQueues[EVQ_TRIG1];
 
-  delayMicroseconds(10);
-  state = digitalRead(Trig1);
   switch (TrigFunc[0])
   {
     case REV1_TF:
@@ -1116,54 +2249,78 @@ void Trig1isr(void)
       if((TrigMode[0] == POS_MODE) && (state == LOW))  mftdata.Fwd[0] = true;
       if((TrigMode[0] == NEG_MODE) && (state == LOW))  mftdata.Fwd[0] = true;
       if((TrigMode[0] == NEG_MODE) && (state == HIGH)) mftdata.Fwd[0] = false;
+      TWdirection(true);
       break;
     case REV2_TF:
       if((TrigMode[0] == POS_MODE) && (state == HIGH)) mftdata.Fwd[1] = false;
       if((TrigMode[0] == POS_MODE) && (state == LOW))  mftdata.Fwd[1] = true;
       if((TrigMode[0] == NEG_MODE) && (state == LOW))  mftdata.Fwd[1] = true;
       if((TrigMode[0] == NEG_MODE) && (state == HIGH)) mftdata.Fwd[1] = false;
+      TWdirection(true);
       break;
     case OPEN1_TF:
       if((TrigMode[0] == POS_MODE) && (state == HIGH)) mftdata.Open[0] = false;
       if((TrigMode[0] == POS_MODE) && (state == LOW))  mftdata.Open[0] = true;
       if((TrigMode[0] == NEG_MODE) && (state == LOW))  mftdata.Open[0] = true;
       if((TrigMode[0] == NEG_MODE) && (state == HIGH)) mftdata.Open[0] = false;
+      TWopen();
       break;
     case OPEN2_TF:
       if((TrigMode[0] == POS_MODE) && (state == HIGH)) mftdata.Open[1] = false;
       if((TrigMode[0] == POS_MODE) && (state == LOW))  mftdata.Open[1] = true;
       if((TrigMode[0] == NEG_MODE) && (state == LOW))  mftdata.Open[1] = true;
       if((TrigMode[0] == NEG_MODE) && (state == HIGH)) mftdata.Open[1] = false;
+      TWopen();
       break;
     case CMD_TF:
-      if((TrigMode[0] == POS_MODE) && (state == HIGH)) TrigCommandString = true;
-      if((TrigMode[0] == NEG_MODE) && (state == LOW))  TrigCommandString = true;
-      if(TrigMode[0] == CHANGE_MODE)  TrigCommandString = true;
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) EventPush(q, EV_CMD, 0, state);
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  EventPush(q, EV_CMD, 0, state);
+      if(TrigMode[0] == CHANGE_MODE)  EventPush(q, EV_CMD, 0, state);
       break;
     case CNT_TF:
-      if((TrigMode[0] == POS_MODE) && (state == HIGH)) advanceCounter();
-      if((TrigMode[0] == NEG_MODE) && (state == LOW))  advanceCounter();
-      if(TrigMode[0] == CHANGE_MODE)  advanceCounter();
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) advanceCounter(q);
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  advanceCounter(q);
+      if(TrigMode[0] == CHANGE_MODE)  advanceCounter(q);
       break;
     case TWALT1_TF:
-      if((TrigMode[0] == POS_MODE) && (state == HIGH)) setTWaltV(0,true);
-      if((TrigMode[0] == POS_MODE) && (state == LOW))  setTWaltV(0,false);
-      if((TrigMode[0] == NEG_MODE) && (state == LOW))  setTWaltV(0,true);
-      if((TrigMode[0] == NEG_MODE) && (state == HIGH)) setTWaltV(0,false);
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) setTWaltV(0, true);
+      if((TrigMode[0] == POS_MODE) && (state == LOW))  setTWaltV(0, false);
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  setTWaltV(0, true);
+      if((TrigMode[0] == NEG_MODE) && (state == HIGH)) setTWaltV(0, false);
       if(TrigMode[0] == CHANGE_MODE)  toggleTWaltV(0);
       break;
     case TWALT2_TF:
-      if((TrigMode[0] == POS_MODE) && (state == HIGH)) setTWaltV(1,true);
-      if((TrigMode[0] == POS_MODE) && (state == LOW))  setTWaltV(1,false);
-      if((TrigMode[0] == NEG_MODE) && (state == LOW))  setTWaltV(1,true);
-      if((TrigMode[0] == NEG_MODE) && (state == HIGH)) setTWaltV(1,false);
-      if(TrigMode[0] == CHANGE_MODE)  toggleTWaltV(0);
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) setTWaltV(1, true);
+      if((TrigMode[0] == POS_MODE) && (state == LOW))  setTWaltV(1, false);
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  setTWaltV(1, true);
+      if((TrigMode[0] == NEG_MODE) && (state == HIGH)) setTWaltV(1, false);
+      if(TrigMode[0] == CHANGE_MODE)  toggleTWaltV(1);
+      break;
+    case RAMP_TF:
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) rampTrigger();
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  rampTrigger();
+      if(TrigMode[0] == CHANGE_MODE)  rampTrigger();
+      break;
+    case TBL_TF:
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) TableTrigger();
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  TableTrigger();
+      if(TrigMode[0] == CHANGE_MODE)  TableTrigger();
+      break;
+    case BURST_TF:
+      if((TrigMode[0] == POS_MODE) && (state == HIGH)) burstTrigger();
+      if((TrigMode[0] == NEG_MODE) && (state == LOW))  burstTrigger();
+      if(TrigMode[0] == CHANGE_MODE)  burstTrigger();
       break;
     default:
       break;
   }
 }
 
+// Trigger 1 edge handlers, a rising or falling edge gives the level
+void Trig1rise(void)   { Trig1event(HIGH); }
+void Trig1fall(void)   { Trig1event(LOW); }
+void Trig1change(void) { Trig1event(halDigitalRead(Trig1)); }
+
 // This function enables the trigger 1 input and assigns it a function.
 // mode defines the trigger level, NA,POS,NEG,CHANGE. NA disables
 // function defines the trigger action, REV 1or2, OPEN 1or2, CMD, CNT
@@ -1171,19 +2328,17 @@ void setTrig1(char *mode, char *function)
 {
   if(!checkTrigFunc(function, &TrigFunc[0])) return;
   if(!checkTrigMode(mode, &TrigMode[0])) return;
-  if(TrigMode[0] == POS_MODE)         attachInterrupt(digitalPinToInterrupt(Trig1), Trig1isr, CHANGE);
-  else if(TrigMode[0] == NEG_MODE)    attachInterrupt(digitalPinToInterrupt(Trig1), Trig1isr, CHANGE);
-  else if(TrigMode[0] == CHANGE_MODE) attachInterrupt(digitalPinToInterrupt(Trig1), Trig1isr, CHANGE);
-  else if(TrigMode[0] == NA_MODE)     detachInterrupt(digitalPinToInterrupt(Trig1));
+  if(TrigMode[0] == NA_MODE) halDetachInterrupt(Trig1);
+  else if(trigEdge(TrigMode[0], TrigFunc[0]) == RISING)  halAttachInterrupt(Trig1, Trig1rise, RISING);
+  else if(trigEdge(TrigMode[0], TrigFunc[0]) == FALLING) halAttachInterrupt(Trig1, Trig1fall, FALLING);
+  else halAttachInterrupt(Trig1, Trig1change, CHANGE);
   SendACK;
 }
 
-void Trig2isr(void)
+static void Trig2event(int state)
 {
-  int state;
+  EventQueue *q = &eventQueues[EVQ_TRIG2];
 
-  delayMicroseconds(10);
-  state = digitalRead(Trig2);
   switch (TrigFunc[1])
   {
     case REV1_TF:
@@ -1191,54 +2346,78 @@ void Trig2isr(void)
       if((TrigMode[1] == POS_MODE) && (state == LOW))  mftdata.Fwd[0] = true;
       if((TrigMode[1] == NEG_MODE) && (state == LOW))  mftdata.Fwd[0] = true;
       if((TrigMode[1] == NEG_MODE) && (state == HIGH)) mftdata.Fwd[0] = false;
+      TWdirection(true);
       break;
     case REV2_TF:
       if((TrigMode[1] == POS_MODE) && (state == HIGH)) mftdata.Fwd[1] = false;
       if((TrigMode[1] == POS_MODE) && (state == LOW))  mftdata.Fwd[1] = true;
       if((TrigMode[1] == NEG_MODE) && (state == LOW))  mftdata.Fwd[1] = true;
       if((TrigMode[1] == NEG_MODE) && (state == HIGH)) mftdata.Fwd[1] = false;
+      TWdirection(true);
       break;
     case OPEN1_TF:
       if((TrigMode[1] == POS_MODE) && (state == HIGH)) mftdata.Open[0] = false;
       if((TrigMode[1] == POS_MODE) && (state == LOW))  mftdata.Open[0] = true;
       if((TrigMode[1] == NEG_MODE) && (state == LOW))  mftdata.Open[0] = true;
       if((TrigMode[1] == NEG_MODE) && (state == HIGH)) mftdata.Open[0] = false;
+      TWopen();
       break;
     case OPEN2_TF:
       if((TrigMode[1] == POS_MODE) && (state == HIGH)) mftdata.Open[1] = false;
       if((TrigMode[1] == POS_MODE) && (state == LOW))  mftdata.Open[1] = true;
       if((TrigMode[1] == NEG_MODE) && (state == LOW))  mftdata.Open[1] = true;
       if((TrigMode[1] == NEG_MODE) && (state == HIGH)) mftdata.Open[1] = false;
+      TWopen();
       break;
     case CMD_TF:
-      if((TrigMode[1] == POS_MODE) && (state == HIGH)) TrigCommandString = true;
-      if((TrigMode[1] == NEG_MODE) && (state == LOW))  TrigCommandString = true;
-      if(TrigMode[1] == CHANGE_MODE)  TrigCommandString = true;
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) EventPush(q, EV_CMD, 0, state);
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  EventPush(q, EV_CMD, 0, state);
+      if(TrigMode[1] == CHANGE_MODE)  EventPush(q, EV_CMD, 0, state);
       break;
     case CNT_TF:
-      if((TrigMode[1] == POS_MODE) && (state == HIGH)) advanceCounter();
-      if((TrigMode[1] == NEG_MODE) && (state == LOW))  advanceCounter();
-      if(TrigMode[1] == CHANGE_MODE)  advanceCounter();
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) advanceCounter(q);
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  advanceCounter(q);
+      if(TrigMode[1] == CHANGE_MODE)  advanceCounter(q);
       break;
     case TWALT1_TF:
-      if((TrigMode[1] == POS_MODE) && (state == HIGH)) setTWaltV(0,true);
-      if((TrigMode[1] == POS_MODE) && (state == LOW))  setTWaltV(0,false);
-      if((TrigMode[1] == NEG_MODE) && (state == LOW))  setTWaltV(0,true);
-      if((TrigMode[1] == NEG_MODE) && (state == HIGH)) setTWaltV(0,false);
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) setTWaltV(0, true);
+      if((TrigMode[1] == POS_MODE) && (state == LOW))  setTWaltV(0, false);
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  setTWaltV(0, true);
+      if((TrigMode[1] == NEG_MODE) && (state == HIGH)) setTWaltV(0, false);
       if(TrigMode[1] == CHANGE_MODE)  toggleTWaltV(0);
       break;
     case TWALT2_TF:
-      if((TrigMode[1] == POS_MODE) && (state == HIGH)) setTWaltV(1,true);
-      if((TrigMode[1] == POS_MODE) && (state == LOW))  setTWaltV(1,false);
-      if((TrigMode[1] == NEG_MODE) && (state == LOW))  setTWaltV(1,true);
-      if((TrigMode[1] == NEG_MODE) && (state == HIGH)) setTWaltV(1,false);
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) setTWaltV(1, true);
+      if((TrigMode[1] == POS_MODE) && (state == LOW))  setTWaltV(1, false);
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  setTWaltV(1, true);
+      if((TrigMode[1] == NEG_MODE) && (state == HIGH)) setTWaltV(1, false);
       if(TrigMode[1] == CHANGE_MODE)  toggleTWaltV(1);
       break;
+    case RAMP_TF:
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) rampTrigger();
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  rampTrigger();
+      if(TrigMode[1] == CHANGE_MODE)  rampTrigger();
+      break;
+    case TBL_TF:
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) TableTrigger();
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  TableTrigger();
+      if(TrigMode[1] == CHANGE_MODE)  TableTrigger();
+      break;
+    case BURST_TF:
+      if((TrigMode[1] == POS_MODE) && (state == HIGH)) burstTrigger();
+      if((TrigMode[1] == NEG_MODE) && (state == LOW))  burstTrigger();
+      if(TrigMode[1] == CHANGE_MODE)  burstTrigger();
+      break;
     default:
       break;
   }
 }
 
+// Trigger 2 edge handlers
+void Trig2rise(void)   { Trig2event(HIGH); }
+void Trig2fall(void)   { Trig2event(LOW); }
+void Trig2change(void) { Trig2event(halDigitalRead(Trig2)); }
+
 // This function enables the trigger 2 input and assigns it a function.
 // mode defines the trigger level, NA,POS,NEG,CHANGE. NA disables
 // function defines the trigger action, REV 1or2, OPEN 1or2, CMD, CNT
@@ -1246,10 +2425,10 @@ void setTrig2(char *mode, char *function)
 {
   if(!checkTrigFunc(function, &TrigFunc[1])) return;
   if(!checkTrigMode(mode, &TrigMode[1])) return;
-  if(TrigMode[1] == POS_MODE)         attachInterrupt(digitalPinToInterrupt(Trig2), Trig2isr, CHANGE);
-  else if(TrigMode[1] == NEG_MODE)    attachInterrupt(digitalPinToInterrupt(Trig2), Trig2isr, CHANGE);
-  else if(TrigMode[1] == CHANGE_MODE) attachInterrupt(digitalPinToInterrupt(Trig2), Trig2isr, CHANGE);
-  else if(TrigMode[1] == NA_MODE)     detachInterrupt(digitalPinToInterrupt(Trig2));
+  if(TrigMode[1] == NA_MODE) halDetachInterrupt(Trig2);
+  else if(trigEdge(TrigMode[1], TrigFunc[1]) == RISING)  halAttachInterrupt(Trig2, Trig2rise, RISING);
+  else if(trigEdge(TrigMode[1], TrigFunc[1]) == FALLING) halAttachInterrupt(Trig2, Trig2fall, FALLING);
+  else halAttachInterrupt(Trig2, Trig2change, CHANGE);
   SendACK;
 }
 
@@ -1263,8 +2442,8 @@ void readTriggerInput(int ch)
 {
   int i;
   
-  if(ch == 1) i = digitalRead(Trig1);
-  else if(ch == 2) i = digitalRead(Trig2);
+  if(ch == 1) i = halDigitalRead(Trig1);
+  else if(ch == 2) i = halDigitalRead(Trig2);
   else BADARG;
   SendACKonly;
   if(SerialMute) return;
@@ -1277,39 +2456,39 @@ void readTriggerInput(int ch)
 void setLimit(bool MAXvalue)
 {
   char        *tkn;
-  String      arg,type;
+  char        type[8];
   int         chan=1;
   float       limit;
 
   while(true)
   {
      if((tkn = TokenFromCommandLine(',')) == NULL) break;
-     type = tkn;
-     if(type == "TWV")
+     // Copy the type, the token buffer is reused by the next read
+     strncpy(type,tkn,sizeof(type)-1);
+     type[sizeof(type)-1] = 0;
+     if(strcmp(type,"TWV") == 0)
      {
         // Read the channel
         if((tkn = TokenFromCommandLine(',')) == NULL) break;
-        arg = tkn;
-        chan = arg.toInt();
+        chan = atoi(tkn);
      }
      if((tkn = TokenFromCommandLine(',')) == NULL) break;
-     arg = tkn;
-     limit = arg.toFloat();
+     limit = atof(tkn);
      if(checkCH(chan) == -1) return;
      chan--;
-     if(type == "TWV")
+     if(strcmp(type,"TWV") == 0)
      {
         if((limit < MINvoltage) || (limit > MAXvoltage)) break;
         if(MAXvalue) mftdata.maxTWV[chan] = limit;
         else mftdata.minTWV[chan] = limit;
      }
-     else if(type == "GRD")
+     else if(strcmp(type,"GRD") == 0)
      {
         if((limit < MINvoltage) || (limit > MAXvoltage)) break;
         if(MAXvalue) mftdata.maxGuard = limit;
         else mftdata.minGuard = limit;
      }
-     else if(type == "FREQ")
+     else if(strcmp(type,"FREQ") == 0)
      {
         if((limit < MINfrequency) || (limit > MAXfrequency)) break;
         if(MAXvalue) mftdata.maxFreq = limit;
@@ -1326,22 +2505,23 @@ void setLimit(bool MAXvalue)
 void getLimit(bool MAXvalue)
 {
   char        *tkn;
-  String      arg,type;
+  char        type[8];
   int         chan=1;
 
   while(true)
   {
      if((tkn = TokenFromCommandLine(',')) == NULL) break;
-     type = tkn;
-     if(type == "TWV")
+     // Copy the type, the token buffer is reused by the next read
+     strncpy(type,tkn,sizeof(type)-1);
+     type[sizeof(type)-1] = 0;
+     if(strcmp(type,"TWV") == 0)
      {
         // Read the channel
         if((tkn = TokenFromCommandLine(',')) == NULL) break;
-        arg = tkn;
-        chan = arg.toInt();
+        chan = atoi(tkn);
      }
      if(checkCH(chan) == -1) return;
-     if(type == "TWV")
+     if(strcmp(type,"TWV") == 0)
      {
         if(!SerialMute)
         {
@@ -1350,7 +2530,7 @@ void getLimit(bool MAXvalue)
           else serial->println(mftdata.minTWV[chan]);
         }
      }
-     else if(type == "GRD")
+     else if(strcmp(type,"GRD") == 0)
      {
         if(!SerialMute)
         {
@@ -1359,7 +2539,7 @@ void getLimit(bool MAXvalue)
           else serial->println(mftdata.minGuard);
         }
      }
-     else if(type == "FREQ")
+     else if(strcmp(type,"FREQ") == 0)
      {
         if(!SerialMute)
         {
@@ -1396,12 +2576,12 @@ void getActiveCMD(void)
 
 void clockCounter(bool high)
 {
-  if(high) advanceCounter();
+  if(high) advanceCounter(&eventQueues[EVQ_CLOCK]);
 }
 void clockTrigger(bool high)
 {
-  if(high) digitalWrite(TrigOut, HIGH);
-  else digitalWrite(TrigOut, LOW);
+  if(high) halDigitalWrite(TrigOut, HIGH);
+  else halDigitalWrite(TrigOut, LOW);
 }
 void clockISR(void)
 {
@@ -1416,20 +2596,17 @@ void setClock(int freq)
 {
   if((freq < 0) || (freq > 10000)) BADARG;
   clockFrequency = freq;
-  if(freq == 0) clockTimer.end();
-  clockTimer.begin(clockISR, 1000000/(2 * freq));
+  if(freq == 0) halClockTimerEnd();
+  else halClockTimerBegin(clockISR, 1000000/(2 * freq));
   SendACK;
 }
 
 void setClockFunction(char *func)
 {
-  String token;
-
-  token = func;
-  if(token == "NA")       clockFunction = NULL;
-  else if(token == "CNT") clockFunction = clockCounter;
-  else if(token == "TRG") clockFunction = clockTrigger;
+  if(strcmp(func,"NA") == 0)       clockFunction = NULL;
+  else if(strcmp(func,"CNT") == 0) clockFunction = clockCounter;
+  else if(strcmp(func,"TRG") == 0) clockFunction = clockTrigger;
   else BADARG;
-  strcpy(clockMode,token.c_str());
+  strcpy(clockMode,func);
   SendACK;
 }
@@ -10,8 +10,11 @@
 #include "string.h"
 #include "Serial.h"
 #include "Errors.h"
-#include <Wire.h>
-#include <SPI.h>
+#include "TwaveDMA.h"
+#include "ADCscan.h"
+#include "Table.h"
+#include "TwaveSplit.h"
+#include "Hal.h"
 //#include "reset.h"
 
 extern ThreadController control;
@@ -20,15 +23,22 @@ Stream *serial = &Serial;
 bool SerialMute = false;
 
 #define MaxToken 20
+#define MaxLine  256
 
 char Token[MaxToken];
-char Sarg1[MaxToken];
-char Sarg2[MaxToken];
 unsigned char Tptr;
 
+// Command line being processed, split in place into tokens
+char Line[MaxLine];
+char *LinePtr = Line;     // Start of the next token
+char LineDel = 0;         // Delimiter that ended the last token, 0 at end of line
+char LineTerm = 0;        // Terminator of the line being processed, ; or \n
+
 int ErrorCode = 0;   // Last communication error that was logged
 
-Ring_Buffer  RB;     // Receive ring buffer
+// Command ports, USB and Serial1
+CmdPort  CmdPorts[NUM_CMDPORTS] = {{&Serial}, {&Serial1}};
+CmdPort  *cmdPort = &CmdPorts[0];
 
 // ACK only string, two options. Need a comma when in the echo mode
 char *ACKonlyString1 = (char *)"\x06";
@@ -37,106 +47,204 @@ char *SelectedACKonlyString = ACKonlyString1;
 
 bool echoMode = false;
 
-Commands  CmdArray[] =   {
+constexpr Commands  CmdArray[] =   {
 // General commands
   {"GVER",  CMDstr, 0, (char *)Version},                                  // Report version
-  {"GERR",  CMDint, 0, (char *)&ErrorCode},                               // Report the last error code
-  {"MUTE",  CMDfunctionStr, 1, (char *)Mute},                             // Turns on and off the serial response from the MIPS system
-  {"ECHO",  CMDbool, 1, (char *)&echoMode},                               // Turns on and off the serial echo mode where the command is echoed to host, TRUE or FALSE
-  {"DELAY", CMDfunction, 1, (char *)DelayCommand},                        // Generates a delay in milliseconds. This is used by the macro functions
+  {"GERR",  CMDint, 0, &ErrorCode},                                       // Report the last error code
+  {"MUTE",  CMDfunctionStr, 1, Mute},                                     // Turns on and off the serial response from the MIPS system
+  {"ECHO",  CMDbool, 1, &echoMode},                                       // Turns on and off the serial echo mode where the command is echoed to host, TRUE or FALSE
+  {"DELAY", CMDfunction, 1, DelayCommand},                                // Generates a delay in milliseconds. This is used by the macro functions
                                                                           // to define delays in voltage ramp up etc.
-  {"GCMDS",  CMDfunction, 0, (char *)GetCommands},                        // Send a list of all commands
-  {"GNAME", CMDstr, 0, (char *)mftdata.Name},                             // Report system name
-  {"SNAME", CMDstr, 1, (char *)mftdata.Name},                             // Set system name
-  {"RESET",  CMDfunction, 0, (char *)Software_Reset},                     // System reboot
-  {"SAVE",   CMDfunction, 0, (char *)SaveSettings},                       // Save settings
-  {"RESTORE", CMDfunction, 0, (char *)RestoreSettings},                   // Restore settings
-  {"FORMAT", CMDfunction, 0, (char *)FormatFLASH},                        // Format FLASH
-  {"DEBUG", CMDfunction, 1, (char *)Debug},                               // Debug function, its function varies
-  {"THREADS", CMDfunction, 0, (char *)ListThreads},                       // List all threads, there IDs, and there last runtimes
-  {"STHRDENA", CMDfunctionStr, 2, (char *)SetThreadEnable},               // Set thread enable to true or false
-  {"SBAUD", CMDint, 1, (char *)&mftdata.Baud},                            // Set serial1 port baud rate, read on startup only
-  {"GBAUD", CMDint, 0, (char *)&mftdata.Baud},                            // Returns the current baud rate setting
+  {"GCMDS",  CMDfunction, 0, GetCommands},                                // Send a list of all commands
+  {"GNAME", CMDstr, 0, mftdata.Name},                                     // Report system name
+  {"SNAME", CMDstr, 1, mftdata.Name},                                     // Set system name
+  {"RESET",  CMDfunction, 0, Software_Reset},                             // System reboot
+  {"SAVE",   CMDfunction, 0, SaveSettings},                               // Save settings
+  {"RESTORE", CMDfunction, 0, RestoreSettings},                           // Restore settings
+  {"FORMAT", CMDfunction, 0, FormatFLASH},                                // Format FLASH
+  {"DEBUG", CMDfunction, 1, Debug},                                       // Debug function, its function varies
+  {"THREADS", CMDfunction, 0, ListThreads},                               // List all threads, there IDs, and there last runtimes
+  {"STHRDENA", CMDfunctionStr, 2, SetThreadEnable},                       // Set thread enable to true or false
+  {"SBAUD", CMDint, 1, &mftdata.Baud},                                    // Set serial1 port baud rate, read on startup only
+  {"GBAUD", CMDint, 0, &mftdata.Baud},                                    // Returns the current baud rate setting
+  {"SBIN", CMDfunctionStr, 1, SetBinaryMode},                             // Set this port to binary command frame mode, TRUE or FALSE
+  {"GCMDID", CMDfunctionStr, 1, GetCommandID},                            // Returns the binary mode ID of a command, name
+  {"STAG", CMDfunctionStr, 1, SetTagMode},                                // Set this port to request tag mode, TRUE or FALSE. Commands can start with #tag
+  {"STLM", CMDfunction, 1, SetTelemetry},                                 // Stream telemetry samples to this port, samples per second, 0 stops
+  {"GTLM", CMDfunction, 0, GetTelemetry},                                 // Returns this port's telemetry rate
+  {"GTXOVF", CMDfunction, 0, GetTxOverflows},                             // Returns the number of characters this port dropped to a full output queue
+  {"GHEAP", CMDint, 0, &halHeapCalls},                                    // Returns the number of heap allocator calls since reset
 // MFT commands
-  {"GSTATUS", CMDstr, 0, (char *)Status},                                 // Report system status
-  {"SENA",  CMDbool, 1, (char *)&mftdata.Enable},                         // TRUE enables the switch
-  {"GENA",  CMDbool, 0, (char *)&mftdata.Enable},                         // Returns the enable status, TRUE or FALSE
-  {"SFREQ", CMDfunctionStr, 1, (char *)SetFrequency},                     // Set twave frequency, this is the frequency per channel
-  {"GFREQ", CMDint, 0, (char *)&mftdata.Freq},                            // Returns requested frequency
-  {"GAFREQ",CMDint, 0, (char *)&mftdata.Afreq},                           // Returns actual frequency
-  {"SFWD", CMDfunctionStr, 2, (char *)SetFWDir},                          // If TRUE direction set to forward, if FALSE reverse
-  {"GFWD",  CMDfunction, 1, (char *)GetFWDir},                            // Returns the Fwd flag, TRUE or FALSE
-  {"SPTRN", CMDfunctionStr, 2, (char *)SetPattern},                       // Set the bit pattern, binary
-  {"GPTRN", CMDfunction, 1, (char *)GetPattern},                          // Returns the bit pattern
-  {"START", CMDfunction, 0, (char *)StartTwave},                          // Start the Twave generation
-  {"STOP", CMDfunction, 0, (char *)StopTwave},                            // Stop the Twave generation
-  {"STEP", CMDfunction, 1, (char *)MoveNcycles},                          // Move N cycles
-  {"STWV", CMDfunctionStr, 2, (char *)SetTWvoltage},                      // Set TW voltage, channel, value
-  {"GTWV", CMDfunction,  1, (char *)GetTWvoltage},                        // Return the TW voltage setting, channel
-  {"GTWVA", CMDfunction,  1, (char *)GetTWreadback},                      // Return the TW voltage readback, channel
-  {"SGRD", CMDfunctionStr, 1, (char *)SetGRDvoltage},                     // Set Gaurd voltage, value
-  {"SGRDA", CMDfunctionStr, 1, (char *)SetGRDvoltageAdj},                 // Set Gaurd voltage and adjust values below 5 volts, value
-  {"GGRD", CMDfloat,  0, (char *)&mftdata.Guard},                         // Return the Gaurd voltage setting
-  {"GGRDA", CMDfloat,  0, (char *)&GRDreadback},                          // Return the Gaurd readback
-  {"TRIGOUT", CMDfunctionStr, 1, (char *)SetTrigOut},                     // Trigger output function, HIGH, LOW, PULSE
-
-  {"STWVALT", CMDfunctionStr, 2, (char *)SetTWAvoltage},                     // Set TW alternut voltage, channel, value
-  {"GTWVALT", CMDfunction,  1, (char *)GetTWAvoltage},                       // Return the TW alternut voltage setting, channel
+  {"GSTATUS", CMDstr, 0, Status},                                         // Report system status
+  {"SENA",  CMDbool, 1, &mftdata.Enable},                                 // TRUE enables the switch
+  {"GENA",  CMDbool, 0, &mftdata.Enable},                                 // Returns the enable status, TRUE or FALSE
+  {"SFREQ", CMDfunctionStr, 1, SetFrequency},                             // Set twave frequency, this is the frequency per channel
+  {"GFREQ", CMDint, 0, &mftdata.Freq},                                    // Returns requested frequency
+  {"GAFREQ",CMDfloat, 0, &twClock.afreq},                                 // Returns actual frequency
+  {"SFWD", CMDfunctionStr, 2, SetFWDir},                                  // If TRUE direction set to forward, if FALSE reverse
+  {"GFWD",  CMDfunction, 1, GetFWDir},                                    // Returns the Fwd flag, TRUE or FALSE
+  {"SPTRN", CMDfunctionStr, 2, SetPattern},                               // Set the bit pattern, binary
+  {"GPTRN", CMDfunction, 1, GetPattern},                                  // Returns the bit pattern
+  {"START", CMDfunction, 0, StartTwave},                                  // Start the Twave generation
+  {"STOP", CMDfunction, 0, StopTwave},                                    // Stop the Twave generation
+  {"STEP", CMDfunction, 1, MoveNcycles},                                  // Move N cycles
+  {"SDMA", CMDfunctionStr, 1, setDMAmode},                                // If TRUE the waveform is played by DMA, no step interrupt
+  {"GDMA", CMDbool, 0, &twDMAmode},                                       // Returns the DMA playback mode, TRUE or FALSE
+  {"TDMA", CMDfunction, 0, testDMAchain},                                 // Checks the DMA descriptor chain against the step ISR, PASS or FAIL
+  {"SSPLIT", CMDfunctionStr, 1, setSplitMode},                            // If TRUE TW1 and TW2 have their own step clocks, TW2 runs at the TW2 frequency
+  {"GSPLIT", CMDbool, 0, &twSplitMode},                                   // Returns the split step clock mode, TRUE or FALSE
+  {"SFREQ2", CMDfunctionStr, 1, SetFrequency2},                           // Set the TW2 frequency used with split step clocks
+  {"GFREQ2", CMDint, 0, &twSplit.freq2},                                  // Returns the TW2 requested frequency
+  {"GAFREQ2",CMDfloat, 0, &twSplit.afreq[1]},                             // Returns the TW2 actual frequency with split step clocks
+  {"SUPDMODE", CMDfunctionStr, 1, setUpdateMode},                         // Sets when running waveform changes take effect, STEP or CYCLE
+  {"GUPDMODE", CMDfunction, 0, getUpdateMode},                            // Returns the update mode
+  {"SSYNC", CMDfunction, 2, setSync},                                     // Set the synchronous sample step, 0-7 or -1 for all, and delay in uS
+  {"GSYNC", CMDfunction, 0, getSync},                                     // Returns the synchronous sample step and delay
+  {"SSYNCENA", CMDfunctionStr, 1, setSyncEnable},                         // If TRUE the readbacks are sampled in step with the waveform
+  {"GSYNCENA", CMDbool, 0, &adcSync.enabled},                             // Returns the synchronous sampling mode, TRUE or FALSE
+  {"GSYNCV", CMDfunction, 1, getSyncProfile},                             // Returns the 8 step averages for a readback, 1 = TW1, 2 = TW2, 3 = guard
+  {"CLRSYNC", CMDfunction, 0, clearSync},                                 // Clears the synchronous step averages
+  {"STWV", CMDfunctionStr, 2, SetTWvoltage},                              // Set TW voltage, channel, value
+  {"GTWV", CMDfunction,  1, GetTWvoltage},                                // Return the TW voltage setting, channel
+  {"GTWVA", CMDfunction,  1, GetTWreadback},                              // Return the TW voltage readback, channel
+  {"SGRD", CMDfunctionStr, 1, SetGRDvoltage},                             // Set Gaurd voltage, value
+  {"SGRDA", CMDfunctionStr, 1, SetGRDvoltageAdj},                         // Set Gaurd voltage and adjust values below 5 volts, value
+  {"GGRD", CMDfloat,  0, &mftdata.Guard},                                 // Return the Gaurd voltage setting
+  {"GGRDA", CMDfloat,  0, &GRDreadback},                                  // Return the Gaurd readback
+  {"TRIGOUT", CMDfunctionStr, 1, SetTrigOut},                             // Trigger output function, HIGH, LOW, PULSE
+
+  {"STWVALT", CMDfunctionStr, 2, SetTWAvoltage},                          // Set TW alternut voltage, channel, value
+  {"GTWVALT", CMDfunction,  1, GetTWAvoltage},                            // Return the TW alternut voltage setting, channel
 
   // User programable limits, nite chan is entered only parameters needing a channel number
-  {"SMAX", CMDfunctionLine, 0, (char *)setMaximum},                       // Set user prgramable maximum limit, type,chan,value. types: GRD,TWV,FREQ
-  {"GMAX", CMDfunctionLine, 0, (char *)getMaximum},                       // Returns user programable maximum limit
-  {"SMIN", CMDfunctionLine, 0, (char *)setMinimum},                       // Set user prgramable minimum limit, type,chan,value. types: GRD,TWV,FREQ
-  {"GMIN", CMDfunctionLine, 0, (char *)getMinimum},                       // Returns user programable minimum limit
+  {"SMAX", CMDfunctionLine, 0, setMaximum},                               // Set user prgramable maximum limit, type,chan,value. types: GRD,TWV,FREQ
+  {"GMAX", CMDfunctionLine, 0, getMaximum},                               // Returns user programable maximum limit
+  {"SMIN", CMDfunctionLine, 0, setMinimum},                               // Set user prgramable minimum limit, type,chan,value. types: GRD,TWV,FREQ
+  {"GMIN", CMDfunctionLine, 0, getMinimum},                               // Returns user programable minimum limit
+  // Ramp engine
+  {"SRAMP", CMDfunctionLine, 0, setRamp},                                 // Set a ramp, type,chan,start,end,mS,LIN|EXP. types: FREQ,TWV,GRD
+  {"GRAMP", CMDfunctionLine, 0, getRamp},                                 // Returns a ramp, type,chan. start,end,mS,shape or NA
+  {"CLRRAMP", CMDfunction, 0, clearRamps},                                // Removes all the ramps
+  {"RUNRAMP", CMDfunction, 0, runRamps},                                  // Starts the ramps now
+  {"ARMRAMP", CMDfunction, 0, armRamps},                                  // Starts the ramps on the next RAMP trigger
+  {"STOPRAMP", CMDfunction, 0, stopRamps},                                // Stops the ramps, the values hold
+  {"GRAMPSTAT", CMDfunction, 0, getRampStatus},                           // Returns the ramp status, IDLE, ARMED or RUNNING
+  // Burst mode
+  {"SBSTCYC", CMDfunction, 1, setBurstCycles},                            // Sets the whole cycles per burst
+  {"GBSTCYC", CMDint, 0, &burst.cycles},                                  // Returns the cycles per burst
+  {"BURST", CMDfunction, 0, startBurst},                                  // Plays a burst now
+  {"BSTARM", CMDfunction, 0, armBurst},                                   // Plays a burst on the next BURST trigger
+  {"BSTSTOP", CMDfunction, 0, stopBurst},                                 // Disarms and ends a burst
+  {"GBSTSTAT", CMDfunction, 0, getBurstStatus},                           // Returns the burst status, IDLE, ARMED or RUNNING
+  {"SBSTREARM", CMDbool, 1, &burst.rearm},                                // If TRUE the burst is armed again when done
+  {"GBSTREARM", CMDbool, 0, &burst.rearm},
+  {"SBSTTRG", CMDbool, 1, &burst.trigOut},                                // If TRUE TrigOut is pulsed when a burst is done
+  {"GBSTTRG", CMDbool, 0, &burst.trigOut},
+  {"SBSTCMD", CMDbool, 1, &burst.command},                                // If TRUE the command string runs when a burst is done
+  {"GBSTCMD", CMDbool, 0, &burst.command},
+  {"GBSTCNT", CMDint, 0, &burst.count},                                   // Returns the bursts done
+  // Time table
+  {"CLRTBL", CMDfunction, 0, clearTable},                                 // Removes all the table entries
+  {"ADDTBL", CMDfunctionLine, 0, addTable},                               // Adds a table entry, time,action,chan,value. actions: FWD,PTRN,OPEN,OMSK,FREQ,TWV,GRD,ALT,TRIGOUT
+  {"GTBL", CMDfunction, 0, getTable},                                     // Returns the table entries separated by ;
+  {"STBLLEN", CMDint, 1, &table.length},                                  // Sets the table pass length in uS, 0 uses the last entry time
+  {"GTBLLEN", CMDint, 0, &table.length},                                  // Returns the table pass length
+  {"STBLREP", CMDint, 1, &table.reps},                                    // Sets the number of table passes, 0 repeats until stopped
+  {"GTBLREP", CMDint, 0, &table.reps},                                    // Returns the number of table passes
+  {"TBLSTRT", CMDfunction, 0, startTable},                                // Starts the table now
+  {"TBLARM", CMDfunction, 0, armTable},                                   // Starts the table on the next TBL trigger
+  {"TBLSTOP", CMDfunction, 0, stopTable},                                 // Stops the table
+  {"GTBLSTAT", CMDfunction, 0, getTableStatus},                           // Returns the table status, IDLE, ARMED or RUNNING
   // Advanced MFT functions
-  {"SOPEN", CMDfunctionStr, 2, (char *)setOpen},                          // Set enable output open mode, chnnel 1 or 2, TRUE to enable 
-  {"GOPEN", CMDfunction,  1, (char *)getOpen},                            // Returns output open mode, channel 1 or 2
-  {"SOMSK", CMDfunctionStr, 2, (char *)setOpenMask},                      // Set output open mask, bits set are open, channel 1 or 2, binary 8 bits
-  {"GOMSK", CMDfunction,  1, (char *)getOpenMask},                        // Returns output open mask, channel 1 or 2
-  {"SFWDPS",CMDfunctionStr, 2, (char *)setFwdPS},                         // Set forward phase shift, channel 1 or 2, phase shift in degrees
-  {"GFWDPS",CMDfunction,  1, (char *)getFwdPS},                           // Returns forward phase shift, channel 1 or 2
-  {"SREVPS",CMDfunctionStr, 2, (char *)setRevPS},                         // Set reverse phase shift, channel 1 or 2, phase shift in degrees
-  {"GREVPS",CMDfunction,  1, (char *)getRevPS},                           // Returns reverse phase shift, channel 1 or 2
+  {"SOPEN", CMDfunctionStr, 2, setOpen},                                  // Set enable output open mode, chnnel 1 or 2, TRUE to enable 
+  {"GOPEN", CMDfunction,  1, getOpen},                                    // Returns output open mode, channel 1 or 2
+  {"SOMSK", CMDfunctionStr, 2, setOpenMask},                              // Set output open mask, bits set are open, channel 1 or 2, binary 8 bits
+  {"GOMSK", CMDfunction,  1, getOpenMask},                                // Returns output open mask, channel 1 or 2
+  {"SFWDPS",CMDfunctionStr, 2, setFwdPS},                                 // Set forward phase shift, channel 1 or 2, phase shift in degrees
+  {"GFWDPS",CMDfunction,  1, getFwdPS},                                   // Returns forward phase shift, channel 1 or 2
+  {"SREVPS",CMDfunctionStr, 2, setRevPS},                                 // Set reverse phase shift, channel 1 or 2, phase shift in degrees
+  {"GREVPS",CMDfunction,  1, getRevPS},                                   // Returns reverse phase shift, channel 1 or 2
+  {"SOVRS", CMDfunction, 1, setOversample},                               // Sets the oversampling, frames per step 1 to 32, phase shifts are set in 45/n degree steps
+  {"GOVRS", CMDint, 0, &twOS},                                            // Returns the oversampling
+  {"GMAXFREQ", CMDfunction, 0, getMaxFrequency},                          // Returns the maximum frequency for the oversampling
+  // Step sequences
+  {"CLRSEQ", CMDfunction, 1, clearSequence},                              // Removes a channel's step sequence, channel 1 or 2
+  {"ADDSEQ", CMDfunctionLine, 0, addSequence},                            // Adds steps to a sequence, channel,mask[:dwell],... mask is binary 8 bits, dwell 1 to 256
+  {"GSEQ", CMDfunction, 1, getSequence},                                  // Returns a channel's sequence, channel 1 or 2
+  {"SSEQENA", CMDfunctionStr, 2, setSequenceEnable},                      // If TRUE the channel plays its sequence instead of its bit pattern, channel 1 or 2
+  {"GSEQENA", CMDfunction, 1, getSequenceEnable},                         // Returns the sequence mode, channel 1 or 2
   // Command string commands
-  {"STRGCMD1", CMDlongStr, MAXCMDLEN,(char *)commandString[0]},           // Allows definition of a string of valid commands
-  {"GTRGCMD1", CMDstr, 0,(char *)commandString[0]},                       // Returns the command string
-  {"STRGCMD2", CMDlongStr, MAXCMDLEN,(char *)commandString[1]},           // Allows definition of a string of valid commands
-  {"GTRGCMD2", CMDstr, 0,(char *)commandString[1]},                       // Returns the command string
-  {"ETRGCMD", CMDfunction,  0, (char *)playCommandString},                // Executes the active command string
-  {"ETRGCMD1", CMDfunction,  0, (char *)playCommandString1},              // Executes command string 1 and set it to active
-  {"ETRGCMD2", CMDfunction,  0, (char *)playCommandString2},              // Executes command string 2 and set it to active
-  {"SCMD", CMDfunction,  1, (char *)setActiveCMD},                        // Set active command string, 1 or 2
-  {"GCMD", CMDfunction,  0, (char *)getActiveCMD},                        // Returns active command string
+  {"STRGCMD1", CMDfunctionLongStr, 1, setCommandString1},                 // Allows definition of a string of valid commands, compiled when set
+  {"GTRGCMD1", CMDstr, 0,commandString[0]},                               // Returns the command string
+  {"STRGCMD2", CMDfunctionLongStr, 1, setCommandString2},                 // Allows definition of a string of valid commands, compiled when set
+  {"GTRGCMD2", CMDstr, 0,commandString[1]},                               // Returns the command string
+  {"ETRGCMD", CMDfunction,  0, playCommandString},                        // Executes the active command string
+  {"ETRGCMD1", CMDfunction,  0, playCommandString1},                      // Executes command string 1 and set it to active
+  {"ETRGCMD2", CMDfunction,  0, playCommandString2},                      // Executes command string 2 and set it to active
+  {"SCMD", CMDfunction,  1, setActiveCMD},                                // Set active command string, 1 or 2
+  {"GCMD", CMDfunction,  0, getActiveCMD},                                // Returns active command string
   // Clock commands
-  {"SCLOCK", CMDfunction,  1, (char *)setClock},                          // Sets clock frequenct, 0 to 10000, 0 = disable 
-  {"GCLOCK", CMDint,0,(char *)&clockFrequency},                           // Returns clock frequency
-  {"SCLKFUN", CMDfunctionStr,  1, (char *)setClockFunction},              // Sets clock function, NA,TRG,CNT
-  {"GCLKFUN", CMDstr,  0, (char *)clockMode},                             // Returns the clock function
+  {"SCLOCK", CMDfunction,  1, setClock},                                  // Sets clock frequenct, 0 to 10000, 0 = disable 
+  {"GCLOCK", CMDint,0,&clockFrequency},                                   // Returns clock frequency
+  {"SCLKFUN", CMDfunctionStr,  1, setClockFunction},                      // Sets clock function, NA,TRG,CNT
+  {"GCLKFUN", CMDstr,  0, clockMode},                                     // Returns the clock function
   // Trigger commands
-  {"TRIG1", CMDfunctionStr, 2, (char *)setTrig1},                         // Set trigger 1 two argument mode, and function
+  {"TRIG1", CMDfunctionStr, 2, setTrig1},                                 // Set trigger 1 two argument mode, and function
                                                                           // mode = POS,NEG,CHANGE,NA
-                                                                          // function = REV1,REV2,OPEN1,OPEN2,CNT,CMD
-  {"TRIG2", CMDfunctionStr, 2, (char *)setTrig2},                         // Set trigger 2 two argument mode, and function
+                                                                          // function = REV1,REV2,OPEN1,OPEN2,CNT,CMD,TWALT1,TWALT2,RAMP,TBL,BURST
+  {"TRIG2", CMDfunctionStr, 2, setTrig2},                                 // Set trigger 2 two argument mode, and function
   // Counter
-  {"GCNT", CMDint, 0, (char *)&pulseCounter.count},                       // Returns the pulse counter's current count
-  {"CLRCNT", CMDfunction, 0, (char *)clearCounter},                       // Resets the pulse counter
-  {"SCNTTRG", CMDint, 1, (char *)&pulseCounter.tcount},                   // Sets pulse counter threshold
-  {"GCNTTRG", CMDint, 0, (char *)&pulseCounter.tcount},                   // Returns pulse counter threshold
-  {"STRIGCNT", CMDbool, 1, (char *)&pulseCounter.triggerOnTcount},        // If TRUE enables trigger on threshold
-  {"GTRIGCNT", CMDbool, 0, (char *)&pulseCounter.triggerOnTcount},        
-  {"STRIGRST", CMDbool, 1, (char *)&pulseCounter.resetOnTcount},          // If TRUE enables reseting counter on threshold
-  {"GTRIGRST", CMDbool, 0, (char *)&pulseCounter.resetOnTcount},          
-  {"STRIGCMD", CMDbool, 1, (char *)&pulseCounter.commandOnTcount},        // If TRUE executes command string on threshold
-  {"GTRIGCMD", CMDbool, 0, (char *)&pulseCounter.commandOnTcount},        
+  {"GCNT", CMDint, 0, &pulseCounter.count},                               // Returns the pulse counter's current count
+  {"CLRCNT", CMDfunction, 0, clearCounter},                               // Resets the pulse counter
+  {"SCNTTRG", CMDint, 1, &pulseCounter.tcount},                           // Sets pulse counter threshold
+  {"GCNTTRG", CMDint, 0, &pulseCounter.tcount},                           // Returns pulse counter threshold
+  {"STRIGCNT", CMDbool, 1, &pulseCounter.triggerOnTcount},                // If TRUE enables trigger on threshold
+  {"GTRIGCNT", CMDbool, 0, &pulseCounter.triggerOnTcount},        
+  {"STRIGRST", CMDbool, 1, &pulseCounter.resetOnTcount},                  // If TRUE enables reseting counter on threshold
+  {"GTRIGRST", CMDbool, 0, &pulseCounter.resetOnTcount},          
+  {"STRIGCMD", CMDbool, 1, &pulseCounter.commandOnTcount},                // If TRUE executes command string on threshold
+  {"GTRIGCMD", CMDbool, 0, &pulseCounter.commandOnTcount},        
+  {"GEVOVF", CMDfunction, 0, getEventOverflows},                          // Returns the number of trigger and clock events lost to a full queue
 // Tigger input read commands
-  {"GTRIGIN", CMDfunction, 1, (char *)readTriggerInput},                  // Reads the state of trigger 1 or 2, returns 0 or 1
+  {"GTRIGIN", CMDfunction, 1, readTriggerInput},                          // Reads the state of trigger 1 or 2, returns 0 or 1
 // Calibration function
-  {"CAL", CMDfunction,  0, (char *)Calibrate},                            // Calibrates, TW1, TW2, and Gaurd
+  {"CAL", CMDfunction,  0, Calibrate},                                    // Calibrates, TW1, TW2, and Gaurd
 // End of table marker
-  {0},
+  {},
 };
 
 
+// Builds the command lookup table from CmdArray, linear probing on collisions
+template<int N> constexpr CmdIndex BuildCmdIndex(const Commands (&cmds)[N])
+{
+  CmdIndex index = {};
+
+  for(int i = 0; cmds[i].Cmd != 0; i++)
+  {
+    uint32_t j = CmdHash(cmds[i].Cmd) & (CMD_HASH_SIZE - 1);
+    while(index.slot[j] != 0) j = (j + 1) & (CMD_HASH_SIZE - 1);
+    index.slot[j] = i + 1;
+  }
+  return index;
+}
+
+static_assert(sizeof(CmdArray) / sizeof(Commands) < CMD_HASH_SIZE / 2, "CMD_HASH_SIZE too small for the command table");
+
+constexpr CmdIndex CmdLookup = BuildCmdIndex(CmdArray);
+
+// Returns the CmdArray index of the command, -1 if not found
+int FindCommand(const char *cmd)
+{
+  uint32_t j = CmdHash(cmd) & (CMD_HASH_SIZE - 1);
+
+  while(CmdLookup.slot[j] != 0)
+  {
+    if (strcmp(cmd, CmdArray[CmdLookup.slot[j] - 1].Cmd) == 0) return CmdLookup.slot[j] - 1;
+    j = (j + 1) & (CMD_HASH_SIZE - 1);
+  }
+  return -1;
+}
+
 // Sends a list of all commands
 void GetCommands(void)
 {
@@ -153,7 +261,7 @@ void GetCommands(void)
 // Delay command, delay is in millisecs
 void DelayCommand(int dtime)
 {
-  delay(dtime);
+  halDelay(dtime);
   SendACK;
 }
 
@@ -179,7 +287,11 @@ void Mute(char *cmd)
 void SerialInit(void)
 {
   Serial.begin(115200);
-  RB_Init(&RB);
+  for (int i = 0; i < NUM_CMDPORTS; i++)
+  {
+    RB_Init(&CmdPorts[i].rb);
+    CmdPorts[i].tx.port = CmdPorts[i].stream;
+  }
 }
 
 // This function builds a token string from the characters passed.
@@ -189,36 +301,78 @@ void Char2Token(char ch)
   if (Tptr >= MaxToken) Tptr = MaxToken - 1;
 }
 
-// Get token from string object, delimited with comma
-// Token are numbered 1 through n, returns empty string
-// at end of tokens
-String GetToken(String cmd, int TokenNum)
+// Returns the span of the string with leading and trailing white space removed
+Span SpanTrim(const char *str)
 {
-  int i, j, k;
-  String Token;
+  Span s;
 
-  // If TokenNum is 0 or 1 then return the first token.
-  // Return up to delimiter of the whole string.
-  cmd.trim();
-  if (TokenNum <= 1)
-  {
-    if ((i = cmd.indexOf(',')) == -1) return cmd;
-    Token = cmd.substring(0, i);
-    return Token;
-  }
-  // Find the requested token
-  k = 0;
-  for (i = 2; i <= TokenNum; i++)
-  {
-    if ((j = cmd.indexOf(',', k)) == -1) return "";
-    k = j + 1;
-  }
-  Token = cmd.substring(k);
-  Token.trim();
-  if ((j = Token.indexOf(',')) == -1) return Token;
-  Token = Token.substring(0, j);
-  Token.trim();
-  return Token;
+  s.str = str;
+  s.len = strlen(str);
+  return SpanTrim(s);
+}
+
+Span SpanTrim(Span s)
+{
+  while((s.len > 0) && isspace(s.str[0])) {s.str++; s.len--;}
+  while((s.len > 0) && isspace(s.str[s.len - 1])) s.len--;
+  return s;
+}
+
+// Returns the span starting at index to the end of s
+Span SpanFrom(Span s, int index)
+{
+  if(index > s.len) index = s.len;
+  s.str += index;
+  s.len -= index;
+  return s;
+}
+
+bool SpanStartsWith(Span s, const char *prefix)
+{
+  int len = strlen(prefix);
+
+  if(len > s.len) return false;
+  return strncmp(s.str, prefix, len) == 0;
+}
+
+bool SpanEquals(Span s, const char *str)
+{
+  if((int)strlen(str) != s.len) return false;
+  return strncmp(s.str, str, s.len) == 0;
+}
+
+// Returns the index of the first ch in the span, -1 if not found
+int SpanIndexOf(Span s, char ch)
+{
+  for(int i=0;i<s.len;i++) if(s.str[i] == ch) return i;
+  return -1;
+}
+
+// Copies the span to buf and null terminates, truncates to fit size. Returns the length copied
+int SpanCopy(Span s, char *buf, int size)
+{
+  if(size <= 0) return 0;
+  if(s.len >= size) s.len = size - 1;
+  memcpy(buf, s.str, s.len);
+  buf[s.len] = 0;
+  return s.len;
+}
+
+// Number conversions, same results as the String toInt and toFloat functions
+int SpanToInt(Span s)
+{
+  char buf[MaxToken];
+
+  SpanCopy(s, buf, sizeof(buf));
+  return atoi(buf);
+}
+
+float SpanToFloat(Span s)
+{
+  char buf[MaxToken];
+
+  SpanCopy(s, buf, sizeof(buf));
+  return atof(buf);
 }
 
 // This function reads the serial input ring buffer and returns a pointer to a ascii token.
@@ -232,7 +386,7 @@ char *GetToken(bool ReturnComma)
   // Exit if the input buffer is empty
   while (1)
   {
-    ch = RB_Next(&RB);
+    ch = RB_Next(&cmdPort->rb);
     if (ch == 0xFF) return NULL;
     if (Tptr >= MaxToken) Tptr = MaxToken - 1;
     if ((ch == '\n') || (ch == ';') || (ch == ':') || (ch == ',') || (ch == ']') || (ch == '['))
@@ -240,11 +394,11 @@ char *GetToken(bool ReturnComma)
       if (Tptr != 0) ch = 0;
       else
       {
-        Char2Token(RB_Get(&RB));
+        Char2Token(RB_Get(&cmdPort->rb));
         ch = 0;
       }
     }
-    else RB_Get(&RB);
+    else RB_Get(&cmdPort->rb);
     // Place the character in the input buffer and advance pointer
     Char2Token(ch);
     if (ch == 0)
@@ -256,18 +410,36 @@ char *GetToken(bool ReturnComma)
   }
 }
 
-char *TokenFromCommandLine(char expectedDel)
+// Returns the next token from the command line being processed. Tokens are split in
+// place at the delimiters and trimmed, empty tokens are skipped. Returns NULL at the
+// end of the line.
+char *LineToken(void)
 {
-  char *tkn;
-  
-  tkn = GetToken(true);
-  if(tkn == NULL) return NULL;
-  if(tkn[0] != expectedDel)
+  char *tkn, *end;
+
+  while (*LinePtr != 0)
   {
-    // Flush to end of line and return NULL
-    return NULL;
+    tkn = LinePtr;
+    while ((*LinePtr != 0) && (*LinePtr != ',') && (*LinePtr != ':') && (*LinePtr != '[') && (*LinePtr != ']')) LinePtr++;
+    LineDel = *LinePtr;
+    end = LinePtr;
+    if (*LinePtr != 0) *LinePtr++ = 0;
+    if (end == tkn) continue;
+    // Trim
+    while ((end > tkn) && isspace(end[-1])) *--end = 0;
+    while (isspace(*tkn)) tkn++;
+    return tkn;
   }
-  return GetToken(true);
+  LineDel = 0;
+  return NULL;
+}
+
+// Used by CMDfunctionLine commands to read their arguments from the command line, returns
+// NULL if the next token is not preceded by expectedDel
+char *TokenFromCommandLine(char expectedDel)
+{
+  if (LineDel != expectedDel) return NULL;
+  return LineToken();
 }
 
 char  *UserInput(char *message, void (*function)(void))
@@ -275,11 +447,12 @@ char  *UserInput(char *message, void (*function)(void))
   char *tkn;
   
   // Flush the input ring buffer
-  RB.Head=RB.Tail=RB.Count=RB.Commands=0;
+  RB_Init(&cmdPort->rb);
   serial->print(message);
   // Wait for a line to be detected in the ring buffer
-  while(RB.Commands == 0) 
+  while(cmdPort->rb.Commands == 0) 
   {
+    SendAllSerial();
     ReadAllSerial();
     if(function != NULL) function();
   }
@@ -292,28 +465,26 @@ char  *UserInput(char *message, void (*function)(void))
 int   UserInputInt(char *message, void (*function)(void))
 {
   char   *tkn;
-  String arg;
 
   tkn = UserInput(message,function);
   // Flush the input ring buffer
-  RB.Head=RB.Tail=RB.Count=RB.Commands=0;
-  arg = tkn;
-  return arg.toInt();
+  RB_Init(&cmdPort->rb);
+  if(tkn == NULL) return 0;
+  return atoi(tkn);
 }
 
 float UserInputFloat(char *message, void (*function)(void))
 {
   char   *tkn;
-  String arg;
 
   tkn = UserInput(message,function);
   // Flush the input ring buffer
-  RB.Head=RB.Tail=RB.Count=RB.Commands=0;
-  arg = tkn;
-  return arg.toFloat();
+  RB_Init(&cmdPort->rb);
+  if(tkn == NULL) return 0;
+  return atof(tkn);
 }
 
-void ExecuteCommand(Commands *cmd, int arg1, int arg2, char *args1, char *args2, float farg1)
+void ExecuteCommand(const Commands *cmd, int arg1, int arg2, char *args1, char *args2, float farg1)
 {
   if (echoMode) SelectedACKonlyString = ACKonlyString2;
   else SelectedACKonlyString = ACKonlyString1;
@@ -351,7 +522,8 @@ void ExecuteCommand(Commands *cmd, int arg1, int arg2, char *args1, char *args2,
       }
       if (cmd->NumArgs == 1)  // If true then read the value
       {
-        strcpy(cmd->pointers.charPtr, args1);
+        // String values are sized for MaxToken characters including the null
+        SpanCopy(SpanTrim(args1), cmd->pointers.charPtr, MaxToken);
         SendACK;
         break;
       }
@@ -401,147 +573,744 @@ void ExecuteCommand(Commands *cmd, int arg1, int arg2, char *args1, char *args2,
   }
 }
 
-// This function processes serial commands.
-// This function does not block and returns -1 if there was nothing to do.
-int ProcessCommand(void)
-{
-  String sToken;
-  char   *Token, ch;
-  int    i;
-  static int   arg1, arg2;
-  static float farg1;
-  static enum  PCstates state;
-  static int   CmdNum;
-  static char  delimiter = 0;
-  // The following variables are used for the long string reading mode
-  static char *lstrptr = NULL;
-  static int  lstrindex;
-  static bool lstrmode = false;
-  static int lstrmax;
-
-  // Wait for line in ringbuffer
-  if (state == PCargLine)
-  {
-    if (RB.Commands <= 0) return -1;
-    CmdArray[CmdNum].pointers.funcVoid();
-    state = PCcmd;
-    return 0;
-  }
-  if (lstrmode)
-  {
-    ch = RB_Get(&RB);
-    if (ch == 0xFF) return (-1);
-//    if (ch == ',') return (0);    // allow a comma in the long string
-    if (ch == '\r') return (0);
-    if (ch == '\n')
+void EchoToken(const char *tkn, char *delimiter)
+{
+  if ((!echoMode) || (SerialMute)) return;
+  if (*delimiter != 0) serial->write(*delimiter);
+  serial->print(tkn);
+  *delimiter = ',';
+}
+
+// A full ring buffer with no line end can never complete a line, the buffered data is
+// dropped and NAKed so the port is not stuck. The rest of the line is dropped when its
+// end arrives. Returns -1 if the buffer is not full.
+static int LineOverflow(CmdPort *port, Stream *out)
+{
+  if (port->rb.Count < RB_BUF_SIZE) return (-1);
+  cmdPort = port;
+  serial = out;
+  RB_Skip(&port->rb, port->rb.Count);
+  port->overflow = true;
+  port->delimiter = 0;
+  SetErrorCode(ERR_LINETOOLONG);
+  SendNAK;
+  return (0);
+}
+
+// Processes an ASCII command line from port. A complete command line is taken from the
+// port's ring buffer, split in place and dispatched in one call. Responses are sent to
+// out. Long string commands run to the end of the line so ; can be used in the string.
+// Returns -1 if there is no complete line.
+int ProcessLine(CmdPort *port, Stream *out)
+{
+  const Commands *cmd;
+  Ring_Buffer    *rb = &port->rb;
+  char   *Cmd, *args[3], term;
+  int    i, len, CmdNum;
+
+  if ((len = RB_LineLength(rb, false)) == 0) return LineOverflow(port, out);
+  if (port->overflow)
+  {
+    // End of a line that overflowed the buffer, it was already NAKed
+    RB_Skip(rb, len);
+    port->overflow = false;
+    return (0);
+  }
+  cmdPort = port;
+  serial = out;
+  term = RB_Peek(rb, len - 1);
+  LineTerm = term;
+  // DAC writes from commands on one line, separated by ;, update the outputs together
+  if (term == ';')
+  {
+    port->dacGroup = true;
+    MAX5815group(true);
+  }
+  RB_PeekLine(rb, Line, MaxLine, len - 1);
+  LinePtr = Line;
+  Cmd = LineToken();
+  // In tag mode a command can start with #tag, the tag is sent in front of its response
+  if ((port->tagged) && (out == &port->tx) && (Cmd != NULL) && (Cmd[0] == '#'))
+  {
+    // The tag and its comma must fit, a longer tag is rejected rather than cut
+    if (strlen(Cmd) + 2 > sizeof(port->tx.tag))
     {
-      lstrptr[lstrindex++] = 0;
-      if(lstrindex >= lstrmax) lstrindex = lstrmax - 1;
-      lstrmode = false;
-      SendACK;
-      return (-1);
+      RB_Skip(rb, len);
+      if (term != ';') port->delimiter = 0;
+      SetErrorCode(ERR_BADARG);
+      SendNAK;
+      return (0);
     }
-    lstrptr[lstrindex++] = ch;
-    if(lstrindex >= lstrmax) lstrindex = lstrmax - 1;
-    if((lstrindex+1) < lstrmax) lstrptr[lstrindex + 1] = 0;  // Keeps the string null terminated as it builds
-    else lstrptr[lstrmax - 1] = 0;   
+    snprintf(port->tx.tag, sizeof(port->tx.tag), "%s,", Cmd);
+    Cmd = LineToken();
+  }
+  if ((Cmd == NULL) || ((CmdNum = FindCommand(Cmd)) == -1))
+  {
+    RB_Skip(rb, len);
+    if (Cmd != NULL) EchoToken(Cmd, &port->delimiter);
+    if (term == ';') EchoToken(";", &port->delimiter);
+    else port->delimiter = 0;
+    if (Cmd == NULL) return (0);
+    SetErrorCode(ERR_BADCMD);
+    SendNAK;
     return (0);
   }
-  Token = GetToken(false);
-  if (Token == NULL) return (-1);
-  if (Token[0] == 0) return (-1);
-  if ((echoMode) && (!SerialMute))
+  cmd = &CmdArray[CmdNum];
+  EchoToken(Cmd, &port->delimiter);
+  // If this is a long string command the string is the rest of the line after the
+  // command and the comma
+  if (cmd->Type == CMDlongStr)
   {
-    if (strcmp(Token, "\n") != 0)
+    if (term == ';')
     {
-      if (delimiter != 0) serial->write(delimiter);
-      serial->print(Token);
+      if ((len = RB_LineLength(rb, true)) == 0) return LineOverflow(port, out);
+      LineTerm = term = RB_Peek(rb, len - 1);
+      RB_PeekLine(rb, Line, MaxLine, len - 1);
+      LinePtr = Line;
+      LineToken();
     }
-    if (strcmp(Token, "\n") == 0) delimiter = 0;
-    else delimiter = ',';
+    RB_Skip(rb, len);
+    port->delimiter = 0;
+    for (i = 0; (LinePtr[i] != 0) && (i < cmd->NumArgs - 1); i++) cmd->pointers.charPtr[i] = LinePtr[i];
+    cmd->pointers.charPtr[i] = 0;
+    SendACK;
+    return (0);
   }
-  switch (state)
+  if (cmd->Type == CMDfunctionLongStr)
   {
-    case PCcmd:
-      if (strcmp(Token, ";") == 0) break;
-      if (strcmp(Token, "\n") == 0) break;
-      CmdNum = -1;
-      // Look for command in command table
-      for (i = 0; CmdArray[i].Cmd != 0; i++) if (strcmp(Token, CmdArray[i].Cmd) == 0)
-        {
-          CmdNum = i;
-          break;
-        }
-      if (CmdNum == -1)
-      {
-        SetErrorCode(ERR_BADCMD);
-        SendNAK;
-        break;
-      }
-      // If the type CMDfunctionLine then we will wait for a full line in the ring buffer
-      // before we call the function. Function has not args and must pull tokens from ring buffer.
-      if (CmdArray[i].Type == CMDfunctionLine)
-      {
-        state = PCargLine;
-        break;
-      }
-      // If this is a long string read command type then init the vaiable to support saving the
-      // string directly to the provided pointer and exit. This function must not block
-      if (CmdArray[i].Type == CMDlongStr)
-      {
-        lstrptr = CmdArray[i].pointers.charPtr;
-        lstrindex = 0;
-        lstrmax = CmdArray[i].NumArgs;
-        lstrmode = true;
-        // If the next char is a comma then remove it
-        if(RB_Next(&RB) == ',') RB_Get(&RB);
-        break;
-      }
-      if (CmdArray[i].NumArgs > 0) state = PCarg1;
-      else state = PCend;
-      break;
-    case PCarg1:
-      Sarg1[0] = 0;
-      sToken = Token;
-      sToken.trim();
-      arg1 = sToken.toInt();
-      farg1 = sToken.toFloat();
-      strcpy(Sarg1, sToken.c_str());
-      if (CmdArray[CmdNum].NumArgs > 1) state = PCarg2;
-      else state = PCend;
-      break;
-    case PCarg2:
-      Sarg2[0] = 0;
-      sToken = Token;
-      sToken.trim();
-      arg2 = sToken.toInt();
-      strcpy(Sarg2, sToken.c_str());
-      if (CmdArray[CmdNum].NumArgs > 2) state = PCarg3;
-      else state = PCend;
+    if (term == ';')
+    {
+      if ((len = RB_LineLength(rb, true)) == 0) return LineOverflow(port, out);
+      LineTerm = RB_Peek(rb, len - 1);
+      RB_PeekLine(rb, Line, MaxLine, len - 1);
+      LinePtr = Line;
+      LineToken();
+    }
+    RB_Skip(rb, len);
+    port->delimiter = 0;
+    cmd->pointers.func1str(LinePtr);
+    return (0);
+  }
+  RB_Skip(rb, len);
+  // CMDfunctionLine commands get their arguments from the line with TokenFromCommandLine
+  if (cmd->Type == CMDfunctionLine)
+  {
+    if (term == ';') EchoToken(";", &port->delimiter);
+    else port->delimiter = 0;
+    cmd->pointers.funcVoid();
+    return (0);
+  }
+  // The command must have all its arguments and no more
+  for (i = 0; i < 3; i++) args[i] = (char *)"";
+  for (i = 0; i < cmd->NumArgs; i++)
+  {
+    if ((args[i] = LineToken()) == NULL) break;
+    EchoToken(args[i], &port->delimiter);
+  }
+  if (term == ';') EchoToken(";", &port->delimiter);
+  else port->delimiter = 0;
+  if ((i < cmd->NumArgs) || (LineToken() != NULL))
+  {
+    SetErrorCode(ERR_BADARG);
+    SendNAK;
+    return (0);
+  }
+  if (cmd->NumArgs > 2) ExecuteCommand(cmd, atoi(args[0]), atoi(args[1]), args[0], args[1], atof(args[2]));
+  else ExecuteCommand(cmd, atoi(args[0]), atoi(args[1]), args[0], args[1], atof(args[0]));
+  return (0);
+}
+
+// Binary mode response capture, the output a command writes to serial is collected
+// here and returned in the response frame
+class BinCapture : public Stream
+{
+  public:
+    uint8_t buf[BIN_MAX + 1];
+    int     len;
+    size_t write(uint8_t b) { if (len < BIN_MAX) buf[len++] = b; return 1; }
+    int    available(void)  { return 0; }
+    int    read(void)       { return -1; }
+    int    peek(void)       { return -1; }
+    using  Print::write;
+};
+
+BinCapture binCapture;
+
+// Sends a binary response frame, type is 0 if there is no value
+void BinRespond(Stream *out, uint8_t id, uint8_t status, char type, const void *val, int vlen)
+{
+  uint8_t frame[BIN_MAX + 4];
+  int     n = 4;
+
+  frame[0] = BIN_SOF;
+  frame[2] = id;
+  frame[3] = status;
+  if (type != 0)
+  {
+    if (vlen > BIN_MAX - 3) vlen = BIN_MAX - 3;
+    frame[n++] = type;
+    memcpy(&frame[n], val, vlen);
+    n += vlen;
+    if (type == BIN_STR) frame[n - 1] = 0;
+  }
+  frame[1] = n - 2;
+  frame[n] = ComputeCRC(&frame[1], n - 1);
+  out->write(frame, n + 1);
+}
+
+// Builds the response to a binary command from its captured output. A NAK in the output
+// returns the error code, a value is returned as an int or float if it is a number and
+// as a string if not.
+void BinRespondCapture(Stream *out, uint8_t id)
+{
+  char    *text = (char *)binCapture.buf, *end;
+  int     len = binCapture.len;
+  int32_t ival;
+  float   fval;
+
+  if (memchr(text, NAK, len) != NULL)
+  {
+    ival = ErrorCode;
+    BinRespond(out, id, NAK, BIN_INT, &ival, 4);
+    return;
+  }
+  while ((len > 0) && ((*text == ACK) || (*text == ','))) {text++; len--;}
+  while ((len > 0) && isspace(text[len - 1])) len--;
+  if (len == 0)
+  {
+    BinRespond(out, id, ACK, 0, NULL, 0);
+    return;
+  }
+  text[len] = 0;
+  ival = strtol(text, &end, 10);
+  if (end == &text[len])
+  {
+    BinRespond(out, id, ACK, BIN_INT, &ival, 4);
+    return;
+  }
+  fval = strtod(text, &end);
+  if (end == &text[len]) BinRespond(out, id, ACK, BIN_FLOAT, &fval, 4);
+  else BinRespond(out, id, ACK, BIN_STR, text, len + 1);
+}
+
+// Processes a binary command frame from port. Lines of ASCII commands pushed to the port
+// by trigger command strings and IF actions are run with the responses discarded, any
+// other bytes before a frame start are dropped. Returns -1 if there is no complete frame.
+int ProcessFrame(CmdPort *port)
+{
+  const Commands *cmd;
+  Ring_Buffer    *rb = &port->rb;
+  uint8_t        frame[BIN_MAX + 4], *p, *end;
+  int32_t        iarg[BIN_ARGS];
+  float          farg[BIN_ARGS];
+  char           *sarg[BIN_ARGS], text[BIN_ARGS][16];
+  int            i, len, n;
+
+  if (RB_PeekLine(rb, (char *)frame, 3, 2) == 0) return (-1);
+  if (frame[0] != BIN_SOF)
+  {
+    if ((len = RB_TextLength(rb)) < 0)
+    {
+      if (LineOverflow(port, &binCapture) == -1) return (-1);
+      binCapture.len = 0;
+      return (0);
+    }
+    if (len == 0)
+    {
+      RB_Skip(rb, 1);
+      return (0);
+    }
+    ProcessLine(port, &binCapture);
+    binCapture.len = 0;
+    return (0);
+  }
+  if (rb->Count < 2) return (-1);
+  len = frame[1] + 3;
+  if (rb->Count < len) return (-1);
+  RB_PeekLine(rb, (char *)frame, sizeof(frame), len);
+  cmdPort = port;
+  serial = &port->tx;
+  if ((len < 4) || (ComputeCRC(&frame[1], len - 2) != frame[len - 1]))
+  {
+    // Drop the start byte and resync on the next one
+    RB_Skip(rb, 1);
+    iarg[0] = ERR_BADCRC;
+    SetErrorCode(ERR_BADCRC);
+    BinRespond(serial, 0xFF, NAK, BIN_INT, &iarg[0], 4);
+    return (0);
+  }
+  RB_Skip(rb, len);
+  if (frame[2] >= sizeof(CmdArray) / sizeof(Commands) - 1)
+  {
+    iarg[0] = ERR_BADCMD;
+    SetErrorCode(ERR_BADCMD);
+    BinRespond(serial, frame[2], NAK, BIN_INT, &iarg[0], 4);
+    return (0);
+  }
+  cmd = &CmdArray[frame[2]];
+  // Value reads are returned directly
+  if ((cmd->NumArgs == 0) && (cmd->Type == CMDint)) {BinRespond(serial, frame[2], ACK, BIN_INT, cmd->pointers.intPtr, 4); return (0);}
+  if ((cmd->NumArgs == 0) && (cmd->Type == CMDfloat)) {BinRespond(serial, frame[2], ACK, BIN_FLOAT, cmd->pointers.floatPtr, 4); return (0);}
+  if ((cmd->NumArgs == 0) && (cmd->Type == CMDbool)) {BinRespond(serial, frame[2], ACK, BIN_BOOL, cmd->pointers.boolPtr, 1); return (0);}
+  if ((cmd->NumArgs == 0) && (cmd->Type == CMDstr)) {BinRespond(serial, frame[2], ACK, BIN_STR, cmd->pointers.charPtr, strlen(cmd->pointers.charPtr) + 1); return (0);}
+  // Decode the arguments, numbers are also made into strings for the commands that
+  // take string arguments. Unused arguments are 0 and empty strings
+  for (i = 0; i < BIN_ARGS; i++) {iarg[i] = 0; farg[i] = 0; sarg[i] = (char *)"";}
+  p = &frame[3];
+  end = &frame[len - 1];
+  for (n = 0; p < end; n++)
+  {
+    if (n >= BIN_ARGS) break;
+    if ((*p == BIN_INT) && (end - p >= 5))
+    {
+      memcpy(&iarg[n], p + 1, 4);
+      farg[n] = iarg[n];
+      snprintf(text[n], sizeof(text[n]), "%ld", (long)iarg[n]);
+      sarg[n] = text[n];
+      p += 5;
+    }
+    else if ((*p == BIN_FLOAT) && (end - p >= 5))
+    {
+      memcpy(&farg[n], p + 1, 4);
+      iarg[n] = farg[n];
+      snprintf(text[n], sizeof(text[n]), "%g", farg[n]);
+      sarg[n] = text[n];
+      p += 5;
+    }
+    else if ((*p == BIN_BOOL) && (end - p >= 2))
+    {
+      iarg[n] = farg[n] = (p[1] != 0);
+      sarg[n] = (char *)(p[1] ? "TRUE" : "FALSE");
+      p += 2;
+    }
+    else if ((*p == BIN_STR) && (memchr(p + 1, 0, end - p - 1) != NULL))
+    {
+      sarg[n] = (char *)(p + 1);
+      iarg[n] = atoi(sarg[n]);
+      farg[n] = atof(sarg[n]);
+      p += strlen(sarg[n]) + 2;
+    }
+    else break;
+  }
+  binCapture.len = 0;
+  serial = &binCapture;
+  if (p != end) {SetErrorCode(ERR_BADARG); SendNAK;}
+  else if (cmd->Type == CMDlongStr)
+  {
+    for (i = 0; (sarg[0][i] != 0) && (i < cmd->NumArgs - 1); i++) cmd->pointers.charPtr[i] = sarg[0][i];
+    cmd->pointers.charPtr[i] = 0;
+    SendACK;
+  }
+  else if (cmd->Type == CMDfunctionLongStr) cmd->pointers.func1str(sarg[0]);
+  else if (cmd->Type == CMDfunctionLine)
+  {
+    // The arguments are passed as a comma delimited line
+    Line[0] = 0;
+    for (i = 0; i < n; i++)
+    {
+      if (i > 0) strncat(Line, ",", MaxLine - strlen(Line) - 1);
+      strncat(Line, sarg[i], MaxLine - strlen(Line) - 1);
+    }
+    LinePtr = Line;
+    LineDel = ',';
+    cmd->pointers.funcVoid();
+  }
+  else if (n != cmd->NumArgs) {SetErrorCode(ERR_BADARG); SendNAK;}
+  else ExecuteCommand(cmd, iarg[0], iarg[1], sarg[0], sarg[1], cmd->NumArgs > 2 ? farg[2] : farg[0]);
+  serial = &port->tx;
+  BinRespondCapture(serial, frame[2]);
+  binCapture.len = 0;
+  return (0);
+}
+
+// This function processes serial commands from port, ASCII lines or binary frames
+// depending on the port mode.
+// This function does not block and returns -1 if there was nothing to do.
+int ProcessCommand(CmdPort *port)
+{
+  int i;
+
+  LineTerm = 0;
+  if (port->binary) i = ProcessFrame(port);
+  else i = ProcessLine(port, &port->tx);
+  // A DAC group opened by ; ends with its line, or when the port has no more complete
+  // lines so a trailing ; does not hold the outputs
+  if ((port->dacGroup) && ((i == -1) || (LineTerm != ';')))
+  {
+    port->dacGroup = false;
+    MAX5815group(false);
+  }
+  port->tx.tag[0] = 0;
+  return i;
+}
+
+// Selects the binary command frame or ASCII mode for the port the command came from
+void SetBinaryMode(char *mode)
+{
+  if (strcmp(mode, "TRUE") == 0) cmdPort->binary = true;
+  else if (strcmp(mode, "FALSE") == 0) cmdPort->binary = false;
+  else BADARG;
+  SendACK;
+}
+
+// Selects request tag mode for the port the command came from
+void SetTagMode(char *mode)
+{
+  if (strcmp(mode, "TRUE") == 0) cmdPort->tagged = true;
+  else if (strcmp(mode, "FALSE") == 0) cmdPort->tagged = false;
+  else BADARG;
+  SendACK;
+}
+
+size_t TxQueue::write(uint8_t b)
+{
+  char t[sizeof(tag)];
+
+  // Send the tag in front of the first character of the response
+  if (tag[0] != 0)
+  {
+    strcpy(t, tag);
+    tag[0] = 0;
+    write((const uint8_t *)t, strlen(t));
+  }
+  // When full wait for the port to take the queue so a response is never cut, the
+  // character is only dropped if the port fails
+  if (count >= TX_BUF_SIZE) send(true);
+  if (count >= TX_BUF_SIZE)
+  {
+    overflows++;
+    return (0);
+  }
+  buf[(head + count) % TX_BUF_SIZE] = b;
+  count++;
+  return (1);
+}
+
+size_t TxQueue::write(const uint8_t *b, size_t n)
+{
+  for (size_t i = 0; i < n; i++) if (write(b[i]) == 0) return (i);
+  return (n);
+}
+
+// Sends queued output, all of it or as much as the port can take without blocking
+void TxQueue::send(bool all)
+{
+  int n;
+
+  if (port == NULL) return;
+  while (count > 0)
+  {
+    if (all) n = count;
+    else if ((n = port->availableForWrite()) <= 0) return;
+    if (n > count) n = count;
+    if (n > TX_BUF_SIZE - head) n = TX_BUF_SIZE - head;
+    if ((n = port->write(&buf[head], n)) <= 0) return;
+    head = (head + n) % TX_BUF_SIZE;
+    count -= n;
+  }
+}
+
+// Sends the output queued for all the ports, all of it or what the ports can take
+void SendAllSerial(bool all)
+{
+  for (int i = 0; i < NUM_CMDPORTS; i++) CmdPorts[i].tx.send(all);
+}
+
+// Queues a telemetry sample on each streaming port that is due one
+void SendTelemetry(void)
+{
+  CmdPort   *p;
+  TLMsample s;
+  uint32_t  now, period, missed;
+
+  for (int i = 0; i < NUM_CMDPORTS; i++)
+  {
+    p = &CmdPorts[i];
+    if (p->tlmRate == 0) continue;
+    now = halMicros();
+    if ((int32_t)(now - p->tlmNext) < 0) continue;
+    // Periods missed while the loop was busy are counted but not sent
+    period = 1000000 / p->tlmRate;
+    missed = (now - p->tlmNext) / period;
+    p->tlmSeq += missed;
+    p->tlmNext += (missed + 1) * period;
+    if (p->tx.count > TX_BUF_SIZE / 2)
+    {
+      p->tlmSeq++;
+      continue;
+    }
+    s.seq = p->tlmSeq++;
+    s.time = now;
+    s.tw[0] = TW1readback;
+    s.tw[1] = TW2readback;
+    s.guard = GRDreadback;
+    s.count = pulseCounter.count;
+    if (strcmp(Status, "Running") == 0) s.status = TLM_RUNNING;
+    else if (strcmp(Status, "Stepping") == 0) s.status = TLM_STEPPING;
+    else s.status = TLM_STOPPED;
+    if (p->binary)
+    {
+      BinRespond(&p->tx, TLM_ID, ACK, BIN_TLM, &s, sizeof(TLMsample));
+      continue;
+    }
+    p->tx.print("TLM,");
+    p->tx.print(s.seq); p->tx.print(",");
+    p->tx.print(s.time); p->tx.print(",");
+    p->tx.print(s.tw[0]); p->tx.print(",");
+    p->tx.print(s.tw[1]); p->tx.print(",");
+    p->tx.print(s.guard); p->tx.print(",");
+    p->tx.print(s.count); p->tx.print(",");
+    p->tx.println(s.status);
+  }
+}
+
+// Starts or stops telemetry streaming to the port the command came from
+void SetTelemetry(int rate)
+{
+  if ((rate < 0) || (rate > TLM_MAXRATE)) BADARG;
+  cmdPort->tlmRate = rate;
+  cmdPort->tlmNext = halMicros();
+  cmdPort->tlmSeq = 0;
+  SendACK;
+}
+
+void GetTelemetry(void)
+{
+  SendACKonly;
+  if (SerialMute) return;
+  serial->println(cmdPort->tlmRate);
+}
+
+// Returns the number of characters dropped because this port's output queue was full
+void GetTxOverflows(void)
+{
+  SendACKonly;
+  if (SerialMute) return;
+  serial->println(cmdPort->tx.overflows);
+}
+
+// Trigger command string compiler. Commands are split on ; or \n, each one is resolved to
+// its CmdArray index and its arguments are stored null terminated in the program text.
+// Offset 0 of the text is always an empty string for the missing arguments.
+
+// Adds str to the program text, returns its offset or -1 if there is no room
+static int CompileText(CmdProgram *prog, int *used, const char *str)
+{
+  int n = strlen(str) + 1;
+
+  if (*used + n > MAXCMDLEN) return (-1);
+  memcpy(&prog->text[*used], str, n);
+  *used += n;
+  return (*used - n);
+}
+
+static bool CompileOp(CmdProgram *prog, int *used, char *str, int index);
+
+// Decodes a conditional action, a value, a +=/-= change, or a command with _ for commas
+static bool CompileAction(CmdProgram *prog, int *used, Span s, CondAction *action)
+{
+  char  buf[MAXCMDLEN];
+  int   i;
+
+  s = SpanTrim(s);
+  action->type = CP_NONE;
+  if (s.len == 0) return (true);
+  if (SpanStartsWith(s, "+=") || SpanStartsWith(s, "-="))
+  {
+    action->type = CP_CHANGE;
+    action->val = SpanToFloat(SpanFrom(s, 2));
+    if (s.str[0] == '-') action->val = -action->val;
+    return (true);
+  }
+  if (isDigit(s.str[0]) || (s.str[0] == '.') || (s.str[0] == '-'))
+  {
+    action->type = CP_VALUE;
+    action->val = SpanToFloat(s);
+    return (true);
+  }
+  SpanCopy(s, buf, sizeof(buf));
+  for (i = 0; buf[i] != 0; i++) if (buf[i] == '_') buf[i] = ',';
+  // Action ops are placed from the end of the list
+  if (prog->last <= prog->num) {SetErrorCode(ERR_BADARG); return (false);}
+  action->type = CP_CMD;
+  action->op = --prog->last;
+  return CompileOp(prog, used, buf, action->op);
+}
+
+// Decodes a conditional argument, cond|true action|false action, the same syntax as checkIF
+static bool CompileCond(CmdProgram *prog, int *used, CmdOp *op, int arg)
+{
+  Span  s, t;
+  int   i, n;
+
+  s = SpanTrim(&prog->text[op->arg[arg]]);
+  if (SpanStartsWith(s, "<=")) {op->cond = 'L'; s = SpanFrom(s, 2);}
+  else if (SpanStartsWith(s, ">=")) {op->cond = 'G'; s = SpanFrom(s, 2);}
+  else if (SpanStartsWith(s, ">") || SpanStartsWith(s, "<") || SpanStartsWith(s, "=")) {op->cond = s.str[0]; s = SpanFrom(s, 1);}
+  else return (true);
+  op->condArg = arg;
+  op->condVal = SpanToFloat(s);
+  op->action[0].type = op->action[1].type = CP_NONE;
+  for (i = 0; i < 2; i++)
+  {
+    if ((n = SpanIndexOf(s, '|')) == -1) return (true);
+    s = SpanFrom(s, n + 1);
+    t = s;
+    if ((n = SpanIndexOf(s, '|')) != -1) t.len = n;
+    if (!CompileAction(prog, used, t, &op->action[i])) return (false);
+  }
+  return (true);
+}
+
+// Compiles one command into ops[index], str is split in place
+static bool CompileOp(CmdProgram *prog, int *used, char *str, int index)
+{
+  CmdOp          *op = &prog->ops[index];
+  const Commands *cmd;
+  char           *tkn;
+  int            i, n;
+
+  LinePtr = str;
+  if (((tkn = LineToken()) == NULL) || ((n = FindCommand(tkn)) == -1)) {SetErrorCode(ERR_BADCMD); return (false);}
+  cmd = &CmdArray[n];
+  op->cmd = n;
+  op->del = LineDel;
+  op->arg[0] = op->arg[1] = 0;
+  op->condArg = 0xFF;
+  op->farg = 0;
+  if ((cmd->Type == CMDlongStr) || (cmd->Type == CMDfunctionLongStr) || (cmd->Type == CMDfunctionLine))
+  {
+    // The rest of the command is passed as is
+    if ((n = CompileText(prog, used, LinePtr)) == -1) {SetErrorCode(ERR_BADARG); return (false);}
+    op->arg[0] = n;
+    return (true);
+  }
+  for (i = 0; i < cmd->NumArgs; i++)
+  {
+    if ((tkn = LineToken()) == NULL) break;
+    if (i < 2)
+    {
+      if ((n = CompileText(prog, used, tkn)) == -1) {SetErrorCode(ERR_BADARG); return (false);}
+      op->arg[i] = n;
+    }
+    else op->farg = atof(tkn);
+  }
+  // Same rule as ProcessLine, the argument count must match
+  if ((i < cmd->NumArgs) || (LineToken() != NULL)) {SetErrorCode(ERR_BADARG); return (false);}
+  op->iarg[0] = atoi(&prog->text[op->arg[0]]);
+  op->iarg[1] = atoi(&prog->text[op->arg[1]]);
+  if (cmd->NumArgs <= 2) op->farg = atof(&prog->text[op->arg[0]]);
+  // Only the first conditional is used, as checkIF is only called for one argument
+  for (i = 0; i < 2; i++)
+  {
+    if (op->arg[i] == 0) continue;
+    if (!CompileCond(prog, used, op, i)) return (false);
+    if (op->condArg != 0xFF) break;
+  }
+  return (true);
+}
+
+// Compiles a trigger command string into prog. Returns false with the error code set if
+// the string has an unknown command, the wrong number of arguments, or does not fit.
+bool CompileCmdString(CmdProgram *prog, const char *str)
+{
+  char  buf[MAXCMDLEN], *cmd, *p, *save = LinePtr, saveDel = LineDel;
+  int   used = 1;
+  bool  ok = true;
+
+  prog->text[0] = 0;
+  prog->num = 0;
+  prog->last = CP_MAXOPS;
+  strncpy(buf, str, MAXCMDLEN - 1);
+  buf[MAXCMDLEN - 1] = 0;
+  for (p = buf; ok && (*p != 0);)
+  {
+    cmd = p;
+    while ((*p != 0) && (*p != ';') && (*p != '\n') && (*p != '\r')) p++;
+    if (*p != 0) *p++ = 0;
+    if (SpanTrim(cmd).len == 0) continue;
+    if (prog->num >= prog->last) {SetErrorCode(ERR_BADARG); ok = false; break;}
+    ok = CompileOp(prog, &used, cmd, prog->num++);
+  }
+  LinePtr = save;
+  LineDel = saveDel;
+  if (!ok) prog->num = 0;
+  return (ok);
+}
+
+// Conditional of the op being run, checkIF uses the decoded form when it is passed ifArg
+const CmdOp *ifOp = NULL;
+const char  *ifArg = NULL;
+int         ifAction = -1;      // Action op index set by checkIF, run after the op
+
+static void RunCmdOp(CmdProgram *prog, int index)
+{
+  const CmdOp    *op = &prog->ops[index];
+  const Commands *cmd = &CmdArray[op->cmd];
+  char           *args[2];
+  int            i;
+  bool           mute;
+
+  // Commands can change their arguments so they run on a copy of the text
+  memcpy(Line, prog->text, MAXCMDLEN);
+  args[0] = &Line[op->arg[0]];
+  args[1] = &Line[op->arg[1]];
+  ifOp = op;
+  ifArg = op->condArg < 2 ? args[op->condArg] : NULL;
+  ifAction = -1;
+  switch (cmd->Type)
+  {
+    case CMDlongStr:
+      for (i = 0; (args[0][i] != 0) && (i < cmd->NumArgs - 1); i++) cmd->pointers.charPtr[i] = args[0][i];
+      cmd->pointers.charPtr[i] = 0;
+      SendACK;
       break;
-    case PCarg3:
-      sToken = Token;
-      sToken.trim();
-      farg1 = sToken.toFloat();
-      state = PCend;
+    case CMDfunctionLongStr:
+      cmd->pointers.func1str(args[0]);
       break;
-    case PCend:
-      if ((strcmp(Token, "\n") != 0) && (strcmp(Token, ";") != 0))
-      {
-        state = PCcmd;
-        SendNAK;
-        break;
-      }
-      i = CmdNum;
-      CmdNum = -1;
-      state = PCcmd;
-      ExecuteCommand(&CmdArray[i], arg1, arg2, Sarg1, Sarg2, farg1);
+    case CMDfunctionLine:
+      LinePtr = args[0];
+      LineDel = op->del;
+      cmd->pointers.funcVoid();
       break;
     default:
-      state = PCcmd;
+      ExecuteCommand(cmd, op->iarg[0], op->iarg[1], args[0], args[1], op->farg);
       break;
   }
-  return (0);
+  ifOp = NULL;
+  ifArg = NULL;
+  i = ifAction;
+  ifAction = -1;
+  // Conditional command actions run muted, as they did when pushed to the ring buffer
+  if (i >= 0)
+  {
+    mute = SerialMute;
+    SerialMute = true;
+    RunCmdOp(prog, i);
+    SerialMute = mute;
+  }
+}
+
+// Runs a compiled command string, command strings can start each other so the nesting
+// is limited
+void RunCmdProgram(CmdProgram *prog)
+{
+  static int depth = 0;
+
+  if (depth >= 4) return;
+  depth++;
+  for (int i = 0; i < prog->num; i++) RunCmdOp(prog, i);
+  depth--;
+}
+
+// Returns the binary mode command ID of the named command
+void GetCommandID(char *name)
+{
+  int i;
+
+  if ((i = FindCommand(name)) == -1) BADARG;
+  SendACKonly;
+  if (!SerialMute) serial->println(i);
 }
 
 void RB_Init(Ring_Buffer *rb)
@@ -613,6 +1382,107 @@ char RB_Get(Ring_Buffer *rb)
   return (ch);
 }
 
+// Returns the length of the next line in the ring buffer including its terminator, 0 if
+// there is no complete line. Lines end with ; or a new line, long lines only end with a
+// new line.
+int RB_LineLength(Ring_Buffer *rb, bool longLine)
+{
+  int  i, j;
+  char ch;
+
+  for (i = 0, j = rb->Head; i < rb->Count; i++)
+  {
+    ch = rb->Buffer[j];
+    if (++j >= RB_BUF_SIZE) j = 0;
+    if ((ch == '\n') || (ch == '\r')) return (i + 1);
+    if ((ch == ';') && !longLine) return (i + 1);
+  }
+  return (0);
+}
+
+// Returns the length of the ASCII line at the head of the ring buffer, 0 if the head is
+// not printable text and -1 if the line is not complete
+int RB_TextLength(Ring_Buffer *rb)
+{
+  int  i, j;
+  char ch;
+
+  for (i = 0, j = rb->Head; i < rb->Count; i++)
+  {
+    ch = rb->Buffer[j];
+    if (++j >= RB_BUF_SIZE) j = 0;
+    if ((ch == ';') || (ch == '\n') || (ch == '\r')) return (i + 1);
+    if (!isprint(ch)) return (0);
+  }
+  return (-1);
+}
+
+// Copies len characters from the head of the ring buffer to line without removing them,
+// the data is one or two contiguous blocks depending on wrap. The copy is limited to
+// size - 1 characters and null terminated. Returns the number of characters copied.
+int RB_PeekLine(Ring_Buffer *rb, char *line, int size, int len)
+{
+  int first;
+
+  if (len > rb->Count) len = rb->Count;
+  if (len > size - 1) len = size - 1;
+  first = RB_BUF_SIZE - rb->Head;
+  if (first > len) first = len;
+  memcpy(line, &rb->Buffer[rb->Head], first);
+  memcpy(&line[first], rb->Buffer, len - first);
+  line[len] = 0;
+  return (len);
+}
+
+// Removes len characters from the ring buffer
+void RB_Skip(Ring_Buffer *rb, int len)
+{
+  char ch;
+
+  if (len > rb->Count) len = rb->Count;
+  rb->Count -= len;
+  while (len-- > 0)
+  {
+    ch = rb->Buffer[rb->Head];
+    if (++rb->Head >= RB_BUF_SIZE) rb->Head = 0;
+    if ((ch == ';') || (ch == '\n') || (ch == '\r')) rb->Commands--;
+  }
+  if ((rb->Commands < 0) || (rb->Count == 0)) rb->Commands = 0;
+}
+
+// Returns the character at offset from the head of the ring buffer, \r is returned as \n
+char RB_Peek(Ring_Buffer *rb, int offset)
+{
+  char ch;
+
+  if (offset >= rb->Count) return (0xFF);
+  ch = rb->Buffer[(rb->Head + offset) % RB_BUF_SIZE];
+  if (ch == '\r') ch = '\n';
+  return (ch);
+}
+
+// Moves all the characters available from stream into the ring buffer, stops when the
+// ring buffer is full. Data is read in blocks, one or two depending on wrap.
+void RB_Read(Ring_Buffer *rb, Stream *stream)
+{
+  int  n, len, i;
+
+  while ((n = stream->available()) > 0)
+  {
+    if (n > RB_BUF_SIZE - rb->Count) n = RB_BUF_SIZE - rb->Count;
+    if (n > RB_BUF_SIZE - rb->Tail) n = RB_BUF_SIZE - rb->Tail;
+    if (n <= 0) return;
+    len = stream->readBytes(&rb->Buffer[rb->Tail], n);
+    if (len <= 0) return;
+    for (i = rb->Tail; i < rb->Tail + len; i++)
+    {
+      if ((rb->Buffer[i] == ';') || (rb->Buffer[i] == '\r') || (rb->Buffer[i] == '\n')) rb->Commands++;
+    }
+    rb->Count += len;
+    if ((rb->Tail += len) >= RB_BUF_SIZE) rb->Tail = 0;
+  }
+}
+
 // Return the next character in the ring buffer but do not remove it, return NULL if empty.
 char RB_Next(Ring_Buffer *rb)
 {
@@ -626,12 +1496,12 @@ char RB_Next(Ring_Buffer *rb)
 
 void PutCh(char ch)
 {
-  RB_Put(&RB, ch);
+  RB_Put(&cmdPort->rb, ch);
 }
 
 void PushCh(char ch)
 {
-  RB_Push(&RB, ch);
+  RB_Push(&cmdPort->rb, ch);
 }
 
 // This function lists all the current threads and there current state.
@@ -51,47 +51,244 @@ enum CmdTypes
   CMDbool,          // Sends or receives a bool, TRUE or FALSE
   CMDfunction,      // Calls a function with 0,1,or 2 int args
   CMDfunctionStr,   // Calls a function with pointer to str arg
-  CMDfunctionLine,  // Calls a function with a full line in the ring buffer, function must get tokens
+  CMDfunctionLine,  // Calls a function with the command line, function gets tokens with TokenFromCommandLine
   CMDfun2int1flt,   // Calls a function with 2 int args followed by 1 float arg
   CMDlongStr,       // Fills the pointer the a long string, max length is defined by num args value
+  CMDfunctionLongStr, // Calls a function with the rest of the line as a long string arg
   CMDna
 };
 
-enum PCstates
-{
-  PCcmd,      // Looking for a command token
-  PCarg1,     // Looking for int arg1
-  PCarg2,     // Looking for int arg2
-  PCarg3,     // Looking for int arg3
-  PCargStr,   // Looking for string arg
-  PCargLine,  // Looking for fill line, no pasring, sent as string arg 
-  PCend,
-  PCna
-};
+// Command table entries are checked at compile time, each pointer type has its own
+// constructor and the command type and number of arguments must match the pointer.
+// A mismatch makes the constexpr command table fail to compile, CmdTypeMismatch is
+// not constexpr and is never defined so it can not be called in a constant expression.
+bool CmdTypeMismatch(void);
+constexpr bool CmdCheck(bool ok) { return ok ? true : CmdTypeMismatch(); }
 
 union functions
 {
-  char  *charPtr;
-  int   *intPtr;
-  float *floatPtr;
-  bool  *boolPtr;
-  void  (*funcVoid)();
-  void  (*func1int)(int);
-  void  (*func2int)(int, int);
-  void  (*func1str)(char *);
-  void  (*func2str)(char *, char *);
-  void  (*func2int1flt)(int, int, float);
+  char     *charPtr;
+  int      *intPtr;
+  uint32_t *uintPtr;
+  float    *floatPtr;
+  bool     *boolPtr;
+  void     (*funcVoid)();
+  void     (*func1int)(int);
+  void     (*func2int)(int, int);
+  void     (*func1str)(char *);
+  void     (*func2str)(char *, char *);
+  void     (*func2int1flt)(int, int, float);
+
+  constexpr functions() : charPtr(0) {}
+  constexpr functions(char *p) : charPtr(p) {}
+  constexpr functions(int *p) : intPtr(p) {}
+  constexpr functions(uint32_t *p) : uintPtr(p) {}
+  constexpr functions(float *p) : floatPtr(p) {}
+  constexpr functions(bool *p) : boolPtr(p) {}
+  constexpr functions(void (*f)()) : funcVoid(f) {}
+  constexpr functions(void (*f)(int)) : func1int(f) {}
+  constexpr functions(void (*f)(int, int)) : func2int(f) {}
+  constexpr functions(void (*f)(char *)) : func1str(f) {}
+  constexpr functions(void (*f)(char *, char *)) : func2str(f) {}
+  constexpr functions(void (*f)(int, int, float)) : func2int1flt(f) {}
 };
 
-typedef struct
+typedef struct Commands
 {
   const char      *Cmd;
   enum  CmdTypes  Type;
   int             NumArgs;
   union functions pointers;
+
+  // End of table marker
+  constexpr Commands() : Cmd(0), Type(CMDna), NumArgs(0), pointers() {}
+  // Values, get with 0 args and set with 1. Long strings use NumArgs as the max length
+  constexpr Commands(const char *c, CmdTypes t, int n, char *p)
+    : Cmd(c), Type(t), NumArgs(CmdCheck(((t == CMDstr) && (n <= 1)) || (t == CMDlongStr)) ? n : 0), pointers(p) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, int *p)
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDint) && (n <= 1)) ? n : 0), pointers(p) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, uint32_t *p)
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDint) && (n <= 1)) ? n : 0), pointers(p) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, float *p)
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDfloat) && (n <= 1)) ? n : 0), pointers(p) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, bool *p)
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDbool) && (n <= 1)) ? n : 0), pointers(p) {}
+  // Functions
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)())
+    : Cmd(c), Type(t), NumArgs(CmdCheck(((t == CMDfunction) || (t == CMDfunctionStr) || (t == CMDfunctionLine)) && (n == 0)) ? n : 0), pointers(f) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)(int))
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDfunction) && (n == 1)) ? n : 0), pointers(f) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)(int, int))
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDfunction) && (n == 2)) ? n : 0), pointers(f) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)(char *))
+    : Cmd(c), Type(t), NumArgs(CmdCheck(((t == CMDfunctionStr) || (t == CMDfunctionLongStr)) && (n == 1)) ? n : 0), pointers(f) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)(char *, char *))
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDfunctionStr) && (n == 2)) ? n : 0), pointers(f) {}
+  constexpr Commands(const char *c, CmdTypes t, int n, void (*f)(int, int, float))
+    : Cmd(c), Type(t), NumArgs(CmdCheck((t == CMDfun2int1flt) && (n == 3)) ? n : 0), pointers(f) {}
 } Commands;
 
-extern Ring_Buffer  RB;
+// Command lookup table, open addressing hash of the command names built at compile
+// time. Each slot holds the CmdArray index + 1, 0 for an empty slot.
+#define CMD_HASH_SIZE  512
+
+typedef struct
+{
+  uint8_t slot[CMD_HASH_SIZE];
+} CmdIndex;
+
+// FNV-1a hash of a command name
+constexpr uint32_t CmdHash(const char *str)
+{
+  uint32_t h = 2166136261u;
+
+  while(*str) h = (h ^ (uint8_t)*str++) * 16777619u;
+  return h;
+}
+
+// Allocation free parsing, a span is a view of part of a string. Nothing is copied
+// and the string does not need to be null terminated at the end of the span.
+typedef struct
+{
+  const char *str;
+  int        len;
+} Span;
+
+// Output queue size for each port
+#define TX_BUF_SIZE    2048
+
+// Port output queue, responses are queued in order and sent as the port can take them
+// so command processing does not wait on the host. When the queue is full it is sent
+// with blocking writes so a response or frame is never split, characters are only
+// dropped and counted if the port fails. A pending tag is sent in front of the next
+// character written.
+class TxQueue : public Stream
+{
+  public:
+    Stream   *port;
+    uint8_t  buf[TX_BUF_SIZE];
+    int      head;
+    int      count;
+    char     tag[12];               // Request tag for the current command, empty if none
+    uint32_t overflows;             // Characters dropped because the port failed to take the queue
+    size_t   write(uint8_t b);
+    size_t   write(const uint8_t *b, size_t n);
+    int      available(void)  { return 0; }
+    int      read(void)       { return -1; }
+    int      peek(void)       { return -1; }
+    void     send(bool all);
+    using    Print::write;
+};
+
+// Command port, each serial port has its own receive ring buffer, echo state and output
+// queue, responses to a command are sent to the port it came from
+typedef struct
+{
+  Stream       *stream;
+  Ring_Buffer  rb;
+  char         delimiter;           // Echo mode delimiter
+  bool         binary;              // Binary command frame mode
+  bool         tagged;              // Request tag mode, commands can start with #tag
+  bool         overflow;            // A line overflowed the ring buffer, the rest of it is dropped
+  bool         dacGroup;            // DAC writes are grouped until the port's ; separated line ends
+  int          tlmRate;             // Telemetry samples per second, 0 if off
+  uint32_t     tlmNext;             // uS time of the next telemetry sample
+  uint32_t     tlmSeq;              // Telemetry sample number
+  TxQueue      tx;
+} CmdPort;
+
+#define NUM_CMDPORTS  2
+
+// Binary command frames, optional per port and selected with SBIN,TRUE
+//   command:  SOF, LEN, ID, args, CRC
+//   response: SOF, LEN, ID, ACK or NAK, value, CRC
+// LEN is the number of bytes after it not counting the CRC, the CRC is the CRC8 of LEN
+// through the last arg or value byte. ID is the command's CmdArray index, see GCMDID.
+// Each arg or value is a type byte and the data, little endian. A NAK returns the error
+// code as an int.
+#define BIN_SOF     0xA5
+#define BIN_MAX     255
+#define BIN_ARGS    3
+#define BIN_INT     'i'         // int32
+#define BIN_FLOAT   'f'         // float32
+#define BIN_BOOL    'b'         // uint8, 0 or 1
+#define BIN_STR     's'         // null terminated string
+#define BIN_TLM     't'         // TLMsample
+
+// Telemetry streaming, selected per port with STLM,rate. Each sample is sent as a line
+//   TLM,seq,time,TW1 readback,TW2 readback,guard readback,count,status
+// or in binary mode as a frame with ID TLM_ID and a BIN_TLM value. seq counts every
+// sample period, a sample is skipped if the port's output queue is over half full so
+// the stream can not crowd out command responses, the gap in seq shows the loss.
+#define TLM_ID      0xFE
+#define TLM_MAXRATE 1000
+
+enum TLMstatus
+{
+  TLM_STOPPED,
+  TLM_RUNNING,
+  TLM_STEPPING
+};
+
+typedef struct __attribute__((packed))
+{
+  uint32_t  seq;
+  uint32_t  time;                   // uS timestamp
+  float     tw[2];                  // TW1 and TW2 readbacks
+  float     guard;                  // Guard readback
+  uint32_t  count;                  // Pulse counter
+  uint8_t   status;                 // TLMstatus
+} TLMsample;
+
+// Compiled trigger command strings. A command string is compiled once when it is set
+// into a list of ops with the command resolved and the arguments parsed. Conditional
+// arguments, cond|true action|false action, are decoded and command actions are
+// compiled to ops at the end of the list.
+#define CP_MAXOPS   16
+
+enum CondActions
+{
+  CP_NONE,          // No action
+  CP_VALUE,         // Set the value
+  CP_CHANGE,        // Add to the value
+  CP_CMD            // Run a command op
+};
+
+typedef struct
+{
+  uint8_t   type;
+  uint8_t   op;                     // Op index for CP_CMD
+  float     val;
+} CondAction;
+
+typedef struct
+{
+  uint8_t     cmd;                  // CmdArray index
+  char        del;                  // Delimiter after the command, for CMDfunctionLine
+  uint8_t     arg[2];               // String argument offsets in the program text
+  uint8_t     condArg;              // Argument holding the conditional, 0xFF if none
+  char        cond;                 // Conditional, < > = or L for <= and G for >=
+  float       condVal;
+  CondAction  action[2];            // True and false actions
+  int         iarg[2];
+  float       farg;
+} CmdOp;
+
+typedef struct
+{
+  char    text[MAXCMDLEN];          // Null separated argument text
+  CmdOp   ops[CP_MAXOPS];
+  int     num;                      // Number of ops in the string
+  int     last;                     // First action op, action ops are at the end of ops
+} CmdProgram;
+
+extern CmdProgram cmdProgram[2];
+extern const CmdOp *ifOp;
+extern const char  *ifArg;
+extern int  ifAction;
+
+extern CmdPort  CmdPorts[NUM_CMDPORTS];
+extern CmdPort  *cmdPort;           // Port being processed, trigger command strings are pushed here
 extern const char Version[];
 
 // Command function prototypes
@@ -107,13 +304,43 @@ float UserInputFloat(char *message, void (*function)(void) = NULL);
 
 // Function prototypes
 void SerialInit(void);
+int  FindCommand(const char *cmd);
+Span SpanTrim(const char *str);
+Span SpanTrim(Span s);
+Span SpanFrom(Span s, int index);
+bool SpanStartsWith(Span s, const char *prefix);
+bool SpanEquals(Span s, const char *str);
+int  SpanIndexOf(Span s, char ch);
+int  SpanCopy(Span s, char *buf, int size);
+int  SpanToInt(Span s);
+float SpanToFloat(Span s);
 char *GetToken(bool ReturnComma);
-int  ProcessCommand(void);
+char *LineToken(void);
+int  ProcessCommand(CmdPort *port);
+int  ProcessLine(CmdPort *port, Stream *out);
+int  ProcessFrame(CmdPort *port);
+void SetBinaryMode(char *mode);
+void SetTagMode(char *mode);
+void SendAllSerial(bool all = false);
+void SendTelemetry(void);
+void SetTelemetry(int rate);
+void GetTelemetry(void);
+void GetTxOverflows(void);
+void GetCommandID(char *name);
+bool CompileCmdString(CmdProgram *prog, const char *str);
+void RunCmdProgram(CmdProgram *prog);
+bool checkIF(const CmdOp *op, float *change);
 void RB_Init(Ring_Buffer *);
 int  RB_Size(Ring_Buffer *);
 char RB_Put(Ring_Buffer *, char);
 char RB_Get(Ring_Buffer *);
 char RB_Next(Ring_Buffer *);
+char RB_Peek(Ring_Buffer *, int offset);
+int  RB_LineLength(Ring_Buffer *, bool longLine);
+int  RB_TextLength(Ring_Buffer *);
+int  RB_PeekLine(Ring_Buffer *, char *line, int size, int len);
+void RB_Skip(Ring_Buffer *, int len);
+void RB_Read(Ring_Buffer *, Stream *stream);
 int  RB_Commands(Ring_Buffer *);
 void PutCh(char ch);
 void PushCh(char ch);
@@ -0,0 +1,365 @@
+//
+// Table
+//
+// Time table sequencer. A table of timed entries is loaded into RAM with ADDTBL, each
+// entry sets the direction, pattern, open mode or mask, frequency, a DAC setpoint, the
+// alternate TW voltage or TrigOut at a uS time from the start of the pass. The table is
+// started by command or by a trigger input set to TBL and can repeat a number of passes
+// or until stopped.
+//
+// The entries are timed by the table timer, a free running uS counter with a compare
+// interrupt. Each entry's compare time is the pass start plus the entry time, so the
+// timing does not drift over long or repeating tables. The ISR runs every entry that is
+// due. The DAC codes are computed when the table is started or armed so the ISR only
+// queues a prebuilt write on the I2C driver, a write is dropped if the queue is full.
+//
+#include <Arduino.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "Hal.h"
+#include "Hardware.h"
+#include "MFT.h"
+#include "Errors.h"
+#include "Serial.h"
+#include "Events.h"
+#include "Table.h"
+#include "AtomicBlock.h"
+
+Table table;
+
+static const char *const tblNames[TBL_NUM] = {"FWD","PTRN","OPEN","OMSK","FREQ","TWV","GRD","ALT","TRIGOUT"};
+static const char *const tblTrigOut[3]     = {"LOW","HIGH","PULSE"};
+
+// True for the actions that take a channel
+static bool TableChannel(int action)
+{
+  return (action != TBL_FREQ) && (action != TBL_GRD) && (action != TBL_TRIGOUT);
+}
+
+// Runs entry i, called from the table ISR
+static void TableRun(int i)
+{
+  TableEntry *e = &table.entry[i];
+  int        ch = e->chan;
+
+  switch(e->action)
+  {
+    case TBL_FWD:
+      mftdata.Fwd[ch] = (e->value != 0);
+      TWdirection(true);
+      break;
+    case TBL_PTRN:
+      mftdata.bitPattern[ch] = (int)e->value;
+      defineTWvector(ch, mftdata.Fwd[ch], true);
+      break;
+    case TBL_OPEN:
+      mftdata.Open[ch] = (e->value != 0);
+      TWopen();
+      break;
+    case TBL_OMSK:
+      mftdata.openMask[ch] = (int)e->value;
+      TWopen();
+      break;
+    case TBL_FREQ:
+      mftdata.Freq = (int)e->value;
+      updateTWclock();
+      break;
+    case TBL_TWV:
+      mftdata.TWvoltage[ch] = e->value;
+      dacCodes.tw[ch] = e->code;
+      MAX5815load(mftdata.MAX5815add, ch == 0 ? mftdata.TW1ctrl.Chan : mftdata.TW2ctrl.Chan, e->code);
+      break;
+    case TBL_GRD:
+      mftdata.Guard = e->value;
+      dacCodes.guard = e->code;
+      MAX5815load(mftdata.MAX5815add, mftdata.GRDctrl.Chan, e->code);
+      break;
+    case TBL_ALT:
+      setTWaltV(ch, e->value != 0);
+      break;
+    case TBL_TRIGOUT:
+      if(e->value == 2) pulseTrigOut();
+      else halDigitalWrite(TrigOut, e->value != 0);
+      break;
+    default:
+      break;
+  }
+}
+
+// Runs the entries that are due and sets the compare for the next one
+static void TableISR(void)
+{
+  uint32_t t;
+
+  if(!table.running)
+  {
+    halTableTimerStop();
+    return;
+  }
+  while(true)
+  {
+    t = table.base + table.entry[table.index].time;
+    if((int32_t)(halTableTimerNow() - t) < 0)
+    {
+      halTableTimerAt(t);
+      // Done unless the time was reached while the compare was set
+      if((int32_t)(halTableTimerNow() - t) < 0) return;
+    }
+    TableRun(table.index);
+    if(++table.index < table.num) continue;
+    // End of the pass
+    table.index = 0;
+    table.base += table.period;
+    if((table.reps != 0) && (++table.pass >= table.reps))
+    {
+      table.running = false;
+      halTableTimerStop();
+      return;
+    }
+  }
+}
+
+// Starts the table now, called with interrupts off or from an ISR
+static void TableStart(void)
+{
+  table.armed = false;
+  table.index = 0;
+  table.pass = 0;
+  table.base = halTableTimerNow();
+  table.running = true;
+  TableISR();
+}
+
+// Returns true if the table can be started, finds the pass period. Sends the NAK if not.
+static bool TableReady(void)
+{
+  if(table.running || table.armed)
+  {
+    SetErrorCode(ERR_TBLALREADY);
+    SendNAK;
+    return false;
+  }
+  if(table.num == 0)
+  {
+    SetErrorCode(ERR_NOTBLLOADED);
+    SendNAK;
+    return false;
+  }
+  table.period = table.entry[table.num - 1].time;
+  if(table.length > (int)table.period) table.period = table.length;
+  if(table.period < TBL_MINLEN) table.period = TBL_MINLEN;
+  // DAC codes with the current calibration
+  for(int i=0;i<table.num;i++)
+  {
+    TableEntry *e = &table.entry[i];
+    if(e->action == TBL_TWV) e->code = Value2Counts(e->value, e->chan == 0 ? &mftdata.TW1ctrl : &mftdata.TW2ctrl);
+    if(e->action == TBL_GRD) e->code = guardCounts(e->value);
+  }
+  return true;
+}
+
+void TableBegin(void)
+{
+  table.reps = 1;
+  halTableTimerBegin(TableISR);
+}
+
+// Starts an armed table, called by the trigger ISRs
+void TableTrigger(void)
+{
+  if(table.armed) TableStart();
+}
+
+//
+// Host command functions
+//
+
+void clearTable(void)
+{
+  if(table.running || table.armed)
+  {
+    SetErrorCode(ERR_TBLALREADY);
+    SendNAK;
+    return;
+  }
+  table.num = 0;
+  SendACK;
+}
+
+// Called with parameters in the ring buffer, time,action,chan,value. The chan is only
+// entered for the channel actions and the times can not decrease. Values:
+//  FWD,OPEN,ALT  TRUE|FALSE
+//  PTRN,OMSK     binary 8 bits
+//  FREQ,TWV,GRD  value, limited to the user limits
+//  TRIGOUT       LOW|HIGH|PULSE
+void addTable(void)
+{
+  char        *tkn;
+  TableEntry  e;
+  int         ch = 0;
+  int         val;
+  bool        tf;
+  float       fval;
+
+  if(table.running || table.armed)
+  {
+    SetErrorCode(ERR_TBLALREADY);
+    SendNAK;
+    return;
+  }
+  if(table.num >= TBL_MAX)
+  {
+    SetErrorCode(ERR_TBLTOOBIG);
+    SendNAK;
+    return;
+  }
+  while(true)
+  {
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    if(!isdigit(tkn[0])) break;
+    e.time = strtoul(tkn, NULL, 10);
+    if((table.num > 0) && (e.time < table.entry[table.num - 1].time)) break;
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    for(val=0;val<TBL_NUM;val++) if(strcmp(tkn, tblNames[val]) == 0) break;
+    if(val == TBL_NUM) break;
+    e.action = val;
+    if(TableChannel(e.action))
+    {
+      if((tkn = TokenFromCommandLine(',')) == NULL) break;
+      if((ch = checkCH(tkn)) == -1) return;
+    }
+    e.chan = ch;
+    if((tkn = TokenFromCommandLine(',')) == NULL) break;
+    switch(e.action)
+    {
+      case TBL_FWD:
+      case TBL_OPEN:
+      case TBL_ALT:
+        if(!checkTF(tkn, &tf)) return;
+        e.value = tf;
+        break;
+      case TBL_PTRN:
+      case TBL_OMSK:
+        if(!checkPattern(tkn, &val)) return;
+        e.value = val;
+        break;
+      case TBL_FREQ:
+        val = atoi(tkn);
+        if(val > TWmaxFrequency()) val = TWmaxFrequency();
+        if(val < mftdata.minFreq) val = mftdata.minFreq;
+        if(val < 1) val = 1;
+        e.value = val;
+        break;
+      case TBL_TWV:
+        fval = atof(tkn);
+        if(fval > mftdata.maxTWV[ch]) fval = mftdata.maxTWV[ch];
+        if(fval < mftdata.minTWV[ch]) fval = mftdata.minTWV[ch];
+        e.value = fval;
+        break;
+      case TBL_GRD:
+        fval = atof(tkn);
+        if(fval > mftdata.maxGuard) fval = mftdata.maxGuard;
+        if(fval < mftdata.minGuard) fval = mftdata.minGuard;
+        e.value = fval;
+        break;
+      case TBL_TRIGOUT:
+        for(val=0;val<3;val++) if(strcmp(tkn, tblTrigOut[val]) == 0) break;
+        if(val == 3) BADARG;
+        e.value = val;
+        break;
+    }
+    table.entry[table.num++] = e;
+    SendACK;
+    return;
+  }
+  BADARG;
+}
+
+// Returns the table entries separated by ;, each time,action,chan,value
+void getTable(void)
+{
+  TableEntry *e;
+
+  SendACKonly;
+  if(SerialMute) return;
+  for(int i=0;i<table.num;i++)
+  {
+    e = &table.entry[i];
+    if(i > 0) serial->print(";");
+    serial->print(e->time);
+    serial->print(",");
+    serial->print(tblNames[e->action]);
+    serial->print(",");
+    if(TableChannel(e->action))
+    {
+      serial->print(e->chan + 1);
+      serial->print(",");
+    }
+    switch(e->action)
+    {
+      case TBL_FWD:
+      case TBL_OPEN:
+      case TBL_ALT:
+        if(e->value != 0) serial->print("TRUE");
+        else serial->print("FALSE");
+        break;
+      case TBL_PTRN:
+      case TBL_OMSK:
+        serial->print((int)e->value, BIN);
+        break;
+      case TBL_FREQ:
+        serial->print((int)e->value);
+        break;
+      case TBL_TRIGOUT:
+        serial->print(tblTrigOut[(int)e->value]);
+        break;
+      default:
+        serial->print(e->value);
+        break;
+    }
+  }
+  serial->println("");
+}
+
+void startTable(void)
+{
+  if(!TableReady()) return;
+  {
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    TableStart();
+  }
+  SendACK;
+}
+
+// The table starts on the next TBL trigger edge
+void armTable(void)
+{
+  if(!TableReady()) return;
+  table.armed = true;
+  SendACK;
+}
+
+void stopTable(void)
+{
+  if(!table.running && !table.armed)
+  {
+    SetErrorCode(ERR_NOTBLMODE);
+    SendNAK;
+    return;
+  }
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  table.armed = false;
+  table.running = false;
+  halTableTimerStop();
+  SendACK;
+}
+
+void getTableStatus(void)
+{
+  SendACKonly;
+  if(SerialMute) return;
+  if(table.running) serial->println("RUNNING");
+  else if(table.armed) serial->println("ARMED");
+  else serial->println("IDLE");
+}
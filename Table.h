@@ -0,0 +1,61 @@
+#ifndef Table_h
+#define Table_h
+#include <stdint.h>
+
+#define TBL_MAX       128       // Table entries
+#define TBL_MINLEN    10        // Shortest repeating pass in uS
+
+// Table entry actions, all run in the table timer ISR. The DAC writes use the codes
+// computed when the table is started or armed and are queued on the I2C driver.
+enum TableActions
+{
+  TBL_FWD,                      // Direction, value 1 = forward
+  TBL_PTRN,                     // Bit pattern
+  TBL_OPEN,                     // Open mode, value 1 = open
+  TBL_OMSK,                     // Open mask
+  TBL_FREQ,                     // Frequency
+  TBL_TWV,                      // TW voltage
+  TBL_GRD,                      // Guard voltage
+  TBL_ALT,                      // Alternate TW voltage, value 1 = select
+  TBL_TRIGOUT,                  // TrigOut, value 0 = LOW, 1 = HIGH, 2 = PULSE
+  TBL_NUM
+};
+
+typedef struct
+{
+  uint32_t  time;               // uS from the start of the pass
+  uint8_t   action;
+  uint8_t   chan;               // 0 or 1 for the channel actions
+  uint16_t  code;               // DAC code for the TWV and GRD actions
+  float     value;
+} TableEntry;
+
+typedef struct
+{
+  TableEntry      entry[TBL_MAX];
+  int             num;          // Loaded entries
+  int             length;       // uS per pass, the last entry time is used if it is longer
+  int             reps;         // Passes, 0 repeats until stopped
+  volatile bool   armed;        // Waiting for a TBL trigger
+  volatile bool   running;
+  // Used by the table ISR while running
+  int             index;        // Next entry
+  int             pass;
+  uint32_t        base;         // Timer count at the start of the pass
+  uint32_t        period;       // uS per pass
+} Table;
+
+extern Table table;
+
+// Function prototypes
+void TableBegin(void);
+void TableTrigger(void);
+void clearTable(void);
+void addTable(void);
+void getTable(void);
+void startTable(void);
+void armTable(void);
+void stopTable(void);
+void getTableStatus(void);
+
+#endif
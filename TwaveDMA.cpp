@@ -0,0 +1,351 @@
+//
+// TwaveDMA
+//
+// DMA driven Twave playback. A PIT timer paces an eDMA channel that pulses the MAX14802
+// latch, its major loop link then runs the frame channel that writes the next 32 bit
+// step frame to the LPSPI4 transmit register. Each frame table direction variant has a
+// scatter/gather descriptor that loops on itself so the waveform plays with no CPU
+// involvement. When the pattern changes the CPU relinks the running descriptor to the
+// other table and the eDMA swaps tables at the cycle boundary, the same as Timer1ISR.
+//
+// The latch is pulsed at the start of a step and latches the frame shifted out during
+// the previous step, so the chain is primed with the last frame of the cycle.
+//
+#include <Arduino.h>
+#include <string.h>
+#include "Hardware.h"
+#include "MFT.h"
+#include "TwaveDMA.h"
+#include "AtomicBlock.h"
+
+#if defined(__IMXRT1062__)
+#include <DMAChannel.h>
+#include <SPI.h>
+#endif
+
+// eDMA register bit fields, defined here for builds without the imxrt headers
+#ifndef DMA_TCD_CSR_ESG
+#define DMA_TCD_CSR_ESG             0x0010
+#define DMA_TCD_CSR_MAJORELINK      0x0020
+#define DMA_TCD_CSR_MAJORLINKCH(n)  (((n) & 0x1F) << 8)
+#define DMA_TCD_ATTR_SSIZE(n)       (((n) & 0x07) << 8)
+#define DMA_TCD_ATTR_DSIZE(n)       ((n) & 0x07)
+#endif
+
+#define TWDMA_ATTR_32BIT  (DMA_TCD_ATTR_SSIZE(2) | DMA_TCD_ATTR_DSIZE(2))
+
+bool       twDMAmode = false;
+TWdmaChain twDMAchain;
+
+#if defined(__IMXRT1062__)
+// Allocated at startup so they get the low channel numbers, the periodic PIT trigger
+// is only available on DMA channels 0 through 3.
+DMAChannel latchDMA;
+DMAChannel frameDMA;
+IMXRT_PIT_CHANNEL_t *twPIT = NULL;
+uint32_t   savedTCR;
+#endif
+
+// Fills the descriptor chain for the frame tables in tw. tdr is the SPI transmit data
+// register, toggle is the GPIO toggle register for the latch pin selected by mask and
+// frameCH is the DMA channel the frame descriptors are loaded into.
+void TWdmaBuildChain(TWdmaChain *chain, TWengine *tw, volatile void *tdr, volatile void *toggle, uint32_t mask, int frameCH)
+{
+  memset(chain, 0, sizeof(TWdmaChain));
+  chain->latchMask[0] = chain->latchMask[1] = mask;
+  // Latch, two writes to the toggle register per step
+  chain->latch.SADDR    = chain->latchMask;
+  chain->latch.SOFF     = 4;
+  chain->latch.ATTR     = TWDMA_ATTR_32BIT;
+  chain->latch.NBYTES   = 8;
+  chain->latch.SLAST    = -8;
+  chain->latch.DADDR    = toggle;
+  chain->latch.DOFF     = 0;
+  chain->latch.CITER    = chain->latch.BITER = 1;
+  chain->latch.CSR      = DMA_TCD_CSR_MAJORELINK | DMA_TCD_CSR_MAJORLINKCH(frameCH);
+  // Frames, one 32 bit frame per step, one cycle per major loop
+  for(int k=0;k<2;k++)
+  {
+    for(int v=0;v<TW_DIRS;v++)
+    {
+      TWdmaTCD *f = &chain->frames[k][v];
+
+      f->SADDR    = tw->frames[k][v];
+      f->SOFF     = 4;
+      f->ATTR     = TWDMA_ATTR_32BIT;
+      f->NBYTES   = 4;
+      f->SLAST    = 0;
+      f->DADDR    = tdr;
+      f->DOFF     = 0;
+      f->CITER    = f->BITER = tw->len[k];
+      f->DLASTSGA = (intptr_t)f;
+      f->CSR      = DMA_TCD_CSR_ESG;
+    }
+  }
+}
+
+#if defined(__IMXRT1062__)
+
+// Returns the frame table and direction variant the frame channel is reading from, as
+// table * TW_DIRS + variant
+static int TWdmaPlaying(volatile const void *saddr)
+{
+  const uint32_t *sa = (const uint32_t *)saddr;
+
+  return (sa - &twEngine.frames[0][0][0]) / TW_MAXFRAMES;
+}
+
+// Sets up the DMA playback chain, the waveform is held until TWdmaRun is called.
+// Returns false if the DMA channel or its PIT timer is not avaliable.
+bool TWdmaBegin(float period_uS)
+{
+  uint32_t frame;
+
+  if(latchDMA.channel > 3) return false;
+  CCM_CCGR1 |= CCM_CCGR1_PIT(CCM_CCGR_ON);
+  PIT_MCR = 1;
+  twPIT = IMXRT_PIT_CHANNELS + latchDMA.channel;
+  if(twPIT->TCTRL != 0) return false;
+  // Take any pending table now, the waveform is stopped at this point
+  if(twEngine.pending)
+  {
+    twEngine.active ^= 1;
+    twEngine.pending = false;
+  }
+  // Shift out the last frame of the cycle, the first latch pulse outputs it
+  twEngine.dir = twEngine.dirNext;
+  frame = twEngine.frames[twEngine.active][twEngine.dir][twEngine.len[twEngine.active] - 1] & twEngine.open;
+  MAX14802(frame >> 16, frame & 0xFFFF, false);
+  TWindx = 0;
+  // 32 bit frames on the LPSPI and ignore the receive data
+  savedTCR = LPSPI4_TCR;
+  LPSPI4_TCR = (savedTCR & ~LPSPI_TCR_FRAMESZ(4095)) | LPSPI_TCR_FRAMESZ(31) | LPSPI_TCR_RXMSK;
+  // Move the latch pin to GPIO2, the eDMA can not reach the fast GPIO ports
+  GPIO2_GDIR |= CORE_PIN10_BITMASK;
+  GPIO2_DR_SET = CORE_PIN10_BITMASK;
+  IOMUXC_GPR_GPR27 &= ~CORE_PIN10_BITMASK;
+  // Load the descriptors
+  TWdmaBuildChain(&twDMAchain, &twEngine, &LPSPI4_TDR, &GPIO2_DR_TOGGLE, CORE_PIN10_BITMASK, frameDMA.channel);
+  memcpy((void *)latchDMA.TCD, &twDMAchain.latch, sizeof(TWdmaTCD));
+  memcpy((void *)frameDMA.TCD, &twDMAchain.frames[twEngine.active][twEngine.dir], sizeof(TWdmaTCD));
+  volatile uint32_t *mux = &DMAMUX_CHCFG0 + latchDMA.channel;
+  *mux = 0;
+  *mux = DMAMUX_CHCFG_ENBL | DMAMUX_CHCFG_TRIG | DMAMUX_CHCFG_A_ON;
+  // The PIT runs with no interrupt, it only paces the latch channel
+  twPIT->TCTRL = 0;
+  twPIT->LDVAL = (uint32_t)(period_uS * 24 + 0.5) - 1;
+  twPIT->TCTRL = PIT_TCTRL_TEN;
+  twDMAmode = true;
+  return true;
+}
+
+// Stops DMA playback and returns the SPI and latch pin to the Timer1ISR path
+void TWdmaEnd(void)
+{
+  int p;
+
+  if(!twDMAmode) return;
+  latchDMA.disable();
+  twPIT->TCTRL = 0;
+  volatile uint32_t *mux = &DMAMUX_CHCFG0 + latchDMA.channel;
+  *mux = 0;
+  frameDMA.disable();
+  // Wait for the last frame to shift out
+  while((LPSPI4_FSR & 0x1F) != 0);
+  while((LPSPI4_SR & LPSPI_SR_MBF) != 0);
+  LPSPI4_TCR = savedTCR;
+  GPIO7_DR_SET = CORE_PIN10_BITMASK;
+  IOMUXC_GPR_GPR27 |= CORE_PIN10_BITMASK;
+  // If the eDMA already moved to the new table there is nothing pending for the ISR
+  p = TWdmaPlaying(frameDMA.TCD->SADDR);
+  twEngine.dir = p % TW_DIRS;
+  p /= TW_DIRS;
+  if(p != twEngine.active)
+  {
+    twEngine.active = p;
+    twEngine.pending = false;
+  }
+  twDMAmode = false;
+}
+
+// Starts or holds the waveform, the PIT keeps running so its channel stays reserved
+void TWdmaRun(bool run)
+{
+  if(!twDMAmode) return;
+  if(run) latchDMA.enable();
+  else latchDMA.disable();
+}
+
+// The new period is loaded at the end of the current step, no glitch
+void TWdmaSetPeriod(float period_uS)
+{
+  if(!twDMAmode) return;
+  twPIT->LDVAL = (uint32_t)(period_uS * 24 + 0.5) - 1;
+}
+
+// Relinks the frame channel to table, if now is true the table is switched at the next
+// step by moving the live source address, else the eDMA switches at the cycle boundary.
+// Only a table with the same cycle length can be switched now.
+void TWdmaLink(int table, bool now)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  int  p;
+
+  if(!twDMAmode) return;
+  for(int v=0;v<TW_DIRS;v++) twDMAchain.frames[table][v].CITER = twDMAchain.frames[table][v].BITER = twEngine.len[table];
+  if(now)
+  {
+    p = TWdmaPlaying(frameDMA.TCD->SADDR);
+    frameDMA.TCD->SADDR = (const uint8_t *)frameDMA.TCD->SADDR + ((const uint8_t *)twEngine.frames[table][twEngine.dirNext] - (const uint8_t *)twEngine.frames[p / TW_DIRS][p % TW_DIRS]);
+  }
+  frameDMA.TCD->DLASTSGA = (int32_t)&twDMAchain.frames[table][twEngine.dirNext];
+}
+
+// Moves the frame channel to the twEngine.dirNext variant of the tables it plays and is
+// linked to. If now is true the variant is switched at the next step, else at the cycle
+// boundary.
+void TWdmaDirection(bool now)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  int  p,l;
+
+  if(!twDMAmode) return;
+  if(now)
+  {
+    p = TWdmaPlaying(frameDMA.TCD->SADDR);
+    frameDMA.TCD->SADDR = (const uint8_t *)frameDMA.TCD->SADDR + ((const uint8_t *)twEngine.frames[p / TW_DIRS][twEngine.dirNext] - (const uint8_t *)twEngine.frames[p / TW_DIRS][p % TW_DIRS]);
+  }
+  l = ((TWdmaTCD *)frameDMA.TCD->DLASTSGA - &twDMAchain.frames[0][0]) / TW_DIRS;
+  frameDMA.TCD->DLASTSGA = (int32_t)&twDMAchain.frames[l][twEngine.dirNext];
+}
+
+// Cancels any pending table switch and returns the table being played. This is safe
+// to call while the eDMA runs, if it switched while we relinked the link is redone.
+int TWdmaHold(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+  int p,p2;
+
+  if(!twDMAmode) return twEngine.active;
+  p = TWdmaPlaying(frameDMA.TCD->SADDR) / TW_DIRS;
+  TWdmaLink(p, false);
+  p2 = TWdmaPlaying(frameDMA.TCD->SADDR) / TW_DIRS;
+  if(p2 != p) TWdmaLink(p2, false);
+  return p2;
+}
+
+#else
+
+bool TWdmaBegin(float period_uS) { return false; }
+void TWdmaEnd(void) {}
+void TWdmaRun(bool run) {}
+void TWdmaSetPeriod(float period_uS) {}
+int  TWdmaHold(void) { return twEngine.active; }
+void TWdmaLink(int table, bool now) {}
+void TWdmaDirection(bool now) {}
+
+#endif
+
+// Returns the step period the PIT can make closest to period_uS, the PIT counts at 24MHz
+float TWdmaPeriod(float period_uS)
+{
+  return (uint32_t)(period_uS * 24 + 0.5) / 24.0;
+}
+
+// Software model of the eDMA chain driving the MAX14802, used to check the descriptors
+// produce the same step sequence as Timer1ISR.
+typedef struct
+{
+  TWdmaTCD  latch;                      // Live latch channel descriptor
+  TWdmaTCD  frame;                      // Live frame channel descriptor
+  uint32_t  tdr;                        // SPI transmit data register
+  uint32_t  toggle;                     // GPIO toggle register
+  bool      level;                      // Latch pin level
+  uint32_t  shift;                      // MAX14802 shift register
+  uint32_t  outputs;                    // MAX14802 latched switch states
+} TWdmaModel;
+
+static void TWdmaModelWrite(TWdmaModel *m, volatile void *addr, uint32_t val)
+{
+  if(addr == &m->tdr) m->shift = val;
+  else if(addr == &m->toggle)
+  {
+    m->level = !m->level;
+    // Data moves to the outputs on the latch rising edge
+    if(m->level) m->outputs = m->shift;
+  }
+}
+
+// Runs one minor loop, returns true at major loop completion
+static bool TWdmaMinorLoop(TWdmaModel *m, TWdmaTCD *tcd)
+{
+  for(uint32_t n=0;n<tcd->NBYTES;n+=4)
+  {
+    TWdmaModelWrite(m, tcd->DADDR, *(volatile const uint32_t *)tcd->SADDR);
+    tcd->SADDR = (volatile const uint8_t *)tcd->SADDR + tcd->SOFF;
+    tcd->DADDR = (volatile uint8_t *)tcd->DADDR + tcd->DOFF;
+  }
+  if(--tcd->CITER != 0) return false;
+  if((tcd->CSR & DMA_TCD_CSR_ESG) != 0)
+  {
+    *tcd = *(TWdmaTCD *)tcd->DLASTSGA;
+    return true;
+  }
+  tcd->SADDR = (volatile const uint8_t *)tcd->SADDR + tcd->SLAST;
+  tcd->DADDR = (volatile uint8_t *)tcd->DADDR + tcd->DLASTSGA;
+  tcd->CITER = tcd->BITER;
+  return true;
+}
+
+// Runs the descriptor chain against the current frame tables and the Timer1ISR step
+// model, including a direction switch and a table switch mid cycle. Returns true if
+// every step matches.
+bool TWdmaVerify(void)
+{
+  static TWengine   tw,ref;
+  static TWdmaChain chain;
+  static TWdmaModel m;
+  int               len = twEngine.len[twEngine.active];
+  volatile int      indx = len - 1;
+  int               next,d,rv;
+
+  tw = twEngine;
+  tw.pending = false;
+  tw.dir = tw.dirNext;
+  tw.open = 0xFFFFFFFF;
+  next = tw.active ^ 1;
+  d = tw.dir;
+  rv = d ^ TW_REV1;
+  // Make sure the second table and the other direction differ from the first
+  for(int i=0;i<len;i++)
+  {
+    tw.frames[tw.active][rv][i] = tw.frames[tw.active][d][i] ^ 0xFFFF;
+    for(int v=0;v<TW_DIRS;v++) tw.frames[next][v][i] = ~tw.frames[tw.active][v][(i + 3) % len];
+  }
+  tw.len[next] = len;
+  ref = tw;
+  memset(&m, 0, sizeof(TWdmaModel));
+  TWdmaBuildChain(&chain, &tw, &m.tdr, &m.toggle, 1, 1);
+  m.latch = chain.latch;
+  m.frame = chain.frames[tw.active][d];
+  m.level = true;
+  m.shift = tw.frames[tw.active][d][len - 1];
+  for(int t=0;t<2*len+48;t++)
+  {
+    if(t == 13)
+    {
+      m.frame.SADDR = (const uint8_t *)m.frame.SADDR + ((const uint8_t *)tw.frames[tw.active][rv] - (const uint8_t *)tw.frames[tw.active][d]);
+      m.frame.DLASTSGA = (intptr_t)&chain.frames[tw.active][rv];
+    }
+    if(t == 21)
+    {
+      m.frame.DLASTSGA = (intptr_t)&chain.frames[next][rv];
+      ref.pending = true;
+    }
+    if(TWdmaMinorLoop(&m, &m.latch) && ((m.latch.CSR & DMA_TCD_CSR_MAJORELINK) != 0)) TWdmaMinorLoop(&m, &m.frame);
+    if(m.outputs != TWstep(&ref, &indx)) return false;
+    // The frame for the next step is already shifted out, so the move shows a step later
+    if(t == 13) ref.dir = ref.dirNext = rv;
+  }
+  return true;
+}
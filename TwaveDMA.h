@@ -0,0 +1,46 @@
+#ifndef TwaveDMA_h
+#define TwaveDMA_h
+#include <stdint.h>
+#include "MFT.h"
+
+// eDMA transfer control descriptor image. This has the same layout as the i.MX RT
+// TCD so the scatter/gather engine can load it directly from RAM.
+typedef struct __attribute__((aligned(32)))
+{
+  volatile const void *SADDR;           // Source address
+  int16_t             SOFF;             // Source offset after each transfer
+  uint16_t            ATTR;             // Transfer size attributes
+  uint32_t            NBYTES;           // Bytes transfered per minor loop
+  int32_t             SLAST;            // Source adjustment at major loop completion
+  volatile void       *DADDR;           // Destination address
+  int16_t             DOFF;             // Destination offset after each transfer
+  uint16_t            CITER;            // Current major loop count
+  intptr_t            DLASTSGA;         // Next descriptor when ESG is set
+  uint16_t            CSR;              // Control and status
+  uint16_t            BITER;            // Major loop count reload value
+} TWdmaTCD;
+
+// Descriptor chain used for Twave playback. The latch descriptor runs once per step
+// and its major loop link runs one minor loop of the frame descriptor.
+typedef struct
+{
+  TWdmaTCD  frames[2][TW_DIRS];         // One descriptor per frame table variant, each loops on itself
+  TWdmaTCD  latch;                      // Latch pulse descriptor
+  uint32_t  latchMask[2];               // Toggle words, pulse the latch low then high
+} TWdmaChain;
+
+extern bool twDMAmode;
+
+// Function prototypes
+void TWdmaBuildChain(TWdmaChain *chain, TWengine *tw, volatile void *tdr, volatile void *toggle, uint32_t mask, int frameCH);
+bool TWdmaBegin(float period_uS);
+void TWdmaEnd(void);
+void TWdmaRun(bool run);
+void TWdmaSetPeriod(float period_uS);
+float TWdmaPeriod(float period_uS);
+int  TWdmaHold(void);
+void TWdmaLink(int table, bool now);
+void TWdmaDirection(bool now);
+bool TWdmaVerify(void);
+
+#endif
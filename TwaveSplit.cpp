@@ -0,0 +1,176 @@
+//
+// TwaveSplit
+//
+// Independent TW1 and TW2 step clocks. The channels index the frame tables on their
+// own, the low 16 bits of a frame for TW1 and the high 16 bits for TW2, and each has
+// its own period and phase accumulator. GPT1 runs free and its compare is set to the
+// earliest next step. Channels that step within TW_SPLITMERGE ticks of each other are
+// written in the same MAX14802 transaction, so there is one SPI write per tick whether
+// one or both channels step. The merge moves a step early, so the window is also kept
+// under 1/16 of the shorter step period.
+//
+// A channel moves to a new frame table at its own cycle boundary, a table with the
+// same channel length can be switched on the next step.
+//
+#include <Arduino.h>
+#include "Hardware.h"
+#include "MFT.h"
+#include "TwaveSplit.h"
+#include "AtomicBlock.h"
+
+bool    twSplitMode = false;
+TWsplit twSplit;
+
+// Advances a channel one step, at its cycle boundary the channel takes the newest table
+// and direction
+static inline void TWsplitStep(int ch)
+{
+  int      i = twSplit.indx[ch];
+  uint32_t frame;
+
+  if(i == 0)
+  {
+    twSplit.table[ch] = twEngine.active;
+    twSplit.dir[ch] = twEngine.dirNext & (TW_REV1 << ch);
+  }
+  frame = twEngine.frames[twSplit.table[ch]][twSplit.dir[ch]][i] & twEngine.open;
+  twSplit.word[ch] = ch ? frame >> 16 : frame & 0xFFFF;
+  if(++i >= twEngine.chLen[twSplit.table[ch]][ch]) i = 0;
+  twSplit.indx[ch] = i;
+  twSplit.next[ch] += twSplit.period[ch];
+}
+
+// Runs the steps that are due and sets the compare for the next one
+static void TWsplitISR(void)
+{
+  uint64_t t;
+  uint32_t at;
+
+  if(!twSplit.running)
+  {
+    halSplitTimerStop();
+    return;
+  }
+  while(true)
+  {
+    t = twSplit.next[0] < twSplit.next[1] ? twSplit.next[0] : twSplit.next[1];
+    at = t >> 32;
+    if((int32_t)(halSplitTimerNow() - at) < 0)
+    {
+      halSplitTimerAt(at);
+      // Done unless the time was reached while the compare was set
+      if((int32_t)(halSplitTimerNow() - at) < 0) return;
+    }
+    for(int ch=0;ch<2;ch++) if(twSplit.next[ch] - t <= twSplit.merge) TWsplitStep(ch);
+    MAX14802(twSplit.word[1], twSplit.word[0]);
+  }
+}
+
+// Selects split playback, the caller stops the step timer first. Any pending table is
+// taken now and both channels start from their first frame when TWsplitRun is called.
+void TWsplitBegin(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  halSplitTimerBegin(TWsplitISR);
+  if(twEngine.pending)
+  {
+    twEngine.active ^= 1;
+    twEngine.pending = false;
+  }
+  for(int ch=0;ch<2;ch++)
+  {
+    twSplit.indx[ch] = 0;
+    twSplit.table[ch] = twEngine.active;
+    twSplit.dir[ch] = twEngine.dirNext & (TW_REV1 << ch);
+  }
+  twSplit.running = false;
+  twSplitMode = true;
+}
+
+// Stops split playback, Timer1ISR starts again from the first frame of twEngine.active
+void TWsplitEnd(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  if(!twSplitMode) return;
+  twSplit.running = false;
+  halSplitTimerStop();
+  TWindx = 0;
+  twSplitMode = false;
+}
+
+// Starts or holds the waveform, a start steps both channels together
+void TWsplitRun(bool run)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  if(!twSplitMode) return;
+  if(run == twSplit.running) return;
+  twSplit.running = run;
+  if(!run)
+  {
+    halSplitTimerStop();
+    return;
+  }
+  twSplit.next[0] = twSplit.next[1] = (uint64_t)(halSplitTimerNow() + TW_SPLITMERGE) << 32;
+  TWsplitISR();
+}
+
+// Sets a channel's step period for freq, the step already scheduled keeps its time
+void TWsplitSetFreq(int ch, int freq)
+{
+  uint64_t steps = (uint64_t)freq * 8 * twOS;
+  uint64_t p = (((uint64_t)HAL_SPLIT_CLOCK << 32) + steps / 2) / steps;
+  uint64_t m;
+
+  {
+    AtomicBlock< Atomic_RestoreState > a_Block;
+    twSplit.period[ch] = p;
+    m = twSplit.period[0] < twSplit.period[1] ? twSplit.period[0] : twSplit.period[1];
+    twSplit.merge = (uint64_t)TW_SPLITMERGE << 32;
+    if(twSplit.merge > m / 16) twSplit.merge = m / 16;
+  }
+  twSplit.afreq[ch] = (double)HAL_SPLIT_CLOCK * 4294967296.0 / ((double)p * 8 * twOS);
+}
+
+// Moves a channel still playing the old table to the newest one so the old table can be
+// rebuilt, and returns the newest table
+int TWsplitHold(void)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  if(!twSplitMode) return twEngine.active;
+  for(int ch=0;ch<2;ch++)
+  {
+    if(twSplit.table[ch] == twEngine.active) continue;
+    twSplit.table[ch] = twEngine.active;
+    if(twSplit.indx[ch] >= twEngine.chLen[twEngine.active][ch]) twSplit.indx[ch] = 0;
+  }
+  return twEngine.active;
+}
+
+// Makes table the newest, the channels take it at their cycle boundary. If now is true
+// a channel with the same length in both tables takes it on its next step.
+void TWsplitLink(int table, bool now)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  if(!twSplitMode) return;
+  twEngine.active = table;
+  if(!now) return;
+  for(int ch=0;ch<2;ch++)
+  {
+    if(twEngine.chLen[table][ch] == twEngine.chLen[table ^ 1][ch]) twSplit.table[ch] = table;
+  }
+}
+
+// Moves the channels to the twEngine.dirNext direction, if now is true on their next
+// step, else at their cycle boundary
+void TWsplitDirection(bool now)
+{
+  AtomicBlock< Atomic_RestoreState > a_Block;
+
+  if(!twSplitMode || !now) return;
+  for(int ch=0;ch<2;ch++) twSplit.dir[ch] = twEngine.dirNext & (TW_REV1 << ch);
+}
@@ -0,0 +1,38 @@
+#ifndef TwaveSplit_h
+#define TwaveSplit_h
+#include <stdint.h>
+#include "MFT.h"
+
+#define TW_SPLITMERGE   8               // Split timer ticks, 333nS, steps this close share one SPI write
+
+// Independent step clocks. Each channel has its own step period and the time of its
+// next step, 32.32 fixed point split timer ticks, so the average rate of each channel
+// is exact. The ISR runs at the earliest step and writes one frame for all the channels
+// that are due.
+typedef struct
+{
+  uint64_t          period[2];          // Step period of each channel
+  uint64_t          next[2];            // Time of each channel's next step
+  uint64_t          merge;              // Steps this close to the earliest are written with it
+  volatile int      indx[2];            // Frame index of each channel
+  volatile uint8_t  table[2];           // Frame table each channel plays
+  volatile uint8_t  dir[2];             // Direction variant each channel plays, its own bit
+  uint16_t          word[2];            // MAX14802 word of each channel
+  volatile bool     running;
+  int               freq2;              // TW2 frequency, TW1 uses mftdata.Freq
+  float             afreq[2];           // Actual frequency of each channel
+} TWsplit;
+
+extern bool    twSplitMode;
+extern TWsplit twSplit;
+
+// Function prototypes
+void TWsplitBegin(void);
+void TWsplitEnd(void);
+void TWsplitRun(bool run);
+void TWsplitSetFreq(int ch, int freq);
+int  TWsplitHold(void);
+void TWsplitLink(int table, bool now);
+void TWsplitDirection(bool now);
+
+#endif
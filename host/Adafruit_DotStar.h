@@ -0,0 +1 @@
+// Adafruit_DotStar.h shim for the host build, the MFT has no DotStar LEDs
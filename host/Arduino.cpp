@@ -0,0 +1,99 @@
+//
+// Arduino core shim for the host build, see Arduino.h. Time comes from the HAL mock's
+// virtual clock so the threads and timeouts follow the simulated time.
+//
+#include <Arduino.h>
+#include <ThreadController.h>
+#include "Hal.h"
+
+HostSerial Serial;
+HostSerial Serial1;
+
+unsigned long millis(void) { return halMicros() / 1000; }
+unsigned long micros(void) { return halMicros(); }
+
+size_t Print::write(const uint8_t *buf, size_t n)
+{
+  size_t i;
+
+  for(i=0;i<n;i++) if(write(buf[i]) == 0) break;
+  return i;
+}
+
+size_t Print::print(long n, int base)
+{
+  if(n < 0)
+  {
+    size_t len = print('-');
+    return len + print((unsigned long)-n, base);
+  }
+  return print((unsigned long)n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+  char buf[8 * sizeof(long) + 1];
+  char *p = &buf[sizeof(buf) - 1];
+
+  if(base < 2) base = DEC;
+  *p = 0;
+  do
+  {
+    int d = n % base;
+    *--p = d < 10 ? '0' + d : 'A' + d - 10;
+    n /= base;
+  } while(n != 0);
+  return write(p);
+}
+
+size_t Print::print(double n, int digits)
+{
+  char buf[40];
+
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t Stream::readBytes(char *buf, size_t n)
+{
+  size_t i = 0;
+  int    c;
+
+  while((i < n) && ((c = read()) >= 0)) buf[i++] = c;
+  return i;
+}
+
+bool ThreadController::add(Thread *t)
+{
+  for(int i=0;i<MAX_THREADS;i++)
+  {
+    if(thread[i] == t) return true;
+    if(thread[i] != NULL) continue;
+    thread[i] = t;
+    return true;
+  }
+  return false;
+}
+
+void ThreadController::run(void)
+{
+  unsigned long now = millis();
+
+  for(int i=0;i<MAX_THREADS;i++) if((thread[i] != NULL) && thread[i]->shouldRun(now)) thread[i]->run();
+}
+
+Thread *ThreadController::get(int index)
+{
+  for(int i=0;i<MAX_THREADS;i++)
+  {
+    if(thread[i] == NULL) continue;
+    if(index-- == 0) return thread[i];
+  }
+  return NULL;
+}
+
+Thread *ThreadController::get(char *name)
+{
+  for(int i=0;i<MAX_THREADS;i++) if((thread[i] != NULL) && (strcmp(thread[i]->getName(), name) == 0)) return thread[i];
+  return NULL;
+}
@@ -0,0 +1,95 @@
+#ifndef Arduino_h
+#define Arduino_h
+//
+// Arduino core shim for the host build. Only the parts of the Teensyduino core the
+// firmware uses are here. The peripherals are reached through Hal.h and the mock
+// backends in HalHost.cpp, the serial ports are in memory streams host code can fill
+// and read.
+//
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <string>
+
+typedef uint8_t byte;
+
+#define PROGMEM
+#define F(x)      x
+
+#define HIGH      1
+#define LOW       0
+#define INPUT     0
+#define OUTPUT    1
+#define FALLING   2
+#define RISING    3
+#define CHANGE    4
+
+#define BIN       2
+#define DEC       10
+#define HEX       16
+
+// Teensy 4.0 analog pins used by the MFT
+#define A6        20
+#define A7        21
+#define A8        22
+
+inline bool isDigit(int c) { return isdigit(c) != 0; }
+
+unsigned long millis(void);
+unsigned long micros(void);
+
+class Print
+{
+  public:
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *buf, size_t n);
+    size_t write(const char *str)           { return write((const uint8_t *)str, strlen(str)); }
+    virtual int availableForWrite(void)     { return 0; }
+    virtual void flush(void)                {}
+    size_t print(const char *str)           { return write(str); }
+    size_t print(char c)                    { return write((uint8_t)c); }
+    size_t print(int n, int base = DEC)     { return print((long)n, base); }
+    size_t print(unsigned n, int base = DEC){ return print((unsigned long)n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+    size_t println(void)                    { return write("\r\n"); }
+    template<typename T> size_t println(T v)            { size_t n = print(v); return n + println(); }
+    template<typename T> size_t println(T v, int fmt)   { size_t n = print(v, fmt); return n + println(); }
+};
+
+class Stream : public Print
+{
+  public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    size_t readBytes(char *buf, size_t n);
+};
+
+// In memory serial port, host code appends to input and takes the output. Setting room
+// to 0 models a host that is not reading.
+class HostSerial : public Stream
+{
+  public:
+    std::string input;
+    std::string output;
+    size_t      pos = 0;
+    int         room = 4096;
+    void   begin(long baud)         {}
+    size_t write(uint8_t b)         { output += (char)b; return 1; }
+    int    availableForWrite(void)  { return room; }
+    int    available(void)          { return input.size() - pos; }
+    int    read(void)               { return pos < input.size() ? (uint8_t)input[pos++] : -1; }
+    int    peek(void)               { return pos < input.size() ? (uint8_t)input[pos] : -1; }
+    using  Print::write;
+};
+
+extern HostSerial Serial;
+extern HostSerial Serial1;
+
+#endif
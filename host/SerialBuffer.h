@@ -0,0 +1,5 @@
+#ifndef SerialBuffer_h
+#define SerialBuffer_h
+// SerialBuffer shim for the host build, the sketch declares one but does not use it
+class SerialBuffer {};
+#endif
@@ -0,0 +1,33 @@
+#ifndef Thread_h
+#define Thread_h
+//
+// Thread shim for the host build, a thread runs its callback every interval mS of
+// the virtual time kept by the HAL mocks.
+//
+#include <Arduino.h>
+
+class Thread
+{
+  public:
+    bool          enabled = true;
+    void          setName(char *name)             { threadName = name; }
+    char         *getName(void)                   { return threadName; }
+    int           getID(void)                     { return (int)(size_t)this; }
+    void          onRun(void (*callback)(void))   { onRunCallback = callback; }
+    void          setInterval(unsigned long ms)   { interval = ms; }
+    unsigned long getInterval(void)               { return interval; }
+    unsigned long runTimeMs(void)                 { return 0; }
+    bool          shouldRun(unsigned long now)    { return enabled && ((long)(now - lastRun) >= (long)interval); }
+    void          run(void)
+    {
+      lastRun = millis();
+      if(onRunCallback != NULL) onRunCallback();
+    }
+  protected:
+    char          *threadName = (char *)"";
+    void          (*onRunCallback)(void) = NULL;
+    unsigned long interval = 0;
+    unsigned long lastRun = 0;
+};
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef ThreadController_h
+#define ThreadController_h
+//
+// ThreadController shim for the host build, runs the threads that are due in the order
+// they were added.
+//
+#include <Arduino.h>
+#include "Thread.h"
+
+#define MAX_THREADS   15
+
+class ThreadController : public Thread
+{
+  public:
+    bool    add(Thread *t);
+    void    run(void);
+    Thread *get(int index);
+    Thread *get(char *name);
+  protected:
+    Thread  *thread[MAX_THREADS] = {};
+};
+
+#endif
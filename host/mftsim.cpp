@@ -0,0 +1,101 @@
+//
+// mftsim, runs the firmware in the HalSim simulator and writes the output trace.
+//
+//   mftsim [-b] trace_file [script_file]
+//
+// -b writes the binary trace, the default is VCD. The script is read from the file or
+// stdin, one line at a time:
+//   # comment, blank lines are ignored
+//   @RUN,uS                   runs the simulation for uS of virtual time
+//   @TRIG,1|2,level[,uS]      schedules a trigger input edge uS from now, default 0
+//   anything else             is sent to the USB port as a command line, the response
+//                             is printed to stdout
+//
+#include <Arduino.h>
+#include "Hal.h"
+#include "MFT.h"
+
+void setup(void);
+void loop(void);
+
+// Prints the response with the ACK and NAK characters made visible
+static void printResponse(const char *line, const std::string &resp)
+{
+  size_t n = resp.find_last_not_of("\r\n") + 1;
+
+  printf("%s -> ", line);
+  for(size_t i=0;i<n;i++)
+  {
+    if(resp[i] == 0x06) printf("<ACK>");
+    else if(resp[i] == 0x15) printf("<NAK>");
+    else if((resp[i] != '\r') && (resp[i] != '\n')) putchar(resp[i]);
+    else if(resp[i] == '\n') printf(" | ");
+  }
+  putchar('\n');
+}
+
+static bool runLine(char *line)
+{
+  float us = 0;
+  int   trig, level;
+
+  if(strncmp(line, "@RUN,", 5) == 0)
+  {
+    if(sscanf(line + 5, "%f", &us) != 1) return false;
+    halSimRun((uint64_t)(us * 1000), loop);
+    return true;
+  }
+  if(strncmp(line, "@TRIG,", 6) == 0)
+  {
+    if(sscanf(line + 6, "%d,%d,%f", &trig, &level, &us) < 2) return false;
+    if((trig < 1) || (trig > 2)) return false;
+    return halSimTrigger(trig == 1 ? Trig1 : Trig2, level, halHost.ns + (uint64_t)(us * 1000));
+  }
+  if(line[0] == '@') return false;
+  Serial.output.clear();
+  Serial.input += line;
+  Serial.input += "\n";
+  loop();
+  printResponse(line, Serial.output);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *script = stdin;
+  bool  binary = false;
+  char  line[256];
+  int   lineNum = 0;
+  int   errors = 0;
+  int   arg = 1;
+
+  if((argc > arg) && (strcmp(argv[arg], "-b") == 0)) { binary = true; arg++; }
+  if((argc - arg < 1) || (argc - arg > 2))
+  {
+    fprintf(stderr, "usage: mftsim [-b] trace_file [script_file]\n");
+    return 2;
+  }
+  if((argc - arg == 2) && ((script = fopen(argv[arg + 1], "r")) == NULL))
+  {
+    fprintf(stderr, "mftsim: can't open %s\n", argv[arg + 1]);
+    return 2;
+  }
+  setup();
+  if(!halSimOpen(argv[arg], binary))
+  {
+    fprintf(stderr, "mftsim: can't create %s\n", argv[arg]);
+    return 2;
+  }
+  while(fgets(line, sizeof(line), script) != NULL)
+  {
+    lineNum++;
+    line[strcspn(line, "\r\n")] = 0;
+    if((line[0] == 0) || (line[0] == '#')) continue;
+    if(runLine(line)) continue;
+    fprintf(stderr, "mftsim: line %d: bad script line: %s\n", lineNum, line);
+    errors++;
+  }
+  halSimClose();
+  if(script != stdin) fclose(script);
+  return errors != 0;
+}
@@ -0,0 +1,6 @@
+//
+// The sketch for the host build. The Arduino IDE joins the .ino files into one
+// translation unit with the main sketch first, this does the same.
+//
+#include "../MFT.ino"
+#include "../Hardware.ino"
@@ -0,0 +1,45 @@
+#ifndef HostTest_h
+#define HostTest_h
+//
+// Helpers for the host build tests. Each test is a program that runs the firmware
+// against the HAL mocks and returns non zero if a check failed.
+//
+#include <Arduino.h>
+#include <string>
+#include "Hal.h"
+#include "MFT.h"
+#include "Serial.h"
+#include "Errors.h"
+
+void setup(void);
+void loop(void);
+
+static int hostTestFailures = 0;
+
+#define CHECK(x) do { if(!(x)) { printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #x); hostTestFailures++; } } while(0)
+
+// Sends command lines to the USB port, runs the main loop and returns the response
+static std::string hostCommand(const char *lines)
+{
+  Serial.output.clear();
+  Serial.input += lines;
+  loop();
+  return Serial.output;
+}
+
+// Sends bytes that may include nulls, binary command frames
+static inline std::string hostCommand(const std::string &bytes)
+{
+  Serial.output.clear();
+  Serial.input += bytes;
+  loop();
+  return Serial.output;
+}
+
+static int hostTestResult(const char *name)
+{
+  printf("%s: %s\n", name, hostTestFailures == 0 ? "PASS" : "FAIL");
+  return hostTestFailures != 0;
+}
+
+#endif
@@ -0,0 +1,163 @@
+//
+// Host build test, runs the command processor, the DAC writes and the step engine
+// against the HAL mocks.
+//
+#include "HostTest.h"
+#include "ADCscan.h"
+
+// Builds a binary command frame, args are the type bytes and data
+static std::string binFrame(int id, const std::string &args)
+{
+  std::string f;
+
+  f += (char)BIN_SOF;
+  f += (char)(args.size() + 1);
+  f += (char)id;
+  f += args;
+  f += (char)ComputeCRC((uint8_t *)&f[1], f.size() - 1);
+  return f;
+}
+
+// A BIN_INT arg or value
+static std::string binInt(int32_t val)
+{
+  std::string a(1, BIN_INT);
+
+  for(int i=0;i<4;i++) a += (char)((uint32_t)val >> (8 * i));
+  return a;
+}
+
+// Builds the response frame expected for id, status and an optional value
+static std::string binResponse(int id, int status, const std::string &val)
+{
+  std::string f;
+
+  f += (char)BIN_SOF;
+  f += (char)(val.size() + 2);
+  f += (char)id;
+  f += (char)status;
+  f += val;
+  f += (char)ComputeCRC((uint8_t *)&f[1], f.size() - 1);
+  return f;
+}
+
+int main(void)
+{
+  uint32_t n;
+
+  setup();
+  // Values and errors
+  CHECK(hostCommand("GVER\n") == std::string("\x06") + Version + "\r\n");
+  CHECK(hostCommand("SFREQ,1500\n") == "\x06\n\r");
+  CHECK(hostCommand("GFREQ\n") == "\x06" "1500\r\n");
+  CHECK(hostCommand("GMAXFREQ\n") == "\x06" "25000\r\n");
+  CHECK(hostCommand("NOTACMD\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "1\r\n");
+  CHECK(hostCommand("STWV,1\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "2\r\n");
+  // Several commands on one line, one response each
+  CHECK(hostCommand("SFREQ,2000;GFREQ\n") == "\x06\n\r\x06" "2000\r\n");
+  // Trigger command strings are checked for the argument count when set
+  CHECK(hostCommand("STRGCMD1,STWV,1\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "2\r\n");
+  CHECK(hostCommand("STRGCMD1,SFREQ\n") == "\x15?\n\r");
+  CHECK(hostCommand("STRGCMD1,SFREQ,2000;STWV,1,20,3\n") == "\x15?\n\r");
+  CHECK(hostCommand("STRGCMD1,SFREQ,2000;STWV,1,20\n") == "\x06\n\r");
+  // A trigger string runs before the next queued command, not after the backlog. The
+  // TrigOut line is looped back to Trig1 so a command raises the trigger.
+  CHECK(hostCommand("TRIG1,POS,CMD\n") == "\x06\n\r");
+  halHost.onPinWrite = [](int pin, int level) { if(pin == TrigOut) halHostSetPin(Trig1, level); };
+  hostCommand("SFREQ,2000\nTRIGOUT,HIGH\nSFREQ,3000\nTRIGOUT,LOW\n");
+  halHost.onPinWrite = NULL;
+  hostCommand("");
+  CHECK(mftdata.Freq == 3000);
+  CHECK(hostCommand("SFREQ,2000\n") == "\x06\n\r");
+  // A sequence step takes one dwell
+  CHECK(hostCommand("ADDSEQ,1,11000000:2:3,01100000\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "2\r\n");
+  CHECK(hostCommand("ADDSEQ,1,11000000:2,01100000\n") == "\x06\n\r");
+  CHECK(hostCommand("GSEQ,1\n") == "\x06" "11000000:2,1100000\r\n");
+  // Request tags are sent in front of the response, a tag too long for the buffer is
+  // rejected
+  CHECK(hostCommand("STAG,TRUE\n") == "\x06\n\r");
+  CHECK(hostCommand("#abcdefghi,GFREQ\n") == "#abcdefghi,\x06" "2000\r\n");
+  CHECK(hostCommand("#abcdefghij,GFREQ\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "2\r\n");
+  CHECK(hostCommand("STAG,FALSE\n") == "\x06\n\r");
+  // A response longer than the output queue is not cut for a host that is slow to read,
+  // the full queue is sent and the rest follows. 256 steps of 11 characters
+  CHECK(hostCommand("CLRSEQ,1\n") == "\x06\n\r");
+  for(int i=0;i<16;i++)
+  {
+    std::string line = "ADDSEQ,1";
+    for(int j=0;j<16;j++) line += ",11000000:2";
+    CHECK(hostCommand((line + "\n").c_str()) == "\x06\n\r");
+  }
+  Serial.room = 0;
+  std::string seq = hostCommand("GSEQ,1\n");
+  CHECK(seq.size() == TX_BUF_SIZE);
+  Serial.room = 4096;
+  seq += hostCommand("");
+  CHECK(seq.size() == 1 + 256 * 11 + 1);
+  CHECK(seq.substr(seq.size() - 13) == ",11000000:2\r\n");
+  CHECK(hostCommand("GTXOVF\n") == "\x06" "0\r\n");
+  CHECK(hostCommand("CLRSEQ,1\n") == "\x06\n\r");
+  // A TW voltage change is written to its DAC channel
+  n = halHost.i2cWrites;
+  CHECK(hostCommand("STWV,1,20\n") == "\x06\n\r");
+  CHECK(halHost.i2cWrites == n + 1);
+  CHECK(halHost.i2cAddr == mftdata.MAX5815add);
+  CHECK((halHost.i2cBuf[0] & 0x0F) == mftdata.TW1ctrl.Chan);
+  CHECK(((halHost.i2cBuf[1] << 8) | halHost.i2cBuf[2]) == dacCodes.tw[0]);
+  // Each step sends the TW1 and TW2 words to the MAX14802 chain
+  CHECK(hostCommand("START\n") == "\x06\n\r");
+  n = halHost.spiWords;
+  halHostSteps(8);
+  CHECK(halHost.spiWords == n + 16);
+  // The open mask applies from the next step, the frame tables are not rebuilt
+  CHECK(hostCommand("SOMSK,1,11111111\n") == "\x06\n\r");
+  CHECK(hostCommand("SOPEN,1,TRUE\n") == "\x06\n\r");
+  halHostSteps(1);
+  CHECK((halHost.spiShift & 0xFFFF) == 0);
+  CHECK((halHost.spiShift >> 16) != 0);
+  CHECK(hostCommand("SOPEN,1,FALSE\n") == "\x06\n\r");
+  halHostSteps(1);
+  CHECK((halHost.spiShift & 0xFFFF) != 0);
+  CHECK(hostCommand("STOP\n") == "\x06\n\r");
+  n = halHost.spiWords;
+  halHostSteps(8);
+  CHECK(halHost.spiWords == n);
+  // The DMA descriptor chain sends the same words as the step ISR
+  CHECK(hostCommand("TDMA\n") == "\x06" "PASS\r\n");
+  // Binary mode, a valid frame sets and reads the frequency, a frame with a bad CRC is
+  // NAKed and the next frame is found, and an ASCII line runs without a response
+  int sfreq = FindCommand("SFREQ");
+  int gfreq = FindCommand("GFREQ");
+  CHECK(hostCommand("SBIN,TRUE\n") == "\x06\n\r");
+  CHECK(hostCommand(binFrame(sfreq, binInt(4000))) == binResponse(sfreq, ACK, ""));
+  CHECK(mftdata.Freq == 4000);
+  CHECK(hostCommand(binFrame(gfreq, "")) == binResponse(gfreq, ACK, binInt(4000)));
+  std::string bad = binFrame(sfreq, binInt(5000));
+  bad.back() ^= 0x55;
+  CHECK(hostCommand(bad + binFrame(gfreq, "")) == binResponse(0xFF, NAK, binInt(ERR_BADCRC)) + binResponse(gfreq, ACK, binInt(4000)));
+  CHECK(mftdata.Freq == 4000);
+  CHECK(hostCommand("SFREQ,2000\n") == "");
+  CHECK(mftdata.Freq == 2000);
+  int sbin = FindCommand("SBIN");
+  CHECK(hostCommand(binFrame(sbin, std::string("sFALSE", 7))) == binResponse(sbin, ACK, ""));
+  CHECK(hostCommand("GFREQ\n") == "\x06" "2000\r\n");
+  // The sync sample delay is kept inside the step period when the frequency goes up, and
+  // DMA playback is refused while the sync sampling needs the step interrupt
+  CHECK(hostCommand("SSYNC,0,40\n") == "\x06\n\r");
+  CHECK(adcSync.ticks == 24 * 40 - 1);
+  CHECK(hostCommand("SFREQ,20000\n") == "\x06\n\r");
+  CHECK(adcSync.ticks == 24 * 5 - 1);
+  CHECK(hostCommand("GSYNC\n") == "\x06" "0,40\r\n");
+  CHECK(hostCommand("SFREQ,2000\n") == "\x06\n\r");
+  CHECK(adcSync.ticks == 24 * 40 - 1);
+  CHECK(hostCommand("SSYNCENA,TRUE\n") == "\x06\n\r");
+  CHECK(hostCommand("SDMA,TRUE\n") == "\x15?\n\r");
+  CHECK(hostCommand("GERR\n") == "\x06" "122\r\n");
+  CHECK(hostCommand("SSYNCENA,FALSE\n") == "\x06\n\r");
+  return hostTestResult("commands");
+}
@@ -0,0 +1,168 @@
+//
+// Host build test, runs the step engine in the HalSim simulator and checks the
+// MAX14802 frames in the binary trace against the words expected for the bit patterns,
+// and the frame and TrigOut timing of a triggered burst.
+//
+#include "HostTest.h"
+#include <vector>
+
+#define STEP_NS   12500     // 10 kHz, 8 steps per cycle
+#define SIGS      7         // TW1, TW2, DAC0 to DAC3, TrigOut
+
+typedef struct
+{
+  uint64_t  ns;
+  uint32_t  val;
+} Latch;
+
+// The MAX14802 word for an 8 bit wave, the high byte drives the inverted outputs
+static uint32_t twWord(int wave)
+{
+  return (wave & 0xFF) | ((~wave & 0xFF) << 8);
+}
+
+// Wave for a step, forward rotates the pattern right one bit per step, reverse left
+static int twStep(int pattern, bool fwd, int step)
+{
+  step &= 7;
+  if(fwd) return ((pattern >> step) | (pattern << (8 - step))) & 0xFF;
+  return ((pattern << step) | (pattern >> (8 - step))) & 0xFF;
+}
+
+// Reads the records of the first SIGS signals from a binary trace
+static bool readTrace(const char *fileName, std::vector<Latch> *sig)
+{
+  FILE    *f;
+  uint8_t rec[13];
+  Latch   l;
+
+  if((f = fopen(fileName, "rb")) == NULL) return false;
+  if((fread(rec, 1, 8, f) != 8) || (memcmp(rec, "MFTT", 4) != 0)) { fclose(f); return false; }
+  while(fread(rec, 1, sizeof(rec), f) == sizeof(rec))
+  {
+    if(rec[8] >= SIGS) continue;
+    l.ns = 0;
+    for(int i=7;i>=0;i--) l.ns = (l.ns << 8) | rec[i];
+    l.val = 0;
+    for(int i=3;i>=0;i--) l.val = (l.val << 8) | rec[9 + i];
+    sig[rec[8]].push_back(l);
+  }
+  fclose(f);
+  return true;
+}
+
+int main(void)
+{
+  const char         *trace = "test_sim.trace";
+  std::vector<Latch> tw[SIGS];
+  int                start = -1;
+  uint64_t           t;
+
+  setup();
+  CHECK(hostCommand("STOP\n") == "\x06\n\r");
+  CHECK(hostCommand("SFREQ,10000\n") == "\x06\n\r");
+  CHECK(hostCommand("SFWD,1,TRUE\n") == "\x06\n\r");
+  CHECK(hostCommand("SFWD,2,FALSE\n") == "\x06\n\r");
+  CHECK(hostCommand("SFWDPS,1,0\n") == "\x06\n\r");
+  CHECK(hostCommand("SREVPS,2,0\n") == "\x06\n\r");
+  CHECK(hostCommand("SPTRN,1,11100000\n") == "\x06\n\r");
+  CHECK(hostCommand("SPTRN,2,11000011\n") == "\x06\n\r");
+  CHECK(hostCommand("START\n") == "\x06\n\r");
+  // Let the new frames take effect at a cycle boundary, then trace two cycles. The
+  // first run ends on a step so the second traces the next 16
+  halSimRun(4 * 8 * STEP_NS, loop);
+  CHECK(halSimOpen(trace, true));
+  halSimRun(16 * STEP_NS, loop);
+  halSimClose();
+  CHECK(readTrace(trace, tw));
+  remove(trace);
+  CHECK(tw[0].size() == 16);
+  CHECK(tw[1].size() == 16);
+  if((tw[0].size() == 16) && (tw[1].size() == 16))
+  {
+    // Find the step the trace starts on from TW1, both channels step together
+    for(int s=0;s<8;s++) if(tw[0][0].val == twWord(twStep(0xE0, true, s))) start = s;
+    CHECK(start >= 0);
+    for(int i=0;i<16;i++)
+    {
+      CHECK(tw[0][i].val == twWord(twStep(0xE0, true, start + i)));
+      CHECK(tw[1][i].val == twWord(twStep(0xC3, false, start + i)));
+      CHECK(tw[0][i].ns == tw[1][i].ns);
+      if(i > 0) CHECK(tw[0][i].ns - tw[0][i-1].ns == STEP_NS);
+    }
+  }
+  // Stop part way into a step period, a triggered burst must still start a full period
+  halSimRun(STEP_NS / 3, loop);
+  CHECK(hostCommand("STOP\n") == "\x06\n\r");
+  CHECK(hostCommand("SBSTCYC,1\n") == "\x06\n\r");
+  CHECK(hostCommand("SBSTTRG,TRUE\n") == "\x06\n\r");
+  CHECK(hostCommand("TRIG1,POS,BURST\n") == "\x06\n\r");
+  CHECK(hostCommand("BSTARM\n") == "\x06\n\r");
+  for(int i=0;i<SIGS;i++) tw[i].clear();
+  CHECK(halSimOpen(trace, true));
+  t = halHost.ns + 1000;
+  CHECK(halSimTrigger(Trig1, 1, t));
+  halSimRun(12 * STEP_NS, loop);
+  halSimClose();
+  CHECK(readTrace(trace, tw));
+  remove(trace);
+  // One cycle of frames from the trigger ISR, then a 5uS TrigOut pulse on the last one
+  CHECK(tw[0].size() == 8);
+  for(size_t i=0;i<tw[0].size();i++) CHECK(tw[0][i].ns == t + i * STEP_NS);
+  CHECK(tw[6].size() == 2);
+  if(tw[6].size() == 2)
+  {
+    CHECK((tw[6][0].ns == t + 7 * STEP_NS) && (tw[6][0].val == 1));
+    CHECK((tw[6][1].ns == t + 7 * STEP_NS + 5000) && (tw[6][1].val == 0));
+  }
+  // A direction trigger mid cycle takes effect on the next step in the CYCLE update mode
+  halHostSetPin(Trig1, 0);
+  CHECK(hostCommand("SREVPS,1,0\n") == "\x06\n\r");
+  CHECK(hostCommand("TRIG1,POS,REV1\n") == "\x06\n\r");
+  CHECK(hostCommand("START\n") == "\x06\n\r");
+  for(int i=0;i<SIGS;i++) tw[i].clear();
+  CHECK(halSimOpen(trace, true));
+  t = halHost.ns + 12 * STEP_NS + 1000;
+  CHECK(halSimTrigger(Trig1, 1, t));
+  halSimRun(24 * STEP_NS, loop);
+  halSimClose();
+  CHECK(readTrace(trace, tw));
+  remove(trace);
+  // The waves are the same 4 steps from the pattern start, so check the next two steps
+  start = -1;
+  for(size_t i=1;i+1<tw[0].size();i++)
+  {
+    if((tw[0][i-1].ns > t) || (tw[0][i].ns <= t)) continue;
+    for(int s=0;s<8;s++) if(tw[0][i-1].val == twWord(twStep(0xE0, true, s))) start = s;
+    CHECK(start >= 0);
+    CHECK(tw[0][i].val == twWord(twStep(0xE0, false, start + 1)));
+    CHECK(tw[0][i+1].val == twWord(twStep(0xE0, false, start + 2)));
+  }
+  CHECK(start >= 0);
+  // A triggered TW voltage ramp steps the DAC up every mS from the ramp timer, TrigOut
+  // pulses at its start and end
+  halHostSetPin(Trig1, 0);
+  CHECK(hostCommand("SRAMP,TWV,1,10,20,5,LIN\n") == "\x06\n\r");
+  CHECK(hostCommand("TRIG1,POS,RAMP\n") == "\x06\n\r");
+  CHECK(hostCommand("ARMRAMP\n") == "\x06\n\r");
+  for(int i=0;i<SIGS;i++) tw[i].clear();
+  CHECK(halSimOpen(trace, true));
+  CHECK(halSimTrigger(Trig1, 1, halHost.ns + 1000));
+  halSimRun(8000000, loop);
+  halSimClose();
+  CHECK(readTrace(trace, tw));
+  remove(trace);
+  std::vector<Latch> &dac = tw[2 + mftdata.TW1ctrl.Chan];
+  CHECK(dac.size() >= 5);
+  for(size_t i=1;i<dac.size();i++)
+  {
+    CHECK(dac[i].val > dac[i-1].val);
+    // The first update is at the trigger, the ticks are on the uS counts of the timer
+    if(i > 1) CHECK(dac[i].ns - dac[i-1].ns == 1000000);
+  }
+  CHECK(mftdata.TWvoltage[0] == 20);
+  CHECK(!dac.empty() && (dac.back().val == dacCodes.tw[0]));
+  CHECK(tw[6].size() == 4);
+  CHECK(hostCommand("GRAMPSTAT\n") == "\x06" "IDLE\r\n");
+  return hostTestResult("sim");
+}
@@ -0,0 +1 @@
+// wiring_private.h shim for the host build, nothing from it is used